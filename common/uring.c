@@ -0,0 +1,553 @@
+/*
+ * A small io_uring wrapper over the raw system calls. See uring.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#if HAVE_IO_URING
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min,
+                              unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, fd, to_submit, min, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned op, const void *arg,
+                                 unsigned nr_args)
+{
+  return syscall(__NR_io_uring_register, fd, op, arg, nr_args);
+}
+
+int uring_init(uring *r, unsigned entries, unsigned flags)
+{
+  struct io_uring_params p;
+  unsigned *array, i;
+
+  memset(r, 0, sizeof(*r));
+
+  /* Multishot operations can post many completions per submission */
+  for (;;) {
+    memset(&p, 0, sizeof(p));
+    p.flags = flags | IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    r->fd = sys_io_uring_setup(entries, &p);
+    if (r->fd >= 0 || errno != EINVAL || flags == 0)
+      break;
+    flags = 0;
+  }
+  if (r->fd < 0)
+    return -1;
+
+  r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_ring_sz > r->sq_ring_sz)
+      r->sq_ring_sz = r->cq_ring_sz;
+    r->cq_ring_sz = 0;
+  }
+
+  r->sq_ring = mmap(NULL, r->sq_ring_sz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED)
+    goto fail;
+  if (r->cq_ring_sz == 0) {
+    r->cq_ring = r->sq_ring;
+  } else {
+    r->cq_ring = mmap(NULL, r->cq_ring_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED)
+      goto fail;
+  }
+
+  r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+    goto fail;
+
+  r->sq_entries = p.sq_entries;
+  r->sq_head = (unsigned *) ((char *) r->sq_ring + p.sq_off.head);
+  r->sq_tail = (unsigned *) ((char *) r->sq_ring + p.sq_off.tail);
+  r->sq_mask = (unsigned *) ((char *) r->sq_ring + p.sq_off.ring_mask);
+  r->cq_head = (unsigned *) ((char *) r->cq_ring + p.cq_off.head);
+  r->cq_tail = (unsigned *) ((char *) r->cq_ring + p.cq_off.tail);
+  r->cq_mask = (unsigned *) ((char *) r->cq_ring + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ring + p.cq_off.cqes);
+  r->sqe_tail = *r->sq_tail;
+
+  /* Entries are always used in order, so the index array never changes */
+  array = (unsigned *) ((char *) r->sq_ring + p.sq_off.array);
+  for (i = 0; i < p.sq_entries; i++)
+    array[i] = i;
+  return 0;
+
+fail:
+  uring_exit(r);
+  return -1;
+}
+
+void uring_exit(uring *r)
+{
+  if (r->sqes != NULL && r->sqes != MAP_FAILED)
+    munmap(r->sqes, r->sqes_sz);
+  if (r->cq_ring_sz > 0 && r->cq_ring != NULL && r->cq_ring != MAP_FAILED)
+    munmap(r->cq_ring, r->cq_ring_sz);
+  if (r->sq_ring != NULL && r->sq_ring != MAP_FAILED)
+    munmap(r->sq_ring, r->sq_ring_sz);
+  if (r->fd >= 0)
+    close(r->fd);
+  r->sqes = NULL;
+  r->sq_ring = r->cq_ring = NULL;
+  r->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring *r)
+{
+  struct io_uring_sqe *sqe;
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+  if (r->sqe_tail - head >= r->sq_entries) {
+    if (uring_submit(r, 0) < 0)
+      return NULL;
+    head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sqe_tail - head >= r->sq_entries) {
+      errno = EBUSY;
+      return NULL;
+    }
+  }
+
+  sqe = &r->sqes[r->sqe_tail & *r->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sqe_tail++;
+  return sqe;
+}
+
+int uring_submit(uring *r, unsigned wait_nr)
+{
+  unsigned to_submit;
+  int ret;
+
+  __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+
+  /*
+   * Whatever the kernel has not taken yet is still between its head
+   * and our tail, even after an interrupted wait
+   */
+  do {
+    to_submit = r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    r->enters++;
+    ret = sys_io_uring_enter(r->fd, to_submit, wait_nr,
+                             IORING_ENTER_GETEVENTS);
+  } while (ret < 0 && errno == EINTR);
+
+  return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring *r)
+{
+  unsigned head = *r->cq_head;
+
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(uring *r)
+{
+  __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_register_buffers(uring *r, const struct iovec *iov, unsigned n)
+{
+  return sys_io_uring_register(r->fd, IORING_REGISTER_BUFFERS, iov, n);
+}
+
+int uring_unregister_buffers(uring *r)
+{
+  return sys_io_uring_register(r->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+}
+
+int uring_bufs_init(uring *r, uring_bufs *b, unsigned entries, int bgid)
+{
+  struct io_uring_buf_reg reg;
+  size_t size = entries * sizeof(struct io_uring_buf);
+
+  b->br = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (b->br == MAP_FAILED) {
+    b->br = NULL;
+    return -1;
+  }
+  b->entries = entries;
+  b->tail = 0;
+  b->bgid = bgid;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long) b->br;
+  reg.ring_entries = entries;
+  reg.bgid = bgid;
+  if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    munmap(b->br, size);
+    b->br = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+void uring_bufs_add(uring_bufs *b, void *addr, unsigned len, int bid)
+{
+  struct io_uring_buf *buf = &b->br->bufs[b->tail++ & (b->entries - 1)];
+
+  buf->addr = (unsigned long) addr;
+  buf->len = len;
+  buf->bid = bid;
+}
+
+void uring_bufs_publish(uring_bufs *b)
+{
+  __atomic_store_n(&b->br->tail, (unsigned short) b->tail, __ATOMIC_RELEASE);
+}
+
+void uring_bufs_free(uring *r, uring_bufs *b)
+{
+  struct io_uring_buf_reg reg;
+
+  if (b->br == NULL)
+    return;
+  memset(&reg, 0, sizeof(reg));
+  reg.bgid = b->bgid;
+  sys_io_uring_register(r->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  munmap(b->br, b->entries * sizeof(struct io_uring_buf));
+  b->br = NULL;
+}
+
+/*
+ * One buffer of uring_copy() and the piece of the file it is moving
+ */
+typedef struct {
+  int       busy;    /* A read or write is in flight */
+  int       full;    /* Holds data that still has to be written */
+  long long seq;     /* Order the data was read in */
+  long long off;     /* Offset in the file of byte 0 */
+  size_t    want;    /* Bytes to read into it */
+  size_t    len;     /* Bytes in it */
+  size_t    done;    /* Bytes read, then bytes written */
+} copy_slot;
+
+static int queue_rw(uring *r, int op, int fd, int fixed, int i, char *buf,
+                    size_t len, long long off)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(r);
+
+  if (sqe == NULL)
+    return -1;
+  if (fixed) {
+    sqe->opcode = op == IORING_OP_READ ? IORING_OP_READ_FIXED
+                                       : IORING_OP_WRITE_FIXED;
+    sqe->buf_index = i;
+  } else {
+    sqe->opcode = op;
+  }
+  sqe->fd = fd;
+  sqe->addr = (unsigned long) buf;
+  sqe->len = len;
+  sqe->off = off;
+  sqe->user_data = i;
+  return 0;
+}
+
+long long uring_copy(uring *r, int in, int out, int nbufs, size_t bufsz)
+{
+  struct stat st;
+  struct iovec *iov = NULL;
+  struct io_uring_cqe *cqe;
+  copy_slot *slots = NULL, *s;
+  char *bufs = NULL;
+  long long size = -1, next_off = 0, read_seq = 0, write_seq = 0;
+  long long in_total = 0, copied = 0, ret = -1;
+  int in_pos, out_pos, fixed = 0, eof = 0, reading = 0, writing = 0;
+  int inflight = 0, i, res, err = 0;
+
+  /*
+   * Files in /proc say they are empty, so only a regular file with a
+   * size is read at offsets
+   */
+  in_pos = fstat(in, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0;
+  if (in_pos)
+    size = st.st_size;
+  out_pos = fstat(out, &st) == 0 && S_ISREG(st.st_mode);
+
+  slots = calloc(nbufs, sizeof(copy_slot));
+  iov = calloc(nbufs, sizeof(struct iovec));
+  if (slots == NULL || iov == NULL ||
+      posix_memalign((void **) &bufs, 4096, nbufs * bufsz) != 0) {
+    bufs = NULL;
+    err = ENOMEM;
+    goto out;
+  }
+  for (i = 0; i < nbufs; i++) {
+    iov[i].iov_base = bufs + i * bufsz;
+    iov[i].iov_len = bufsz;
+  }
+  /* Pinning can run into RLIMIT_MEMLOCK, plain reads work regardless */
+  fixed = uring_register_buffers(r, iov, nbufs) == 0;
+
+  for (;;) {
+    /* Start reads into every idle buffer the input can fill */
+    for (i = 0; i < nbufs && !eof; i++) {
+      s = &slots[i];
+      if (s->busy || s->full)
+        continue;
+      if (in_pos) {
+        if (next_off >= size) {
+          eof = 1;
+          break;
+        }
+        s->off = next_off;
+        s->want = size - next_off < (long long) bufsz ? size - next_off
+                                                      : bufsz;
+        next_off += s->want;
+      } else {
+        /* A pipe or device has no offsets, so one read at a time */
+        if (reading)
+          break;
+        s->off = -1;
+        s->want = bufsz;
+        reading = 1;
+      }
+      s->seq = read_seq++;
+      s->done = 0;
+      s->busy = 1;
+      inflight++;
+      if (queue_rw(r, IORING_OP_READ, in, fixed, i, iov[i].iov_base,
+                   s->want, s->off) < 0)
+        goto fail;
+    }
+
+    /* And writes of every full buffer the output can take now */
+    for (i = 0; i < nbufs; i++) {
+      s = &slots[i];
+      if (s->busy || !s->full)
+        continue;
+      if (!out_pos && (writing || s->seq != write_seq))
+        continue;
+      s->busy = 1;
+      writing = !out_pos;
+      inflight++;
+      if (queue_rw(r, IORING_OP_WRITE, out, fixed, i,
+                   (char *) iov[i].iov_base + s->done, s->len - s->done,
+                   out_pos ? s->off + (long long) s->done : -1) < 0)
+        goto fail;
+    }
+
+    /* Everything in flight completes on its own, so waiting for half
+     * of it can not hang and saves entering the kernel for each one */
+    if (inflight == 0)
+      break;
+    if (uring_submit(r, (inflight + 1) / 2) < 0)
+      goto fail;
+
+    while ((cqe = uring_peek_cqe(r)) != NULL) {
+      i = cqe->user_data;
+      res = cqe->res;
+      uring_cqe_seen(r);
+      s = &slots[i];
+      s->busy = 0;
+      inflight--;
+
+      if (res == -EINTR || res == -EAGAIN) {
+        /* Nothing moved, go again from the same place */
+        if (s->full) {
+          writing = 0;
+        } else if (in_pos) {
+          s->busy = 1;
+          inflight++;
+          if (queue_rw(r, IORING_OP_READ, in, fixed, i,
+                       (char *) iov[i].iov_base + s->done,
+                       s->want - s->done, s->off + s->done) < 0)
+            goto fail;
+        } else {
+          reading = 0;
+          read_seq--;
+        }
+        continue;
+      }
+      if (res < 0 || (s->full && res == 0)) {
+        err = res < 0 ? -res : EIO;
+        goto drain;
+      }
+
+      if (!s->full) {
+        /* A read */
+        if (!in_pos) {
+          reading = 0;
+          if (res == 0) {
+            eof = 1;
+            read_seq--;
+            continue;
+          }
+          s->off = in_total;
+          in_total += res;
+          s->len = res;
+          s->done = 0;
+          s->full = 1;
+          continue;
+        }
+        s->done += res;
+        if (res == 0 && s->done < s->want) {
+          /* The file shrank under us, stop at what it has now */
+          s->want = s->done;
+          eof = 1;
+        }
+        if (s->done < s->want) {
+          s->busy = 1;
+          inflight++;
+          if (queue_rw(r, IORING_OP_READ, in, fixed, i,
+                       (char *) iov[i].iov_base + s->done,
+                       s->want - s->done, s->off + s->done) < 0)
+            goto fail;
+          continue;
+        }
+        s->len = s->done;
+        s->done = 0;
+        s->full = s->len > 0;
+        continue;
+      }
+
+      /* A write. A pipe or socket can take less than asked, so the
+       * rest goes out next, before anything after it */
+      s->done += res;
+      if (s->done < s->len) {
+        s->busy = 1;
+        inflight++;
+        if (queue_rw(r, IORING_OP_WRITE, out, fixed, i,
+                     (char *) iov[i].iov_base + s->done, s->len - s->done,
+                     out_pos ? s->off + (long long) s->done : -1) < 0)
+          goto fail;
+        continue;
+      }
+      copied += s->len;
+      s->full = 0;
+      if (!out_pos) {
+        writing = 0;
+        write_seq++;
+      }
+    }
+  }
+
+  /* Nothing left in flight with data still to write would be lost */
+  for (i = 0; i < nbufs; i++)
+    if (slots[i].full) {
+      err = EIO;
+      goto out;
+    }
+  ret = copied;
+  goto out;
+
+fail:
+  err = errno;
+drain:
+  /* The buffers can not go away under operations still in flight */
+  while (inflight > 0 && uring_submit(r, 1) >= 0) {
+    while ((cqe = uring_peek_cqe(r)) != NULL) {
+      uring_cqe_seen(r);
+      inflight--;
+    }
+  }
+out:
+  if (bufs != NULL && fixed)
+    uring_unregister_buffers(r);
+  free(bufs);
+  free(iov);
+  free(slots);
+  if (ret < 0)
+    errno = err;
+  return ret;
+}
+
+#else /* !HAVE_IO_URING */
+
+int uring_init(uring *r, unsigned entries, unsigned flags)
+{
+  memset(r, 0, sizeof(*r));
+  r->fd = -1;
+  errno = ENOSYS;
+  return -1;
+}
+
+void uring_exit(uring *r)
+{
+}
+
+struct io_uring_sqe *uring_get_sqe(uring *r)
+{
+  errno = ENOSYS;
+  return NULL;
+}
+
+int uring_submit(uring *r, unsigned wait_nr)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring *r)
+{
+  return NULL;
+}
+
+void uring_cqe_seen(uring *r)
+{
+}
+
+int uring_register_buffers(uring *r, const struct iovec *iov, unsigned n)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+int uring_unregister_buffers(uring *r)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+int uring_bufs_init(uring *r, uring_bufs *b, unsigned entries, int bgid)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+void uring_bufs_add(uring_bufs *b, void *addr, unsigned len, int bid)
+{
+}
+
+void uring_bufs_publish(uring_bufs *b)
+{
+}
+
+void uring_bufs_free(uring *r, uring_bufs *b)
+{
+}
+
+long long uring_copy(uring *r, int in, int out, int nbufs, size_t bufsz)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+#endif
@@ -1,8 +1,9 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
-#define NUM_THREADS  3
+#define NUM_THREADS  3  /* Default number of threads */
 
 typedef struct thread_args {
   int tid;
@@ -10,7 +11,7 @@ typedef struct thread_args {
   int loop;
 } thread_args ;
 
-int count = 0;
+long count = 0;
 pthread_mutex_t count_mutex;
 
 /*
@@ -42,22 +43,33 @@ void *inc_count(void *arg)
 
 int main(int argc, char *argv[])
 {
-  int i, loop, inc;
+  int i, loop, inc, num_threads;
   struct thread_args *targs;
-  pthread_t threads[NUM_THREADS];
+  pthread_t *threads;
   pthread_attr_t attr;
+  struct timespec start, end;
+  double elapsed;
 
-  if (argc != 3) {
-    printf("Usage: ./ptcount_atomic LOOP_BOUND INCREMENT\n");
+  if (argc != 3 && argc != 4) {
+    printf("Usage: ./ptcount_atomic LOOP_BOUND INCREMENT [NUM_THREADS]\n");
     exit(0);
   }
 
   /*
    * First argument is how many times to loop. The second is how much
-   * to increment each time.
+   * to increment each time. The optional third is how many threads
+   * to create.
    */
   loop = atoi(argv[1]);
   inc = atoi(argv[2]);
+  num_threads = argc == 4 ? atoi(argv[3]) : NUM_THREADS;
+
+  if (num_threads < 1) {
+    printf("NUM_THREADS must be at least 1\n");
+    exit(0);
+  }
+
+  threads = malloc(num_threads * sizeof(pthread_t));
 
   /* Initialize mutex */
   pthread_mutex_init(&count_mutex, NULL);
@@ -70,9 +82,10 @@ int main(int argc, char *argv[])
    * each thread should be inc_count. The attribute object should be
    * attr. You should pass as the thread's sole argument the populated
    * targs struct. Note we create a different copy of it for each
-   * thread.
+   * thread. Time everything from the first create to the last join.
    */
-  for (i = 0; i < NUM_THREADS; i++) {
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < num_threads; i++) {
     targs = malloc(sizeof(thread_args));
     targs->tid = i;
     targs->loop = loop;
@@ -84,16 +97,22 @@ int main(int argc, char *argv[])
   /* Wait for all threads to complete using pthread_join.  The threads
    * do not return anything on exit, so the second argument is NULL
    */
-  for (i = 0; i < NUM_THREADS; i++) {
+  for (i = 0; i < num_threads; i++) {
     /* Make call to pthread_join here */
     pthread_join(threads[i], NULL);
   }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  printf ("Main(): Waited on %d threads. Final value of count = %ld. Done.\n",
+          num_threads, count);
 
-  printf ("Main(): Waited on %d threads. Final value of count = %d. Done.\n",
-          NUM_THREADS, count);
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf ("Main(): ptcount_atomic: %.3f s, %.1f million increments/s\n",
+          elapsed, (double) loop * num_threads / elapsed / 1e6);
 
   /* Clean up and exit */
   pthread_attr_destroy(&attr);
+  free(threads);
   pthread_mutex_destroy(&count_mutex);
   pthread_exit (NULL);
 }
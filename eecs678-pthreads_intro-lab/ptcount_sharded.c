@@ -0,0 +1,135 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NUM_THREADS  3  /* Default number of threads */
+#define CACHE_LINE   64
+
+typedef struct thread_args {
+  int tid;
+  int inc;
+  int loop;
+} thread_args;
+
+/*
+ * Each thread counts into its own shard. The shards are padded out to
+ * a full cache line so that no two threads ever write to the same
+ * line, which is what makes the shared count in ptcount_mutex and
+ * ptcount_atomic slow down as threads are added.
+ */
+typedef struct shard {
+  long count;
+} __attribute__((aligned(CACHE_LINE))) shard;
+
+shard *shards;
+long count = 0;
+
+/*
+ * This routine will be executed by each thread we choose to create.
+ * The routine a new thread will execute is given as an arguent to the
+ * pthread_create() call.
+ */
+void *inc_count(void *arg)
+{
+  int i,loc;
+  long sum = 0;
+  thread_args *my_args = (thread_args*) arg;
+  shard *my_shard = &shards[my_args->tid];
+
+  loc = 0;
+  for (i = 0; i < my_args->loop; i++) {
+    /*
+     * No other thread writes to this shard, so it needs no critical
+     * section protection. The running sum stays in a register and is
+     * stored to the shard on every iteration; the atomic store keeps
+     * the compiler from turning the loop into a single addition, so
+     * each strategy still makes one update to memory per increment.
+     */
+    sum += my_args->inc;
+    __atomic_store_n(&my_shard->count, sum, __ATOMIC_RELAXED);
+    loc = loc + my_args->inc;
+  }
+  printf("Thread: %d finished. Counted: %d\n", my_args->tid, loc);
+  free(my_args);
+  pthread_exit(NULL);
+}
+
+int main(int argc, char *argv[])
+{
+  int i, loop, inc, num_threads;
+  struct thread_args *targs;
+  pthread_t *threads;
+  pthread_attr_t attr;
+  struct timespec start, end;
+  double elapsed;
+
+  if (argc != 3 && argc != 4) {
+    printf("Usage: ./ptcount_sharded LOOP_BOUND INCREMENT [NUM_THREADS]\n");
+    exit(0);
+  }
+
+  /*
+   * First argument is how many times to loop. The second is how much
+   * to increment each time. The optional third is how many threads
+   * to create.
+   */
+  loop = atoi(argv[1]);
+  inc = atoi(argv[2]);
+  num_threads = argc == 4 ? atoi(argv[3]) : NUM_THREADS;
+
+  if (num_threads < 1) {
+    printf("NUM_THREADS must be at least 1\n");
+    exit(0);
+  }
+
+  threads = malloc(num_threads * sizeof(pthread_t));
+
+  /* Allocate one zeroed, cache line aligned shard per thread */
+  if (posix_memalign((void **) &shards, CACHE_LINE,
+                     num_threads * sizeof(shard)) != 0) {
+    printf("Failed to allocate the shards\n");
+    exit(1);
+  }
+
+  for (i = 0; i < num_threads; i++)
+    shards[i].count = 0;
+
+  /* For portability, explicitly create threads in a joinable state */
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+  /* Create each thread using pthread_create. Time everything from the
+   * first create to the last join, including summing the shards.
+   */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < num_threads; i++) {
+    targs = malloc(sizeof(thread_args));
+    targs->tid = i;
+    targs->loop = loop;
+    targs->inc = inc;
+    pthread_create(&threads[i], &attr, inc_count, (void *)targs);
+  }
+
+  /* Wait for all threads to complete using pthread_join, adding each
+   * thread's shard into the total once the thread is done with it
+   */
+  for (i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+    count += shards[i].count;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  printf ("Main(): Waited on %d threads. Final value of count = %ld. Done.\n",
+          num_threads, count);
+
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf ("Main(): ptcount_sharded: %.3f s, %.1f million increments/s\n",
+          elapsed, (double) loop * num_threads / elapsed / 1e6);
+
+  /* Clean up and exit */
+  pthread_attr_destroy(&attr);
+  free(threads);
+  free(shards);
+  pthread_exit (NULL);
+}
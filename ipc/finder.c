@@ -1,9 +1,22 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <string.h>
 #include <strings.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <locale.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define BSIZE 256
 
@@ -14,119 +27,729 @@
 #define SORT_EXEC  "/usr/bin/sort"
 #define HEAD_EXEC  "/usr/bin/head"
 
-int main(int argc, char *argv[])
+#define MAX_THREADS 64
+#define DENTS_BSIZE 32768
+#define MMAP_MIN 65536   /* Smaller files are read, mmap costs more */
+#define LINE_MAX_LEN 4096
+
+/* grep takes STR as a basic regular expression with these specials */
+#define REGEX_CHARS ".[]*^$\\\n"
+
+/*
+ * Every process has to drop the pipe ends it does not use, or a reader
+ * never sees the end of its input and a writer never gets SIGPIPE once
+ * head has all it wants
+ */
+void close_pipes(int p1[2], int p2[2], int p3[2])
+{
+  close(p1[0]);
+  close(p1[1]);
+  close(p2[0]);
+  close(p2[1]);
+  close(p3[0]);
+  close(p3[1]);
+}
+
+/*
+ * The original way: find | xargs grep -c | sort | head, each run by a
+ * shell in its own process
+ */
+int run_pipeline(char *dir, char *str, char *num)
 {
   int status;
   pid_t pid_1, pid_2, pid_3, pid_4;
+  int p1[2];
+  int p2[2];
+  int p3[2];
+
+  pipe(p1);
+  pipe(p2);
+  pipe(p3);
 
-  if (argc != 4) {
-    printf("usage: finder DIR STR NUM_FILES\n");
+  pid_1 = fork();
+  if (pid_1 == 0) {
+    /* First Child */
+    char cmdbuf[BSIZE];
+    bzero(cmdbuf, BSIZE);
+    sprintf(cmdbuf, "%s %s -name \'*\'.[ch]", FIND_EXEC, dir);
+    dup2(p1[1], STDOUT_FILENO);
+    close_pipes(p1, p2, p3);
+    char *myArgs[] = {BASH_EXEC, "-c", cmdbuf, (char*) 0};
+    if ((execv(BASH_EXEC, myArgs)) < 0) {
+      fprintf(stderr, "\nError execing find. ERROR#%d\n", errno);
+      return (EXIT_FAILURE);
+    }
     exit(0);
   }
 
-    int p1[2];
-  	int p2[2];
-  	int p3[2];
-
-  	pipe(p1);
-  	pipe(p2);
-  	pipe(p3);
-
-
-      pid_1 = fork();
-      if (pid_1 == 0)
-      {
-      /* First Child */
-          char cmdbuf[BSIZE];
-          bzero(cmdbuf, BSIZE);
-          sprintf(cmdbuf, "%s %s -name \'*\'.[ch]", FIND_EXEC, argv[1]);
-          dup2(p1[1], STDOUT_FILENO);
-          char *myArgs[] = {BASH_EXEC, "-c", cmdbuf, (char*) 0};
-          if((execv(BASH_EXEC, myArgs))< 0)
-          {
-              fprintf(stderr, "\nError execing find. ERROR#%d\n", errno);
-              return (EXIT_FAILURE);
-          }
-          exit(0);
-      }
+  pid_2 = fork();
+  if (pid_2 == 0) {
+    /* Second Child */
+    char cmdbuf[BSIZE];
+    bzero(cmdbuf, BSIZE);
+    sprintf(cmdbuf, "%s %s -c %s", XARGS_EXEC, GREP_EXEC, str);
+    dup2(p1[0], STDIN_FILENO);
+    dup2(p2[1], STDOUT_FILENO);
+    close_pipes(p1, p2, p3);
+    char *myArgs[] = {BASH_EXEC, "-c", cmdbuf, (char*) 0};
+    if ((execv(BASH_EXEC, myArgs)) < 0) {
+      fprintf(stderr, "\nError execing find. ERROR#%d\n", errno);
+      return (EXIT_FAILURE);
+    }
+    exit(0);
+  }
 
-      pid_2 = fork();
-      if (pid_2 == 0) {
-      /* Second Child */
-      char cmdbuf[BSIZE];
-      bzero(cmdbuf, BSIZE);
-      sprintf(cmdbuf, "%s %s -c %s", XARGS_EXEC, GREP_EXEC, argv[2]);
-      dup2(p1[0], STDIN_FILENO);
-      dup2(p2[1], STDOUT_FILENO);
-      close(p1[1]);
-      char *myArgs[] = {BASH_EXEC, "-c", cmdbuf, (char*) 0};
-          if((execv(BASH_EXEC, myArgs))< 0)
-          {
-              fprintf(stderr, "\nError execing find. ERROR#%d\n", errno);
-              return (EXIT_FAILURE);
-          }
-          exit(0);
-      }
+  pid_3 = fork();
+  if (pid_3 == 0) {
+    /* Third Child */
+    char cmdbuf[BSIZE];
+    bzero(cmdbuf, BSIZE);
+    sprintf(cmdbuf, "%s -t : +1.0 -2.0 --numeric --reverse", SORT_EXEC);
+    dup2(p2[0], STDIN_FILENO);
+    dup2(p3[1], STDOUT_FILENO);
+    close_pipes(p1, p2, p3);
+    char *myArgs[] = {BASH_EXEC, "-c", cmdbuf, (char*) 0};
+    if ((execv(BASH_EXEC, myArgs)) < 0) {
+      fprintf(stderr, "\nError execing find. ERROR#%d\n", errno);
+      return EXIT_FAILURE;
+    }
+    exit(0);
+  }
 
-      pid_3 = fork();
-      if (pid_3 == 0) {
-      /* Third Child */
-      char cmdbuf[BSIZE];
-      bzero(cmdbuf, BSIZE);
-      sprintf(cmdbuf, "%s -t : +1.0 -2.0 --numeric --reverse", SORT_EXEC);
-      dup2(p2[0], STDIN_FILENO);
-      dup2(p3[1], STDOUT_FILENO);
-      close(p1[1]);
-      close(p2[1]);
-      char *myArgs[] = {BASH_EXEC, "-c", cmdbuf, (char*) 0};
-      if((execv(BASH_EXEC, myArgs))< 0)
-      {
-          fprintf(stderr, "\nError execing find. ERROR#%d\n", errno);
-          return EXIT_FAILURE;
-      }
+  pid_4 = fork();
+  if (pid_4 == 0) {
+    /* Fourth Child */
+    char cmdbuf[BSIZE];
+    bzero(cmdbuf, BSIZE);
+    sprintf(cmdbuf, "%s --lines=%s", HEAD_EXEC, num);
+    dup2(p3[0], STDIN_FILENO);
+    close_pipes(p1, p2, p3);
+    char *myArgs[] = {BASH_EXEC, "-c", cmdbuf, (char*) 0};
+    if ((execv(BASH_EXEC, myArgs)) < 0) {
+      fprintf(stderr, "\nError execing find. ERROR#%d\n", errno);
+      return EXIT_FAILURE;
+    }
+    exit(0);
+  }
 
-          exit(0);
-      }
+  close_pipes(p1, p2, p3);
 
-      pid_4 = fork();
-      if (pid_4 == 0) {
-      /* Fourth Child */
-        char cmdbuf[BSIZE];
-        bzero(cmdbuf, BSIZE);
-        sprintf(cmdbuf, "%s --lines=%s", HEAD_EXEC, argv[3]);
-        dup2(p3[0], STDIN_FILENO);
-        close(p1[1]);
-        close(p2[1]);
-        close(p3[1]);
-        char *myArgs[] = {BASH_EXEC, "-c", cmdbuf, (char*) 0};
-        if((execv(BASH_EXEC, myArgs))< 0)
-        {
-            fprintf(stderr, "\nError execing find. ERROR#%d\n", errno);
-            return EXIT_FAILURE;
-        }
-        exit(0);
-      }
+  if ((waitpid(pid_1, &status, 0)) == -1) {
+    fprintf(stderr, "Process 1 encountered an error. ERROR%d", errno);
+    return EXIT_FAILURE;
+  }
+  if ((waitpid(pid_2, &status, 0)) == -1) {
+    fprintf(stderr, "Process 2 encountered an error. ERROR%d", errno);
+    return EXIT_FAILURE;
+  }
+  if ((waitpid(pid_3, &status, 0)) == -1) {
+    fprintf(stderr, "Process 3 encountered an error. ERROR%d", errno);
+    return EXIT_FAILURE;
+  }
+  if ((waitpid(pid_4, &status, 0)) == -1) {
+    fprintf(stderr, "Process 4 encountered an error. ERROR%d", errno);
+    return EXIT_FAILURE;
+  }
+
+  return 0;
+}
+
+/*
+ * The native way does all of it in this process: threads walk the
+ * tree, each file is counted where it lies and only the best lines
+ * are kept.
+ */
+
+/*
+ * An open directory, kept until the last of its entries has been
+ * opened relative to it
+ */
+typedef struct {
+  int   fd;
+  int   refs;
+  char *path;   /* As find would print it */
+} dir_ref;
+
+/* A directory to read or a file to count, by name inside dir */
+typedef struct {
+  dir_ref *dir;  /* NULL for the top directory */
+  char    *name;
+  int      is_dir;
+} task;
+
+/* One line of output, ranked by count and then by the line itself */
+typedef struct {
+  long  count;
+  char *line;
+} entry;
+
+/*
+ * Each thread pushes and pops tasks at the tail of its own deque, so
+ * a directory's entries are worked on while it is still open and
+ * cached. A thread with nothing left steals from the head of someone
+ * else's, which is where the oldest and biggest pieces of the tree are.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  task          **tasks;
+  size_t          head;
+  size_t          tail;
+  size_t          cap;
+  entry          *heap;    /* The thread's best num lines so far */
+  size_t          heap_n;
+  char           *buf;     /* For files too small to map */
+  size_t          buf_cap;
+  int             id;
+} finder_thread;
+
+struct linux_dirent64 {
+  unsigned long long d_ino;
+  long long          d_off;
+  unsigned short     d_reclen;
+  unsigned char      d_type;
+  char               d_name[];
+};
+
+static finder_thread threads[MAX_THREADS];
+static int nthreads;
+static const char *pattern;
+static size_t pattern_len;
+static size_t num_lines;
+
+/* Tasks pushed and not finished; the walk is over when it reaches 0 */
+static long pending;
+static unsigned long generation;   /* Bumped by every push */
+static int sleepers;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+static const char *(*search)(const char *, size_t, const char *, size_t);
+
+/*
+ * Find the first place str occurs in buf. The vector versions look
+ * for the first and the last byte of str at once over a whole vector
+ * of positions and only compare the rest where both match, which is
+ * rare for anything but very short strings.
+ */
+static const char *
+search_scalar (const char *buf, size_t len, const char *str, size_t n)
+{
+  return memmem(buf, len, str, n);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) static const char *
+search_sse2 (const char *buf, size_t len, const char *str, size_t n)
+{
+  const __m128i first = _mm_set1_epi8(str[0]);
+  const __m128i last = _mm_set1_epi8(str[n - 1]);
+  __m128i a, b;
+  unsigned mask;
+  size_t i;
+  int bit;
+
+  for (i = 0; n > 1 && i + n - 1 + 16 <= len; i += 16) {
+    a = _mm_cmpeq_epi8(first, _mm_loadu_si128((__m128i *) (buf + i)));
+    b = _mm_cmpeq_epi8(last,
+                       _mm_loadu_si128((__m128i *) (buf + i + n - 1)));
+    mask = _mm_movemask_epi8(_mm_and_si128(a, b));
+    while (mask != 0) {
+      bit = __builtin_ctz(mask);
+      if (memcmp(buf + i + bit + 1, str + 1, n - 2) == 0)
+        return buf + i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return search_scalar(buf + i, len - i, str, n);
+}
+
+__attribute__((target("avx2"))) static const char *
+search_avx2 (const char *buf, size_t len, const char *str, size_t n)
+{
+  const __m256i first = _mm256_set1_epi8(str[0]);
+  const __m256i last = _mm256_set1_epi8(str[n - 1]);
+  __m256i a, b;
+  unsigned mask;
+  size_t i;
+  int bit;
+
+  for (i = 0; n > 1 && i + n - 1 + 32 <= len; i += 32) {
+    a = _mm256_cmpeq_epi8(first, _mm256_loadu_si256((__m256i *) (buf + i)));
+    b = _mm256_cmpeq_epi8(last,
+                          _mm256_loadu_si256((__m256i *) (buf + i + n - 1)));
+    mask = _mm256_movemask_epi8(_mm256_and_si256(a, b));
+    while (mask != 0) {
+      bit = __builtin_ctz(mask);
+      if (memcmp(buf + i + bit + 1, str + 1, n - 2) == 0)
+        return buf + i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return search_sse2(buf + i, len - i, str, n);
+}
+#endif
+
+static void
+choose_search (void)
+{
+  search = search_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2"))
+    search = search_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    search = search_sse2;
+#endif
+}
+
+/*
+ * What grep -c prints: the number of lines with the pattern in them,
+ * so the search carries on from the next line after every match
+ */
+long count_lines(const char *buf, size_t len)
+{
+  const char *end = buf + len;
+  const char *m;
+  long count = 0;
+
+  while ((m = search(buf, end - buf, pattern, pattern_len)) != NULL) {
+    count++;
+    if ((buf = memchr(m, '\n', end - m)) == NULL)
+      break;
+    buf++;
+  }
+  return count;
+}
+
+/*
+ * Where a line goes in the output: more matches first, and the same
+ * number in reverse order of the whole line, like sort --reverse
+ * breaks ties
+ */
+static int
+rank_above (const entry *a, const entry *b)
+{
+  if (a->count != b->count)
+    return a->count > b->count;
+  return strcoll(a->line, b->line) > 0;
+}
+
+static int
+compare_rank (const void *a, const void *b)
+{
+  return rank_above(b, a) - rank_above(a, b);
+}
+
+/*
+ * Keep line if it is among the best num_lines this thread has seen.
+ * The heap's root is the worst line kept, the one to give up.
+ */
+void keep_line(finder_thread *t, long count, const char *line)
+{
+  entry e = { count, (char *) line };
+  entry *h = t->heap;
+  size_t i, child;
+
+  if (num_lines == 0)
+    return;
+  if (t->heap_n == num_lines) {
+    if (!rank_above(&e, &h[0]))
+      return;
+    free(h[0].line);
+    e.line = strdup(line);
+    /* Sift the new line down from the root */
+    for (i = 0; (child = 2 * i + 1) < t->heap_n; i = child) {
+      if (child + 1 < t->heap_n && rank_above(&h[child], &h[child + 1]))
+        child++;
+      if (!rank_above(&e, &h[child]))
+        break;
+      h[i] = h[child];
+    }
+    h[i] = e;
+    return;
+  }
+
+  e.line = strdup(line);
+  for (i = t->heap_n++; i > 0 && rank_above(&h[(i - 1) / 2], &e);
+       i = (i - 1) / 2)
+    h[i] = h[(i - 1) / 2];
+  h[i] = e;
+}
+
+void push_task(finder_thread *t, dir_ref *dir, const char *name, int is_dir)
+{
+  task *tk = malloc(sizeof(task));
+
+  tk->dir = dir;
+  tk->name = strdup(name);
+  tk->is_dir = is_dir;
+  if (dir != NULL)
+    __atomic_fetch_add(&dir->refs, 1, __ATOMIC_RELAXED);
+
+  __atomic_fetch_add(&pending, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&t->lock);
+  if (t->tail == t->cap) {
+    if (t->head > 0) {
+      memmove(t->tasks, t->tasks + t->head,
+              (t->tail - t->head) * sizeof(task *));
+      t->tail -= t->head;
+      t->head = 0;
+    }
+    if (t->tail == t->cap) {
+      t->cap = t->cap ? t->cap * 2 : 256;
+      t->tasks = realloc(t->tasks, t->cap * sizeof(task *));
+    }
+  }
+  t->tasks[t->tail++] = tk;
+  pthread_mutex_unlock(&t->lock);
+
+  /* Wake anyone who looked for work before this was there */
+  __atomic_fetch_add(&generation, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&sleepers, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&idle_lock);
+    pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+  }
+}
+
+task *pop_task(finder_thread *t)
+{
+  task *tk = NULL;
+
+  pthread_mutex_lock(&t->lock);
+  if (t->tail > t->head)
+    tk = t->tasks[--t->tail];
+  pthread_mutex_unlock(&t->lock);
+  return tk;
+}
+
+task *steal_task(finder_thread *t)
+{
+  finder_thread *v;
+  task *tk = NULL;
+  int i;
+
+  for (i = 1; i < nthreads && tk == NULL; i++) {
+    v = &threads[(t->id + i) % nthreads];
+    pthread_mutex_lock(&v->lock);
+    if (v->tail > v->head)
+      tk = v->tasks[v->head++];
+    pthread_mutex_unlock(&v->lock);
+  }
+  return tk;
+}
+
+void release_dir(dir_ref *dir)
+{
+  if (dir == NULL || __atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+  close(dir->fd);
+  free(dir->path);
+  free(dir);
+}
+
+/* find -name '*.[ch]' */
+static int
+wanted (const char *name)
+{
+  size_t len = strlen(name);
+
+  return len >= 2 && name[len - 2] == '.' &&
+    (name[len - 1] == 'c' || name[len - 1] == 'h');
+}
+
+/* What goes between a directory and a name, find leaves out a second / */
+static const char *
+separator (const char *dir)
+{
+  size_t len = strlen(dir);
+
+  return len > 0 && dir[len - 1] == '/' ? "" : "/";
+}
+
+char *join_path(const char *dir, const char *name)
+{
+  char *path = malloc(strlen(dir) + strlen(name) + 2);
 
-      close(p1[1]);
-      close(p2[1]);
-      close(p3[1]);
+  sprintf(path, "%s%s%s", dir, separator(dir), name);
+  return path;
+}
 
-      if ((waitpid(pid_1, &status, 0)) == -1) {
-          fprintf(stderr, "Process 1 encountered an error. ERROR%d", errno);
-          return EXIT_FAILURE;
+/*
+ * Open a directory and queue everything in it that has to be walked
+ * or counted. d_type saves a stat per entry on file systems that fill
+ * it in. Like find, links to directories are not followed.
+ */
+void walk_dir(finder_thread *t, task *tk)
+{
+  char dents[DENTS_BSIZE];
+  struct linux_dirent64 *d;
+  struct stat st;
+  dir_ref *dir;
+  long n, off;
+  int fd, is_dir;
+
+  if (tk->dir == NULL)
+    fd = open(tk->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  else
+    fd = openat(tk->dir->fd, tk->name,
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "finder: %s/%s: %s\n", tk->dir ? tk->dir->path : ".",
+            tk->name, strerror(errno));
+    return;
+  }
+
+  dir = malloc(sizeof(dir_ref));
+  dir->fd = fd;
+  dir->refs = 1;   /* Ours, until every entry is queued */
+  dir->path = tk->dir ? join_path(tk->dir->path, tk->name) : strdup(tk->name);
+
+  while ((n = syscall(SYS_getdents64, fd, dents, sizeof(dents))) > 0) {
+    for (off = 0; off < n; off += d->d_reclen) {
+      d = (struct linux_dirent64 *) (dents + off);
+      if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+        continue;
+
+      if (d->d_type == DT_UNKNOWN) {
+        if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+          continue;
+        is_dir = S_ISDIR(st.st_mode);
+      } else {
+        is_dir = d->d_type == DT_DIR;
       }
-      if ((waitpid(pid_2, &status, 0)) == -1) {
-          fprintf(stderr, "Process 2 encountered an error. ERROR%d", errno);
-          return EXIT_FAILURE;
+
+      if (is_dir)
+        push_task(t, dir, d->d_name, 1);
+      else if (wanted(d->d_name))
+        push_task(t, dir, d->d_name, 0);
+    }
+  }
+  if (n < 0)
+    fprintf(stderr, "finder: %s: %s\n", dir->path, strerror(errno));
+
+  release_dir(dir);
+}
+
+/*
+ * Count one file, mapped if it is big enough to be worth it, and keep
+ * its line if it ranks
+ */
+void count_file(finder_thread *t, task *tk)
+{
+  char line[LINE_MAX_LEN];
+  struct stat st;
+  char *data = NULL;
+  size_t len = 0;
+  ssize_t r;
+  long count;
+  int fd, mapped = 0;
+
+  /* Like grep, this follows links to files */
+  if ((fd = openat(tk->dir->fd, tk->name, O_RDONLY | O_CLOEXEC)) < 0 ||
+      fstat(fd, &st) < 0) {
+    fprintf(stderr, "finder: %s/%s: %s\n", tk->dir->path, tk->name,
+            strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    close(fd);
+    return;
+  }
+
+  if (S_ISREG(st.st_mode) && st.st_size >= MMAP_MIN) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+      len = st.st_size;
+      mapped = 1;
+    }
+  }
+  if (!mapped) {
+    for (;;) {
+      if (t->buf_cap - len < MMAP_MIN) {
+        t->buf_cap = t->buf_cap ? t->buf_cap * 2 : MMAP_MIN * 2;
+        t->buf = realloc(t->buf, t->buf_cap);
       }
-      if ((waitpid(pid_3, &status, 0)) == -1) {
-          fprintf(stderr, "Process 3 encountered an error. ERROR%d", errno);
-          return EXIT_FAILURE;
+      if ((r = read(fd, t->buf + len, t->buf_cap - len)) <= 0) {
+        if (r < 0 && errno == EINTR)
+          continue;
+        break;
       }
-      if ((waitpid(pid_4, &status, 0)) == -1) {
-          fprintf(stderr, "Process 4 encountered an error. ERROR%d", errno);
-          return EXIT_FAILURE;
+      len += r;
+    }
+    data = t->buf;
+  }
+  close(fd);
+
+  count = count_lines(data, len);
+  if (mapped)
+    munmap(data, len);
+
+  snprintf(line, sizeof(line), "%s%s%s:%ld", tk->dir->path,
+           separator(tk->dir->path), tk->name, count);
+  keep_line(t, count, line);
+}
+
+void *finder_main(void *arg)
+{
+  finder_thread *t = arg;
+  unsigned long seen;
+  task *tk;
+
+  for (;;) {
+    seen = __atomic_load_n(&generation, __ATOMIC_SEQ_CST);
+    if ((tk = pop_task(t)) == NULL)
+      tk = steal_task(t);
+
+    if (tk != NULL) {
+      if (tk->is_dir)
+        walk_dir(t, tk);
+      else
+        count_file(t, tk);
+      release_dir(tk->dir);
+      free(tk->name);
+      free(tk);
+      if (__atomic_sub_fetch(&pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_broadcast(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
       }
+      continue;
+    }
+
+    /* Nothing anywhere: sleep until something is pushed or all is done */
+    pthread_mutex_lock(&idle_lock);
+    __atomic_fetch_add(&sleepers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&pending, __ATOMIC_SEQ_CST) > 0 &&
+           __atomic_load_n(&generation, __ATOMIC_SEQ_CST) == seen)
+      pthread_cond_wait(&idle_cond, &idle_lock);
+    __atomic_fetch_sub(&sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&idle_lock);
+
+    if (__atomic_load_n(&pending, __ATOMIC_SEQ_CST) == 0)
+      return NULL;
+  }
+}
+
+/*
+ * Every directory being walked holds a descriptor, and a wide tree
+ * has many of them at once
+ */
+static void
+raise_fd_limit (void)
+{
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+int run_native(char *dir, char *str, long num, int nthr)
+{
+  pthread_t tids[MAX_THREADS];
+  entry *all;
+  size_t n = 0, i, j;
+  int k;
 
-    return 0;
+  pattern = str;
+  pattern_len = strlen(str);
+  num_lines = num;
+  nthreads = nthr;
+  choose_search();
+  raise_fd_limit();
+  /* Ties are broken the way sort would in this locale */
+  setlocale(LC_COLLATE, "");
+
+  for (k = 0; k < nthreads; k++) {
+    pthread_mutex_init(&threads[k].lock, NULL);
+    threads[k].id = k;
+    threads[k].heap = malloc((num_lines ? num_lines : 1) * sizeof(entry));
+  }
+  push_task(&threads[0], NULL, dir, 1);
+
+  for (k = 1; k < nthreads; k++) {
+    if ((errno = pthread_create(&tids[k], NULL, finder_main,
+                                &threads[k])) != 0) {
+      fprintf(stderr, "finder: pthread_create: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+  finder_main(&threads[0]);
+  for (k = 1; k < nthreads; k++)
+    pthread_join(tids[k], NULL);
+
+  /* The best lines overall are among the best of every thread */
+  for (k = 0; k < nthreads; k++)
+    n += threads[k].heap_n;
+  all = malloc((n ? n : 1) * sizeof(entry));
+  for (k = 0, i = 0; k < nthreads; k++)
+    for (j = 0; j < threads[k].heap_n; j++)
+      all[i++] = threads[k].heap[j];
+  qsort(all, n, sizeof(entry), compare_rank);
+
+  for (i = 0; i < n && i < num_lines; i++)
+    printf("%s\n", all[i].line);
+  for (i = 0; i < n; i++)
+    free(all[i].line);
+  free(all);
+  for (k = 0; k < nthreads; k++) {
+    free(threads[k].heap);
+    free(threads[k].tasks);
+    free(threads[k].buf);
+  }
+  return 0;
+}
+
+void usage(void)
+{
+  printf("usage: finder [-n] [-j THREADS] DIR STR NUM_FILES\n");
+  printf("  -n  search in this process with threads instead of running\n"
+         "      find, xargs grep, sort and head\n");
+  printf("  -j  threads for -n (default one per CPU, at most %d)\n",
+         MAX_THREADS);
+  exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+  int opt, native = 0;
+  long nthr = sysconf(_SC_NPROCESSORS_ONLN);
+  long num;
+  char *end;
+
+  while ((opt = getopt(argc, argv, "nj:")) != -1) {
+    switch (opt) {
+    case 'n': native = 1; break;
+    case 'j': nthr = strtol(optarg, NULL, 10); break;
+    default: usage();
+    }
+  }
+  if (argc - optind != 3)
+    usage();
+  if (nthr < 1)
+    nthr = 1;
+  if (nthr > MAX_THREADS)
+    nthr = MAX_THREADS;
+
+  /*
+   * The native search only knows fixed strings. A pattern grep would
+   * read as a regular expression, or a count head would not take, is
+   * left to the pipeline.
+   */
+  num = strtol(argv[optind + 2], &end, 10);
+  if (native && (argv[optind + 1][0] == '\0' || argv[optind + 1][0] == '-' ||
+                 strpbrk(argv[optind + 1], REGEX_CHARS) != NULL ||
+                 *end != '\0' || end == argv[optind + 2] || num < 0)) {
+    fprintf(stderr, "finder: STR is not a plain string or NUM_FILES "
+            "not a count, running the pipeline\n");
+    native = 0;
   }
+
+  if (native)
+    return run_native(argv[optind], argv[optind + 1], num, nthr);
+  return run_pipeline(argv[optind], argv[optind + 1], argv[optind + 2]);
+}
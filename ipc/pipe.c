@@ -1,73 +1,293 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 
+#include "uring.h"
+
 #define R_FILE "/proc/meminfo"
-#define BSIZE 256 
+#define BSIZE 256
+#define URING_DEPTH 8
+
+static size_t bsize = BSIZE;     /* -b: buffer of the copying path */
+static int use_uring = 0;        /* -u: process a copies with io_uring */
+static int use_splice = 0;       /* -s: move pages instead of copying */
+static int timing = 0;           /* -t: process b reports the throughput */
+static long pipe_size = 0;       /* -p: F_SETPIPE_SZ, 0 to leave it */
+static long long gen_bytes = -1; /* -g: bytes process a makes in memory
+                                    instead of reading a file */
+static double start;
+
+double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int write_all(int fd, const char *buf, size_t n)
+{
+  ssize_t w;
+
+  while (n > 0) {
+    if ((w = write(fd, buf, n)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += w;
+    n -= w;
+  }
+  return 0;
+}
+
+/*
+ * Copy in to out through a buffer until the end of in. Returns the
+ * bytes copied or -1.
+ */
+long long copy_fd(int in, int out)
+{
+  char *buf = malloc(bsize);
+  long long total = 0;
+  ssize_t rsize;
+
+  if (buf == NULL)
+    return -1;
+  while ((rsize = read(in, buf, bsize)) != 0) {
+    if (rsize < 0) {
+      if (errno == EINTR)
+        continue;
+      total = -1;
+      break;
+    }
+    if (write_all(out, buf, rsize) < 0) {
+      total = -1;
+      break;
+    }
+    total += rsize;
+  }
+  free(buf);
+  return total;
+}
+
+/*
+ * Move in to out with splice(), where one of them is the pipe, so the
+ * kernel hands over page references instead of copying the bytes
+ * through user space. A file that can not be spliced is copied.
+ */
+long long splice_fd(int in, int out, size_t chunk)
+{
+  long long total = 0;
+  ssize_t n;
+
+  for (;;) {
+    n = splice(in, NULL, out, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EINVAL && total == 0)
+      return copy_fd(in, out);
+    if (n <= 0)
+      return n < 0 ? -1 : total;
+    total += n;
+  }
+}
+
+/*
+ * Process a without a file: fill the pipe with gen_bytes of lines made
+ * in memory. With splice the pages of the one buffer are lent to the
+ * pipe with vmsplice(), which is only safe because the buffer never
+ * changes afterwards.
+ */
+long long generate(int out, size_t chunk)
+{
+  static const char line[] = "the quick brown fox jumps over the lazy dog\n";
+  char *buf;
+  struct iovec iov;
+  long long left = gen_bytes;
+  ssize_t n;
+  size_t i;
+
+  if (posix_memalign((void **) &buf, 4096, chunk) != 0)
+    return -1;
+  for (i = 0; i < chunk; i++)
+    buf[i] = line[i % (sizeof(line) - 1)];
+
+  while (left > 0) {
+    iov.iov_base = buf;
+    iov.iov_len = left < (long long) chunk ? left : chunk;
+    if (!use_splice) {
+      if (write_all(out, iov.iov_base, iov.iov_len) < 0)
+        return -1;
+      left -= iov.iov_len;
+      continue;
+    }
+    while (iov.iov_len > 0) {
+      n = vmsplice(out, &iov, 1, 0);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        return -1;
+      }
+      iov.iov_base = (char *) iov.iov_base + n;
+      iov.iov_len -= n;
+      left -= n;
+    }
+  }
+  return gen_bytes;
+}
 
-int main()
+void usage(char *prog)
 {
-  int status;
+  fprintf(stderr, "Usage: %s [-u|-s] [-b BSIZE] [-p PIPE_SIZE] [-g MB] [-t] "
+          "[FILE]\n", prog);
+  fprintf(stderr, "  -u  process a reads FILE with io_uring\n");
+  fprintf(stderr, "  -s  splice FILE into the pipe and the pipe to the "
+          "output,\n      or vmsplice the data made by -g\n");
+  fprintf(stderr, "  -b  buffer size when copying (default %d)\n", BSIZE);
+  fprintf(stderr, "  -p  set the pipe's size with F_SETPIPE_SZ\n");
+  fprintf(stderr, "  -g  send MB of data made in memory instead of FILE\n");
+  fprintf(stderr, "  -t  report the throughput on stderr\n");
+  fprintf(stderr, "FILE defaults to %s\n", R_FILE);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+  int status, opt, failed = 0;
+  int pfd[2];
+  size_t chunk;
+  const char *r_file = R_FILE;
   pid_t pid_1, pid_2;
 
-  /* XXX - need to declare pipes and make the pipe() system call before
-   * forking any children
+  while ((opt = getopt(argc, argv, "usb:p:g:t")) != -1) {
+    switch (opt) {
+    case 'u': use_uring = 1; break;
+    case 's': use_splice = 1; break;
+    case 'b': bsize = strtoul(optarg, NULL, 10); break;
+    case 'p': pipe_size = strtol(optarg, NULL, 10); break;
+    case 'g': gen_bytes = atoll(optarg) << 20; break;
+    case 't': timing = 1; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind < argc)
+    r_file = argv[optind];
+  if (bsize == 0 || pipe_size < 0 || (use_uring && use_splice))
+    usage(argv[0]);
+
+  /* The pipe has to exist before the children fork to inherit it */
+  if (pipe(pfd) < 0) {
+    fprintf(stderr, "\nError creating pipe. ERROR#%d\n", errno);
+    return EXIT_FAILURE;
+  }
+
+  /*
+   * A bigger pipe holds more between the two processes, so they take
+   * turns less often. splice moves at most a pipe full at a time.
    */
+  if (pipe_size > 0 && fcntl(pfd[1], F_SETPIPE_SZ, pipe_size) < 0)
+    fprintf(stderr, "Could not set the pipe size to %ld. ERROR#%d\n",
+            pipe_size, errno);
+  chunk = fcntl(pfd[1], F_GETPIPE_SZ);
+
+  start = now();
 
   pid_1 = fork();
-  if (pid_1 == 0) { 
-    /* process a */ 
+  if (pid_1 == 0) {
+    /* process a */
 
     int rfd;
-    size_t rsize;
-    char buf[BSIZE];
+    long long moved;
+    uring ring;
+
+    close(pfd[0]);
 
-    if ((rfd = open(R_FILE, O_RDONLY)) < 0) {
-      fprintf(stderr, "\nError opening file: %s. ERROR#%d\n", R_FILE, errno);
+    if (gen_bytes >= 0) {
+      if (generate(pfd[1], chunk) < 0) {
+        fprintf(stderr, "\nError writing to pipe. ERROR#%d\n", errno);
+        return EXIT_FAILURE;
+      }
+      close(pfd[1]);
+      return 0;
+    }
+
+    if ((rfd = open(r_file, O_RDONLY)) < 0) {
+      fprintf(stderr, "\nError opening file: %s. ERROR#%d\n", r_file, errno);
       return EXIT_FAILURE;
     }
 
     /* read contents of file and write it out to a pipe */
-    while ((rsize = read(rfd, buf, BSIZE)) > 0) {
-      /* XXX - this should write to a pipe - not to stdout */
-      write(STDOUT_FILENO, buf, rsize);
+    if (use_uring && uring_init(&ring, URING_DEPTH * 2, 0) == 0) {
+      /* Reads and writes of several buffers go to the kernel together */
+      moved = uring_copy(&ring, rfd, pfd[1], URING_DEPTH, bsize);
+      uring_exit(&ring);
+    } else {
+      if (use_uring)
+        fprintf(stderr, "io_uring is not available (%s), using read/write\n",
+                strerror(errno));
+      moved = use_splice ? splice_fd(rfd, pfd[1], chunk)
+                         : copy_fd(rfd, pfd[1]);
+    }
+
+    if (moved < 0) {
+      fprintf(stderr, "\nError copying file: %s. ERROR#%d\n", r_file, errno);
+      return EXIT_FAILURE;
     }
 
     close(rfd);
-    return 0; 
-  } 
+    close(pfd[1]);
+    return 0;
+  }
 
   pid_2 = fork();
   if (pid_2 == 0) {
     /* process b */
-#if 0
-    size_t rsize;
-    char buf[BSIZE];
+    long long moved;
+    double elapsed;
 
-    /* read from pipe and write out contents to the terminal */
+    close(pfd[1]);
 
-    /* XXX - this should read from a pipe - not from stdin */
-    while ((rsize = read(STDIN_FILENO, buf, BSIZE)) > 0) {
-      write(STDOUT_FILENO, buf, rsize);
+    /* read from pipe and write out contents to the terminal */
+    moved = use_splice ? splice_fd(pfd[0], STDOUT_FILENO, chunk)
+                       : copy_fd(pfd[0], STDOUT_FILENO);
+    if (moved < 0) {
+      fprintf(stderr, "\nError reading from pipe. ERROR#%d\n", errno);
+      return EXIT_FAILURE;
     }
-#endif
 
+    elapsed = now() - start;
+    if (timing)
+      fprintf(stderr, "%s: %lld bytes in %.3f s, %.1f MB/s\n",
+              use_splice ? (gen_bytes >= 0 ? "vmsplice" : "splice")
+                         : use_uring ? "io_uring" : "copy",
+              moved, elapsed, moved / 1e6 / elapsed);
+
+    close(pfd[0]);
     return 0;
   }
 
-  /* shell process */
+  /* shell process, the pipe is only for the children */
+  close(pfd[0]);
+  close(pfd[1]);
+
   if ((waitpid(pid_1, &status, 0)) == -1) {
     fprintf(stderr, "Process 1 encountered an error. ERROR%d", errno);
     return EXIT_FAILURE;
-  }        
+  }
+  failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
 
   if ((waitpid(pid_2, &status, 0)) == -1) {
     fprintf(stderr, "Process 2 encountered an error. ERROR%d", errno);
     return EXIT_FAILURE;
   }
+  failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
 
-  return 0;
+  return failed ? EXIT_FAILURE : 0;
 }
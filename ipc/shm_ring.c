@@ -0,0 +1,312 @@
+/*
+ * A ring of message slots in shared memory. See shm_ring.h.
+ *
+ * Slot i of the ring is used for messages i, i + nslots, i + 2 nslots
+ * and so on. Its sequence number is the position of the message it
+ * waits for while free, and that position + 1 once the message is in
+ * it, so a sender and the receiver each know from the number alone
+ * whether it is their turn.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shm_ring.h"
+
+#define SHM_SPIN 4096
+
+typedef struct {
+  uint64_t seq;
+  uint32_t len;
+} shm_slot;
+
+static long futex_wait(uint32_t *addr, uint32_t val)
+{
+  /* Not FUTEX_PRIVATE_FLAG, the word is shared with other processes */
+  return syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static long futex_wake(uint32_t *addr)
+{
+  return syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+static size_t round_up(size_t n, size_t to)
+{
+  return (n + to - 1) / to * to;
+}
+
+static shm_slot *slot_at(shm_ring *r, uint64_t pos)
+{
+  return (shm_slot *) (r->slots +
+                       (pos & (r->hdr->nslots - 1)) * r->hdr->stride);
+}
+
+static char *slot_data(shm_slot *s)
+{
+  return (char *) s + SHM_CACHE_LINE;
+}
+
+/*
+ * Spinning only pays if the other side is running at the same time on
+ * another CPU
+ */
+static int default_spin(void)
+{
+  return sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN : 0;
+}
+
+static int attach(shm_ring *r, int fd, size_t size)
+{
+  r->map_size = size;
+  r->hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (r->hdr == MAP_FAILED) {
+    r->hdr = NULL;
+    return -1;
+  }
+  r->slots = (char *) r->hdr + round_up(sizeof(shm_ring_hdr), SHM_CACHE_LINE);
+  r->fd = fd;
+  r->spin = default_spin();
+  r->head = 0;
+  r->off = 0;
+  return 0;
+}
+
+int shm_ring_create(shm_ring *r, unsigned nslots, size_t slot_size,
+                    int senders)
+{
+  unsigned n = 2, i;
+  size_t stride, size;
+  int fd;
+
+  if (nslots == 0 || slot_size == 0 || slot_size > UINT32_MAX / 2 ||
+      senders < 1) {
+    errno = EINVAL;
+    return -1;
+  }
+  /*
+   * A full slot holds position + 1, which with one slot would be the
+   * number it has when free for the next message
+   */
+  while (n < nslots)
+    n *= 2;
+  /* Every slot starts on its own cache line, the payload on the next */
+  stride = SHM_CACHE_LINE + round_up(slot_size, SHM_CACHE_LINE);
+  size = round_up(sizeof(shm_ring_hdr), SHM_CACHE_LINE) + n * stride;
+
+  if ((fd = memfd_create("shm_ring", MFD_CLOEXEC)) < 0)
+    return -1;
+  if (ftruncate(fd, size) < 0 || attach(r, fd, size) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  r->hdr->nslots = n;
+  r->hdr->slot_size = slot_size;
+  r->hdr->stride = stride;
+  r->hdr->senders = senders;
+  r->hdr->multi = senders > 1;
+  for (i = 0; i < n; i++)
+    slot_at(r, i)->seq = i;
+  return 0;
+}
+
+int shm_ring_map(shm_ring *r, int fd)
+{
+  struct stat st;
+
+  if (fstat(fd, &st) < 0)
+    return -1;
+  if ((size_t) st.st_size < sizeof(shm_ring_hdr)) {
+    errno = EINVAL;
+    return -1;
+  }
+  return attach(r, fd, st.st_size);
+}
+
+void shm_ring_unmap(shm_ring *r)
+{
+  if (r->hdr != NULL)
+    munmap(r->hdr, r->map_size);
+  if (r->fd >= 0)
+    close(r->fd);
+  r->hdr = NULL;
+  r->fd = -1;
+}
+
+/*
+ * Tell a sleeping receiver that a slot was filled or a sender left.
+ * Only the first to see it asleep makes the system call, the rest of
+ * the messages sent before it runs again cost nothing extra.
+ */
+static void wake_receiver(shm_ring *r)
+{
+  if (__atomic_exchange_n(&r->hdr->receiver_waiting, 0, __ATOMIC_SEQ_CST)) {
+    __atomic_fetch_add(&r->hdr->data_futex, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&r->hdr->data_futex);
+  }
+}
+
+/*
+ * Take the next slot to fill. A slot whose number is behind the
+ * position is still full from the last time around, so the ring is
+ * full; one ahead of it was taken by another sender.
+ */
+static shm_slot *claim_slot(shm_ring *r, uint64_t *posp)
+{
+  shm_ring_hdr *h = r->hdr;
+  shm_slot *s;
+  uint64_t pos, seq;
+  uint32_t v;
+  int i;
+
+  for (i = 0;; i++) {
+    pos = __atomic_load_n(&h->tail, __ATOMIC_RELAXED);
+    s = slot_at(r, pos);
+    seq = __atomic_load_n(&s->seq, __ATOMIC_SEQ_CST);
+
+    if (seq == pos) {
+      if (!h->multi) {
+        __atomic_store_n(&h->tail, pos + 1, __ATOMIC_RELAXED);
+        break;
+      }
+      if (__atomic_compare_exchange_n(&h->tail, &pos, pos + 1, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+      continue;
+    }
+    if ((int64_t) (seq - pos) > 0 || i < r->spin) {
+      cpu_relax();
+      continue;
+    }
+
+    /*
+     * Full. Say so before looking again, so the receiver either sees
+     * the sender waiting or the sender sees the slot it freed.
+     */
+    v = __atomic_load_n(&h->space_futex, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&h->space_wanted, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->seq, __ATOMIC_SEQ_CST) == seq)
+      futex_wait(&h->space_futex, v);
+    i = 0;
+  }
+
+  *posp = pos;
+  return s;
+}
+
+ssize_t shm_ring_send(shm_ring *r, const void *buf, size_t len)
+{
+  const char *p = buf;
+  size_t left = len, n;
+  uint64_t pos;
+  shm_slot *s;
+
+  while (left > 0) {
+    n = left < r->hdr->slot_size ? left : r->hdr->slot_size;
+    s = claim_slot(r, &pos);
+    memcpy(slot_data(s), p, n);
+    s->len = n;
+    __atomic_store_n(&s->seq, pos + 1, __ATOMIC_SEQ_CST);
+    wake_receiver(r);
+    p += n;
+    left -= n;
+  }
+  return len;
+}
+
+/* Wake the senders sleeping on a full ring, as wake_receiver() */
+static void wake_senders(shm_ring *r)
+{
+  if (__atomic_exchange_n(&r->hdr->space_wanted, 0, __ATOMIC_SEQ_CST)) {
+    __atomic_fetch_add(&r->hdr->space_futex, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&r->hdr->space_futex);
+  }
+}
+
+/*
+ * Wait for the slot at head to be filled. Returns 1 when it is, 0 if
+ * it never will be because every sender has closed.
+ */
+static int wait_data(shm_ring *r, shm_slot *s)
+{
+  shm_ring_hdr *h = r->hdr;
+  uint64_t want = r->head + 1;
+  uint32_t v;
+  int i;
+
+  for (i = 0;; i++) {
+    if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) == want)
+      return 1;
+    if (__atomic_load_n(&h->senders, __ATOMIC_SEQ_CST) == 0)
+      return __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) == want;
+    if (i < r->spin) {
+      cpu_relax();
+      continue;
+    }
+
+    /* A sender left waiting would never fill the slot */
+    wake_senders(r);
+    v = __atomic_load_n(&h->data_futex, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&h->receiver_waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->seq, __ATOMIC_SEQ_CST) != want &&
+        __atomic_load_n(&h->senders, __ATOMIC_SEQ_CST) > 0)
+      futex_wait(&h->data_futex, v);
+    __atomic_store_n(&h->receiver_waiting, 0, __ATOMIC_SEQ_CST);
+    i = 0;
+  }
+}
+
+ssize_t shm_ring_recv(shm_ring *r, void *buf, size_t len)
+{
+  shm_ring_hdr *h = r->hdr;
+  shm_slot *s = slot_at(r, r->head);
+  size_t n;
+
+  if (len == 0)
+    return 0;
+  if (!wait_data(r, s))
+    return 0;
+
+  n = s->len - r->off;
+  if (n > len)
+    n = len;
+  memcpy(buf, slot_data(s) + r->off, n);
+  r->off += n;
+  if (r->off < s->len)
+    return n;
+
+  /* Hand the slot to whoever sends nslots messages from now */
+  r->off = 0;
+  __atomic_store_n(&s->seq, r->head + h->nslots, __ATOMIC_SEQ_CST);
+  r->head++;
+  /*
+   * A sender that found the ring full is woken once half of it is free
+   * again, not for every slot, so on a busy CPU the two sides are not
+   * switched back and forth one message at a time
+   */
+  if ((r->head & (h->nslots / 2 - 1)) == 0)
+    wake_senders(r);
+  return n;
+}
+
+void shm_ring_close(shm_ring *r)
+{
+  __atomic_fetch_sub(&r->hdr->senders, 1, __ATOMIC_SEQ_CST);
+  wake_receiver(r);
+}
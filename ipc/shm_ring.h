@@ -0,0 +1,84 @@
+/*
+ * A ring of message slots in shared memory, for moving data between
+ * processes without a system call per message.
+ *
+ * The memory comes from memfd_create(), so children forked after
+ * shm_ring_create() share it, and any other process can be handed the
+ * descriptor (over a Unix socket) and call shm_ring_map(). A sender
+ * copies straight into a slot and a receiver straight out of it, one
+ * copy each where a pipe or socket takes two plus the system calls.
+ *
+ * Any number of processes may send, but only one may receive. Each
+ * slot carries a sequence number that says whether it is free for the
+ * sender whose turn it is or full for the receiver, so senders only
+ * contend on claiming the next slot. A side that has to wait spins a
+ * little and then sleeps on a futex in the shared memory, and the
+ * other side only makes the futex call to wake it if it is asleep.
+ */
+
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SHM_CACHE_LINE 64
+
+/* The shared header; the slots follow it */
+typedef struct {
+  uint32_t nslots;       /* A power of 2 */
+  uint32_t slot_size;    /* Payload bytes per slot */
+  uint32_t stride;       /* Bytes from one slot to the next */
+  int32_t  senders;      /* Still open, the receiver sees the end at 0 */
+  uint32_t multi;        /* Senders have to claim slots atomically */
+  uint64_t tail __attribute__((aligned(SHM_CACHE_LINE)));  /* Next to fill */
+  uint32_t data_futex __attribute__((aligned(SHM_CACHE_LINE)));
+  int32_t  receiver_waiting;  /* Set to sleep, cleared by the waker */
+  uint32_t space_futex __attribute__((aligned(SHM_CACHE_LINE)));
+  int32_t  space_wanted;      /* A sender sleeps on a full ring */
+} shm_ring_hdr;
+
+/* A process's handle on a ring. head and off are the receiver's own. */
+typedef struct {
+  shm_ring_hdr *hdr;
+  char         *slots;
+  size_t        map_size;
+  int           fd;
+  int           spin;      /* Times to look again before sleeping */
+  uint64_t      head;      /* Next slot to read */
+  uint32_t      off;       /* Bytes of it already read */
+} shm_ring;
+
+/*
+ * Make a ring of nslots (rounded up to a power of 2, at least 2) slots
+ * of slot_size bytes, for senders processes to send on. With more than
+ * one sender slots are claimed with compare-and-swap. Returns 0 or -1
+ * with errno set.
+ */
+int shm_ring_create(shm_ring *r, unsigned nslots, size_t slot_size,
+                    int senders);
+
+/* Attach to a ring made by another process from its descriptor */
+int shm_ring_map(shm_ring *r, int fd);
+void shm_ring_unmap(shm_ring *r);
+
+/*
+ * Like write() on a pipe: all of len bytes are sent, in messages of up
+ * to a slot each, waiting for room as needed. Returns len. As
+ * with PIPE_BUF, only what fits in one slot is sure not to be mixed
+ * with what other senders send at the same time.
+ */
+ssize_t shm_ring_send(shm_ring *r, const void *buf, size_t len);
+
+/*
+ * Like read() on a pipe: wait until there is data and return up to len
+ * bytes of it, or 0 once every sender has closed and the ring is empty.
+ * A message bigger than len is returned over several calls.
+ */
+ssize_t shm_ring_recv(shm_ring *r, void *buf, size_t len);
+
+/* A sender is done; the last one to close ends the receiver's stream */
+void shm_ring_close(shm_ring *r);
+
+#endif
@@ -0,0 +1,391 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "shm_ring.h"
+
+/*
+ * Send the same messages between two processes over a pipe, a Unix
+ * socket and a shared memory ring, one message at a time back and
+ * forth to see the latency and as a stream to see the throughput.
+ */
+
+#define MSG_SIZE 64
+#define COUNT 100000
+#define SHM_SLOTS 256
+#define SHM_SLOT_SIZE 4096
+#define MAX_SENDERS 64
+
+enum { T_PIPE, T_UNIX, T_SHM, T_COUNT };
+enum { M_PINGPONG, M_STREAM, M_COUNT };
+
+static const char *transport_names[] = { "pipe", "unix", "shm" };
+static const char *mode_names[] = { "pingpong", "stream" };
+
+static size_t msg_size = MSG_SIZE;
+static long count = COUNT;
+static int senders = 1;          /* -P: processes sending in a stream */
+static unsigned shm_slots = SHM_SLOTS;
+static size_t shm_slot_size = SHM_SLOT_SIZE;
+static int spin = -1;            /* -S: shm spins before sleeping */
+
+/*
+ * One direction between the processes, with the same send and receive
+ * whatever carries it
+ */
+typedef struct {
+  int      kind;
+  int      rfd;
+  int      wfd;
+  shm_ring ring;
+} channel;
+
+double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int channel_open(channel *c, int kind, int nsenders)
+{
+  int fds[2];
+
+  memset(c, 0, sizeof(*c));
+  c->kind = kind;
+  c->rfd = c->wfd = -1;
+  c->ring.fd = -1;
+
+  switch (kind) {
+  case T_PIPE:
+    if (pipe(fds) < 0)
+      return -1;
+    break;
+  case T_UNIX:
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+      return -1;
+    break;
+  default:
+    if (shm_ring_create(&c->ring, shm_slots, shm_slot_size, nsenders) < 0)
+      return -1;
+    if (spin >= 0)
+      c->ring.spin = spin;
+    return 0;
+  }
+  c->rfd = fds[0];
+  c->wfd = fds[1];
+  return 0;
+}
+
+/* After the fork, each process keeps only its end */
+void channel_sender(channel *c)
+{
+  if (c->rfd >= 0)
+    close(c->rfd);
+  c->rfd = -1;
+}
+
+void channel_receiver(channel *c)
+{
+  if (c->wfd >= 0)
+    close(c->wfd);
+  c->wfd = -1;
+}
+
+int channel_send(channel *c, const char *buf, size_t n)
+{
+  ssize_t w;
+
+  if (c->kind == T_SHM)
+    return shm_ring_send(&c->ring, buf, n) < 0 ? -1 : 0;
+
+  while (n > 0) {
+    if ((w = write(c->wfd, buf, n)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += w;
+    n -= w;
+  }
+  return 0;
+}
+
+/* Receive exactly n bytes. Returns 1, 0 at the end or -1. */
+int channel_recv(channel *c, char *buf, size_t n)
+{
+  ssize_t r;
+
+  while (n > 0) {
+    if (c->kind == T_SHM)
+      r = shm_ring_recv(&c->ring, buf, n);
+    else
+      r = read(c->rfd, buf, n);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return r;
+    buf += r;
+    n -= r;
+  }
+  return 1;
+}
+
+void channel_close(channel *c)
+{
+  if (c->kind == T_SHM) {
+    shm_ring_unmap(&c->ring);
+    return;
+  }
+  if (c->rfd >= 0)
+    close(c->rfd);
+  if (c->wfd >= 0)
+    close(c->wfd);
+  c->rfd = c->wfd = -1;
+}
+
+/* A sender is done, which the receiver sees as the end of the data */
+void channel_end(channel *c)
+{
+  if (c->kind == T_SHM)
+    shm_ring_close(&c->ring);
+  else
+    close(c->wfd);
+  c->wfd = -1;
+}
+
+static void stamp(char *msg, uint64_t seq)
+{
+  if (msg_size >= sizeof(seq))
+    memcpy(msg, &seq, sizeof(seq));
+}
+
+static int stamped(const char *msg, uint64_t seq)
+{
+  return msg_size < sizeof(seq) || memcmp(msg, &seq, sizeof(seq)) == 0;
+}
+
+static int wait_children(int n)
+{
+  int status, failed = 0;
+
+  while (n-- > 0) {
+    if (wait(&status) < 0)
+      return -1;
+    failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+  }
+  return failed ? -1 : 0;
+}
+
+/*
+ * The parent sends a message, the child sends it back, count times.
+ * Every round trip is two messages and two waits for the other side.
+ */
+int pingpong(int kind)
+{
+  channel there, back;
+  char *msg = calloc(1, msg_size);
+  double start, elapsed;
+  long i;
+  pid_t pid;
+
+  if (channel_open(&there, kind, 1) < 0 || channel_open(&back, kind, 1) < 0) {
+    perror("channel_open");
+    return -1;
+  }
+
+  if ((pid = fork()) < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    channel_receiver(&there);
+    channel_sender(&back);
+    while (channel_recv(&there, msg, msg_size) > 0)
+      if (channel_send(&back, msg, msg_size) < 0)
+        exit(EXIT_FAILURE);
+    exit(0);
+  }
+
+  channel_sender(&there);
+  channel_receiver(&back);
+  start = now();
+  for (i = 0; i < count; i++) {
+    stamp(msg, i);
+    if (channel_send(&there, msg, msg_size) < 0 ||
+        channel_recv(&back, msg, msg_size) <= 0 || !stamped(msg, i)) {
+      fprintf(stderr, "%s: round trip %ld failed\n", transport_names[kind], i);
+      break;
+    }
+  }
+  elapsed = now() - start;
+  channel_end(&there);
+
+  if (wait_children(1) < 0 || i < count)
+    return -1;
+  printf("%-5s %-9s %8zu B  %10.2f us per round trip  %10.0f round trips/s\n",
+         transport_names[kind], mode_names[M_PINGPONG], msg_size,
+         elapsed / count * 1e6, count / elapsed);
+
+  channel_close(&there);
+  channel_close(&back);
+  free(msg);
+  return 0;
+}
+
+/*
+ * Whether a message from one sender can not be split up by another's.
+ * A stream socket makes no promise at all.
+ */
+static int atomic_messages(int kind)
+{
+  if (kind == T_SHM)
+    return msg_size <= shm_slot_size;
+  return kind == T_PIPE && msg_size <= PIPE_BUF;
+}
+
+/*
+ * senders children each send count messages as fast as they can and
+ * the parent takes them all. Every sender's messages have to arrive in
+ * order, which can only be checked with more than one sender if the
+ * messages are not broken up.
+ */
+int stream(int kind)
+{
+  channel c;
+  char *msg = calloc(1, msg_size);
+  double start, elapsed;
+  long long bytes = 0, want = (long long) senders * count * msg_size;
+  uint64_t next[MAX_SENDERS] = { 0 }, seq;
+  int i, r, bad = 0, check = senders == 1 || atomic_messages(kind);
+  long j;
+  pid_t pid;
+
+  if (channel_open(&c, kind, senders) < 0) {
+    perror("channel_open");
+    return -1;
+  }
+
+  start = now();
+  for (i = 0; i < senders; i++) {
+    if ((pid = fork()) < 0) {
+      perror("fork");
+      return -1;
+    }
+    if (pid == 0) {
+      channel_sender(&c);
+      for (j = 0; j < count; j++) {
+        stamp(msg, (uint64_t) i << 48 | j);
+        if (channel_send(&c, msg, msg_size) < 0)
+          exit(EXIT_FAILURE);
+      }
+      channel_end(&c);
+      exit(0);
+    }
+  }
+
+  channel_receiver(&c);
+  while ((r = channel_recv(&c, msg, msg_size)) > 0) {
+    if (check && msg_size >= sizeof(seq)) {
+      memcpy(&seq, msg, sizeof(seq));
+      i = seq >> 48;
+      if (i >= senders || seq != ((uint64_t) i << 48 | next[i]++))
+        bad = 1;
+    }
+    bytes += msg_size;
+  }
+  elapsed = now() - start;
+
+  if (wait_children(senders) < 0 || r < 0 || bad || bytes != want) {
+    fprintf(stderr, "%s: stream got %lld of %lld bytes%s\n",
+            transport_names[kind], bytes, want, bad ? " out of order" : "");
+    return -1;
+  }
+  printf("%-5s %-9s %8zu B  %10.1f MB/s  %10.0f messages/s  %d sender%s\n",
+         transport_names[kind], mode_names[M_STREAM], msg_size,
+         bytes / 1e6 / elapsed, senders * count / elapsed, senders,
+         senders > 1 ? "s" : "");
+
+  channel_close(&c);
+  free(msg);
+  return 0;
+}
+
+int pick(const char *arg, const char **names, int n)
+{
+  int i;
+
+  if (strcmp(arg, "all") == 0)
+    return n;
+  for (i = 0; i < n; i++)
+    if (strcmp(arg, names[i]) == 0)
+      return i;
+  return -1;
+}
+
+void usage(char *prog)
+{
+  fprintf(stderr, "Usage: %s [-t pipe|unix|shm|all] [-m pingpong|stream|all] "
+          "[-s SIZE] [-n COUNT] [-P SENDERS] [-r SLOTS] [-z SLOT_SIZE] "
+          "[-S SPIN]\n", prog);
+  fprintf(stderr, "  -t  transport to measure (default all)\n");
+  fprintf(stderr, "  -m  round trips one at a time, or a one way stream "
+          "(default all)\n");
+  fprintf(stderr, "  -s  message size (default %d)\n", MSG_SIZE);
+  fprintf(stderr, "  -n  messages or round trips (default %d)\n", COUNT);
+  fprintf(stderr, "  -P  processes sending in the stream (default 1)\n");
+  fprintf(stderr, "  -r  shm ring slots (default %d)\n", SHM_SLOTS);
+  fprintf(stderr, "  -z  shm slot size (default %d)\n", SHM_SLOT_SIZE);
+  fprintf(stderr, "  -S  shm spins before sleeping (default some with more "
+          "than one CPU, else none)\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+  int opt, t, m, failed = 0;
+  int transport = T_COUNT, mode = M_COUNT;
+
+  while ((opt = getopt(argc, argv, "t:m:s:n:P:r:z:S:")) != -1) {
+    switch (opt) {
+    case 't': transport = pick(optarg, transport_names, T_COUNT); break;
+    case 'm': mode = pick(optarg, mode_names, M_COUNT); break;
+    case 's': msg_size = strtoul(optarg, NULL, 10); break;
+    case 'n': count = strtol(optarg, NULL, 10); break;
+    case 'P': senders = atoi(optarg); break;
+    case 'r': shm_slots = strtoul(optarg, NULL, 10); break;
+    case 'z': shm_slot_size = strtoul(optarg, NULL, 10); break;
+    case 'S': spin = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind < argc || transport < 0 || mode < 0 || msg_size == 0 ||
+      count < 1 || senders < 1 || senders > MAX_SENDERS)
+    usage(argv[0]);
+
+  /* Nothing left buffered for the children to print again at exit() */
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  for (m = 0; m < M_COUNT; m++) {
+    if (mode != M_COUNT && mode != m)
+      continue;
+    for (t = 0; t < T_COUNT; t++) {
+      if (transport != T_COUNT && transport != t)
+        continue;
+      if (m == M_PINGPONG)
+        failed |= pingpong(t) < 0;
+      else
+        failed |= stream(t) < 0;
+    }
+  }
+  return failed ? EXIT_FAILURE : 0;
+}
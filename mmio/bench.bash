@@ -0,0 +1,100 @@
+#!/bin/bash
+#
+# Copy test files of several sizes with memmap and every read_write
+# strategy, and print a CSV line of throughput and CPU time per copy.
+
+SIZES="1M 64M 256M"
+BUFS="4096 65536 1048576"
+CACHE=warm
+REPEAT=1
+WINDOW=64
+THREADS=2
+DIR=.
+
+# read_write strategies that take a buffer size, and ones that do not
+SWEPT="rw direct thread uring"
+KERNEL="copy_file_range sendfile splice"
+
+usage() {
+    printf "Usage $0 [-s SIZES] [-b BUFS] [-c warm|drop] [-r REPEAT] [-w WINDOW_MB] [-j THREADS] [-d DIR]\n" 1>&2
+    printf "\ts - File sizes to copy, like \"1M 64M 1G\" (default \"$SIZES\")\n" 1>&2
+    printf "\tb - read_write buffer sizes to sweep (default \"$BUFS\")\n" 1>&2
+    printf "\tc - Start each copy with the input cached, or dropped from the cache\n" 1>&2
+    printf "\tr - Copies of each kind per size\n" 1>&2
+    printf "\tw - memmap window in MiB\n" 1>&2
+    printf "\tj - memmap threads for the threaded windowed copy\n" 1>&2
+    printf "\td - Where to put the test files\n" 1>&2
+    exit 1
+}
+
+while getopts "s:b:c:r:w:j:d:" o; do
+    case "${o}" in
+        s) SIZES=${OPTARG} ;;
+        b) BUFS=${OPTARG} ;;
+        c) CACHE=${OPTARG} ;;
+        r) REPEAT=${OPTARG} ;;
+        w) WINDOW=${OPTARG} ;;
+        j) THREADS=${OPTARG} ;;
+        d) DIR=${OPTARG} ;;
+        *) usage ;;
+    esac
+done
+
+if [ "$CACHE" != warm ] && [ "$CACHE" != drop ]; then
+    usage
+fi
+
+IN=$DIR/bench.in
+OUT=$DIR/bench.out
+
+# Dropping the whole page cache needs root. Anyone can ask for one
+# file's pages to go, which is all that matters here.
+prepare_cache() {
+    if [ "$CACHE" = warm ]; then
+        cat $IN > /dev/null
+    else
+        sync
+        if ! (echo 3 > /proc/sys/vm/drop_caches) 2> /dev/null; then
+            dd if=$IN iflag=nocache count=0 status=none
+        fi
+    fi
+}
+
+# Run one copy, which prints its own CSV line, after the cache is set.
+# BUF is left empty for the programs that do not take one.
+copy() {
+    local SIZE=$1 RUN=$2 BUF=$3
+    shift 3
+
+    prepare_cache
+    "$@" -c $IN $OUT $BUF | sed "s/^/$SIZE,$CACHE,$RUN,/"
+}
+
+echo "file_size,cache,run,strategy,buf_size,bytes,seconds,mb_per_s,user_s,sys_s,syscalls"
+
+for SIZE in $SIZES; do
+    BYTES=`numfmt --from=iec $SIZE` || exit 1
+    head -c $BYTES /dev/urandom > $IN
+
+    for RUN in `seq $REPEAT`; do
+        copy $BYTES $RUN "" ./memmap
+        copy $BYTES $RUN "" ./memmap -w $WINDOW
+        if [ $THREADS -gt 1 ]; then
+            copy $BYTES $RUN "" ./memmap -w $WINDOW -j $THREADS
+        fi
+
+        for S in $SWEPT; do
+            for BUF in $BUFS; do
+                copy $BYTES $RUN $BUF ./read_write -s $S
+            done
+        done
+
+        for S in $KERNEL; do
+            copy $BYTES $RUN "" ./read_write -s $S
+        done
+    done
+
+    cmp $IN $OUT || exit 1
+done
+
+rm -f $IN $OUT
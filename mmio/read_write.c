@@ -1,10 +1,66 @@
+/*
+ * Copy a file with read() and write(), or with one of the other ways
+ * Linux has of moving bytes between files, to compare them with each
+ * other and with memmap.
+ *
+ * The buffer size can be left out, and then a size is picked from the
+ * file system's block size. -s all runs every strategy in turn and
+ * reports each one.
+ */
+
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "uring.h"
+
+#define URING_DEPTH 8            /* Buffers in flight in io_uring mode */
+#define AUTO_BSIZE  (128 << 10)  /* Where read/write stops getting faster */
+#define DIRECT_ALIGN 4096        /* Covers the logical block size of any
+                                    disk O_DIRECT is likely to meet */
+#define KERNEL_CHUNK (1 << 30)   /* Bytes per copy_file_range/sendfile */
+
+enum { REPORT_NONE, REPORT_TEXT, REPORT_CSV };
+
+typedef struct {
+  unsigned long long syscalls;
+  int started;    /* Some data was read or written, a retry has to rewind */
+} copy_stats;
+
+typedef long long (*copy_fn) (int fdin, int fdout, size_t bufsz,
+                              copy_stats *st);
+
+typedef struct {
+  const char *name;
+  copy_fn     copy;
+} strategy;
+
+/*
+ * The two buffers of the threaded copy. A helper thread fills them in
+ * turn while main() writes out the other one.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t  changed;
+  int             fdin;
+  size_t          bufsz;
+  char           *buf[2];
+  ssize_t         len[2];   /* Bytes in the buffer, 0 at the end of the
+                               file, -errno if the read failed */
+  int             full[2];
+  int             stop;     /* The writer gave up */
+  unsigned long long syscalls;
+} double_buf;
 
 void err_quit (const char * mesg)
 {
@@ -18,14 +74,477 @@ void err_sys (const char * mesg)
   exit(errno);
 }
 
-int main (int argc, char *argv[])
+double now ()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double cpu_seconds (struct timeval *tv)
+{
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/*
+ * Write all n bytes, however many write() calls that takes. Returns 0
+ * or -1 with errno set.
+ */
+int write_all (int fd, const char *buf, size_t n, copy_stats *st)
+{
+  ssize_t w;
+
+  while (n > 0) {
+    w = write (fd, buf, n);
+    st->syscalls++;
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += w;
+    n -= w;
+  }
+  return 0;
+}
+
+ssize_t read_some (int fd, char *buf, size_t n, copy_stats *st)
+{
+  ssize_t r;
+
+  do {
+    r = read (fd, buf, n);
+    st->syscalls++;
+  } while (r < 0 && errno == EINTR);
+  if (r > 0)
+    st->started = 1;
+  return r;
+}
+
+long long copy_rw (int fdin, int fdout, size_t bufsz, copy_stats *st)
+{
+  char *buf = malloc(bufsz);
+  long long copied = 0;
+  ssize_t n;
+
+  if (buf == NULL)
+    return -1;
+
+  /* A read can come back short anywhere, so write what it got */
+  while ((n = read_some (fdin, buf, bufsz, st)) > 0) {
+    if (write_all (fdout, buf, n, st) < 0) {
+      n = -1;
+      break;
+    }
+    copied += n;
+  }
+
+  free(buf);
+  return n < 0 ? -1 : copied;
+}
+
+/*
+ * Turn on O_DIRECT for a regular file. On a pipe it means packet mode
+ * instead, so anything else is left alone.
+ */
+int set_direct (int fd, int flags, copy_stats *st)
 {
-  int fdin, fdout, bufsz;
-  char *src;
   struct stat statbuf;
 
-  if (argc != 4)
-    err_quit ("usage: read_write <fromfile> <tofile> <buf_size>");
+  if (fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode))
+    return 0;
+  st->syscalls += 2;
+  return fcntl(fd, F_SETFL, flags | O_DIRECT);
+}
+
+/*
+ * Copy around the page cache. O_DIRECT needs the buffer, the length
+ * and the file offset aligned, so the tail of a file that is not a
+ * whole number of blocks is written with O_DIRECT turned off again.
+ */
+long long copy_direct (int fdin, int fdout, size_t bufsz, copy_stats *st)
+{
+  int inflags = fcntl(fdin, F_GETFL), outflags = fcntl(fdout, F_GETFL);
+  long long copied = 0;
+  char *buf;
+  ssize_t n;
+  size_t got;
+
+  bufsz = (bufsz + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+  if (posix_memalign((void **) &buf, DIRECT_ALIGN, bufsz) != 0)
+    return -1;
+  if (set_direct(fdin, inflags, st) < 0 ||
+      set_direct(fdout, outflags, st) < 0) {
+    fcntl(fdin, F_SETFL, inflags);
+    free(buf);
+    return -1;
+  }
+
+  for (;;) {
+    /* Fill the whole buffer, so only the last write is unaligned */
+    for (got = 0; got < bufsz; got += n) {
+      n = read_some (fdin, buf + got, bufsz - got, st);
+      if (n <= 0)
+        break;
+    }
+    if (n < 0 || got == 0)
+      break;
+
+    if (got % DIRECT_ALIGN != 0) {
+      fcntl(fdout, F_SETFL, outflags);
+      st->syscalls++;
+    }
+    if (write_all (fdout, buf, got, st) < 0) {
+      n = -1;
+      break;
+    }
+    copied += got;
+    if (got < bufsz)
+      break;
+  }
+
+  fcntl(fdin, F_SETFL, inflags);
+  fcntl(fdout, F_SETFL, outflags);
+  free(buf);
+  return n < 0 ? -1 : copied;
+}
+
+void *read_ahead (void *arg)
+{
+  double_buf *db = arg;
+  int i = 0, stop;
+  ssize_t n;
+
+  for (;;) {
+    pthread_mutex_lock(&db->lock);
+    while (db->full[i] && !db->stop)
+      pthread_cond_wait(&db->changed, &db->lock);
+    stop = db->stop;
+    pthread_mutex_unlock(&db->lock);
+    if (stop)
+      break;
+
+    do {
+      n = read (db->fdin, db->buf[i], db->bufsz);
+      db->syscalls++;
+    } while (n < 0 && errno == EINTR);
+
+    pthread_mutex_lock(&db->lock);
+    db->len[i] = n < 0 ? -errno : n;
+    db->full[i] = 1;
+    pthread_cond_signal(&db->changed);
+    pthread_mutex_unlock(&db->lock);
+    if (n <= 0)
+      break;
+    i = !i;
+  }
+
+  return NULL;
+}
+
+/*
+ * Read the next buffer on a helper thread while this one writes out
+ * the last, so the disk and the writes overlap
+ */
+long long copy_thread (int fdin, int fdout, size_t bufsz, copy_stats *st)
+{
+  double_buf db;
+  pthread_t reader;
+  long long copied = 0;
+  ssize_t n;
+  int i = 0, err = 0;
+
+  memset(&db, 0, sizeof(db));
+  pthread_mutex_init(&db.lock, NULL);
+  pthread_cond_init(&db.changed, NULL);
+  db.fdin = fdin;
+  db.bufsz = bufsz;
+  db.buf[0] = malloc(bufsz);
+  db.buf[1] = malloc(bufsz);
+  if (db.buf[0] == NULL || db.buf[1] == NULL ||
+      (errno = pthread_create(&reader, NULL, read_ahead, &db)) != 0) {
+    free(db.buf[0]);
+    free(db.buf[1]);
+    return -1;
+  }
+
+  for (;;) {
+    pthread_mutex_lock(&db.lock);
+    while (!db.full[i])
+      pthread_cond_wait(&db.changed, &db.lock);
+    n = db.len[i];
+    pthread_mutex_unlock(&db.lock);
+
+    if (n <= 0) {
+      err = -n;
+      break;
+    }
+    st->started = 1;
+    if (write_all (fdout, db.buf[i], n, st) < 0) {
+      err = errno;
+      break;
+    }
+    copied += n;
+
+    pthread_mutex_lock(&db.lock);
+    db.full[i] = 0;
+    pthread_cond_signal(&db.changed);
+    pthread_mutex_unlock(&db.lock);
+    i = !i;
+  }
+
+  pthread_mutex_lock(&db.lock);
+  db.stop = 1;
+  pthread_cond_signal(&db.changed);
+  pthread_mutex_unlock(&db.lock);
+  pthread_join(reader, NULL);
+
+  st->syscalls += db.syscalls;
+  pthread_mutex_destroy(&db.lock);
+  pthread_cond_destroy(&db.changed);
+  free(db.buf[0]);
+  free(db.buf[1]);
+  errno = err;
+  return err != 0 ? -1 : copied;
+}
+
+/*
+ * The kernel copies from file to file without the data coming up to
+ * user space at all, and some file systems share the blocks instead
+ */
+long long copy_range (int fdin, int fdout, size_t bufsz, copy_stats *st)
+{
+  long long copied = 0;
+  ssize_t n;
+
+  for (;;) {
+    n = copy_file_range (fdin, NULL, fdout, NULL, KERNEL_CHUNK, 0);
+    st->syscalls++;
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    copied += n;
+    st->started = 1;
+  }
+  return n < 0 ? -1 : copied;
+}
+
+/*
+ * sendfile() also copies inside the kernel, and works on more kinds
+ * of files than copy_file_range()
+ */
+long long copy_sendfile (int fdin, int fdout, size_t bufsz, copy_stats *st)
+{
+  long long copied = 0;
+  ssize_t n;
+
+  for (;;) {
+    n = sendfile (fdout, fdin, NULL, KERNEL_CHUNK);
+    st->syscalls++;
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    copied += n;
+    st->started = 1;
+  }
+  return n < 0 ? -1 : copied;
+}
+
+/*
+ * Move the file through a pipe with splice(), which only hands pages
+ * from one to the other. The pipe is grown to a buffer's worth when
+ * the system allows it, and each splice moves up to a pipe full.
+ */
+long long copy_splice (int fdin, int fdout, size_t bufsz, copy_stats *st)
+{
+  long long copied = 0;
+  ssize_t n, m;
+  int p[2], chunk, err = 0;
+
+  if (pipe2(p, O_CLOEXEC) < 0)
+    return -1;
+  fcntl(p[1], F_SETPIPE_SZ, bufsz);
+  chunk = fcntl(p[1], F_GETPIPE_SZ);
+  st->syscalls += 3;
+
+  for (;;) {
+    n = splice(fdin, NULL, p[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+    st->syscalls++;
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      err = n < 0 ? errno : 0;
+      break;
+    }
+    st->started = 1;
+
+    while (n > 0) {
+      m = splice(p[0], NULL, fdout, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+      st->syscalls++;
+      if (m < 0 && errno == EINTR)
+        continue;
+      if (m <= 0) {
+        err = m < 0 ? errno : EIO;
+        break;
+      }
+      n -= m;
+      copied += m;
+    }
+    if (err != 0)
+      break;
+  }
+
+  close(p[0]);
+  close(p[1]);
+  errno = err;
+  return err != 0 ? -1 : copied;
+}
+
+long long copy_uring (int fdin, int fdout, size_t bufsz, copy_stats *st)
+{
+  uring ring;
+  long long copied;
+  int err;
+
+  if (uring_init(&ring, URING_DEPTH * 2, 0) < 0)
+    return -1;
+  copied = uring_copy(&ring, fdin, fdout, URING_DEPTH, bufsz);
+  err = errno;
+  /* It does not say how far it got, so assume it did */
+  if (copied < 0)
+    st->started = 1;
+  st->syscalls += ring.enters;
+  uring_exit(&ring);
+  errno = err;
+  return copied;
+}
+
+strategy strategies[] = {
+  { "rw",              copy_rw },
+  { "direct",          copy_direct },
+  { "thread",          copy_thread },
+  { "copy_file_range", copy_range },
+  { "sendfile",        copy_sendfile },
+  { "splice",          copy_splice },
+  { "uring",           copy_uring },
+  { NULL,              NULL }
+};
+
+/*
+ * Big enough buffers make the system calls cheap next to the copying.
+ * Past AUTO_BSIZE little more is gained, unless the file system asks
+ * for bigger blocks than that.
+ */
+size_t auto_bufsz (int fdin)
+{
+  struct stat statbuf;
+
+  if (fstat(fdin, &statbuf) == 0 && statbuf.st_blksize > AUTO_BSIZE)
+    return statbuf.st_blksize;
+  return AUTO_BSIZE;
+}
+
+/*
+ * Copy with one strategy, starting again from the beginning of both
+ * files. A strategy the kernel or the files do not support falls back
+ * to read and write.
+ */
+void run (strategy *s, int fdin, int fdout, size_t bufsz, int report)
+{
+  copy_stats st = { 0 };
+  struct rusage before, after;
+  long long copied;
+  double start, elapsed, user, sys;
+
+  /* Pipes and terminals can not go back, but they are only copied once */
+  lseek(fdin, 0, SEEK_SET);
+  lseek(fdout, 0, SEEK_SET);
+  ftruncate(fdout, 0);
+
+  getrusage(RUSAGE_SELF, &before);
+  start = now();
+  copied = s->copy(fdin, fdout, bufsz, &st);
+  if (copied < 0 && s->copy != copy_rw &&
+      (errno == EINVAL || errno == ENOSYS || errno == EXDEV ||
+       errno == EPERM || errno == EOPNOTSUPP)) {
+    fprintf(stderr, "%s is not available here (%s), using rw\n", s->name,
+            strerror(errno));
+    /* Nothing moved yet means a pipe can carry on where it is */
+    if (st.started &&
+        (lseek(fdin, 0, SEEK_SET) < 0 || lseek(fdout, 0, SEEK_SET) < 0 ||
+         ftruncate(fdout, 0) < 0))
+      err_sys("can't start the copy over");
+    copied = copy_rw(fdin, fdout, bufsz, &st);
+  }
+  elapsed = now() - start;
+  getrusage(RUSAGE_SELF, &after);
+  user = cpu_seconds(&after.ru_utime) - cpu_seconds(&before.ru_utime);
+  sys = cpu_seconds(&after.ru_stime) - cpu_seconds(&before.ru_stime);
+
+  if (copied < 0) {
+    char buf[256];
+    sprintf(buf, "%s copy", s->name);
+    err_sys(buf);
+  }
+
+  if (report == REPORT_TEXT)
+    fprintf(stderr, "%-16s %lld bytes in %.3f s, %.1f MB/s, %.3f s user, "
+            "%.3f s sys, %llu system calls\n", s->name, copied, elapsed,
+            copied / 1e6 / elapsed, user, sys, st.syscalls);
+  else if (report == REPORT_CSV)
+    printf("%s,%zu,%lld,%.6f,%.1f,%.6f,%.6f,%llu\n", s->name, bufsz,
+           copied, elapsed, copied / 1e6 / elapsed, user, sys, st.syscalls);
+}
+
+void usage ()
+{
+  strategy *s;
+
+  fprintf(stderr, "usage: read_write [-s STRATEGY|all] [-u] [-v|-c] "
+          "<fromfile> <tofile> [buf_size]\n"
+          "  -s  how to copy, one of");
+  for (s = strategies; s->name != NULL; s++)
+    fprintf(stderr, " %s", s->name);
+  fprintf(stderr, "\n      (rw by default), or all of them in turn\n"
+          "  -u  the same as -s uring\n"
+          "  -v  report the time and system calls the copy took\n"
+          "  -c  report them as a CSV line of strategy, buf_size, bytes,\n"
+          "      seconds, MB/s, user and system CPU seconds, system calls\n"
+          "  buf_size is picked from the file system if left out\n");
+  exit(1);
+}
+
+int main (int argc, char *argv[])
+{
+  int fdin, fdout, opt, report = REPORT_NONE, all = 0;
+  const char *name = "rw";
+  strategy *s;
+  size_t bufsz;
+
+  while ((opt = getopt (argc, argv, "s:uvc")) != -1) {
+    switch (opt) {
+    case 's': name = optarg; break;
+    case 'u': name = "uring"; break;
+    case 'v': report = REPORT_TEXT; break;
+    case 'c': report = REPORT_CSV; break;
+    default: usage();
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if (argc != 3 && argc != 4)
+    usage();
+
+  all = strcmp(name, "all") == 0;
+  for (s = strategies; s->name != NULL && !all; s++)
+    if (strcmp(s->name, name) == 0)
+      break;
+  if (s->name == NULL && !all)
+    usage();
 
   /* open the input file */
   if ((fdin = open (argv[1], O_RDONLY)) < 0) {
@@ -43,14 +562,18 @@ int main (int argc, char *argv[])
     exit(errno);
   }
 
-  /* Allocate a buffer of the size specified */
-  bufsz = atoi(argv[3]);
-  src = malloc(bufsz);
-  
-  /* And use it to copy the file */
-  while ((read (fdin, src, bufsz)) > 0) {
-    write (fdout, src, bufsz);
-  }
-} /* main */
+  bufsz = argc == 4 ? strtoul(argv[3], NULL, 10) : auto_bufsz(fdin);
+  if (bufsz == 0)
+    err_quit ("buf_size must be positive");
 
+  if (all) {
+    for (s = strategies; s->name != NULL; s++)
+      run(s, fdin, fdout, bufsz, report ? report : REPORT_TEXT);
+  } else {
+    run(s, fdin, fdout, bufsz, report);
+  }
 
+  close(fdin);
+  close(fdout);
+  return 0;
+} /* main */
@@ -8,13 +8,16 @@
 #include <pthread.h>
 #include <sys/types.h>
 #include <linux/unistd.h>
+#include <fcntl.h>
+#include <time.h>
 
 #define gettid() syscall(__NR_gettid)
 
 #define NUM_PHILS 5
 #define MAX_BUF 256
-#define NUM_CHOPS NUM_PHILS
 #define FIELDS_TO_IGNORE 13
+#define REPORT_PERIOD 5000  /* msec between progress reports */
+#define MAX_PRINTED_PHILS 10 /* Summarize the progress of more diners */
 
 #define DEADLOCK 1
 #define ACTIVE_DURATION 200
@@ -24,16 +27,40 @@ typedef struct {
   pthread_cond_t can_eat;
   int id;
   int tid;
+  int statfd;          /* SAMPLE_PREAD: stat file kept open */
+  clockid_t cpuclock;  /* SAMPLE_CLOCK: CPU time clock of the thread */
 } philosopher;
 
+/*
+ * Ways of finding out how much CPU time each diner has used.
+ * SAMPLE_STAT opens and parses the stat file with stdio on every
+ * sample. SAMPLE_PREAD keeps every stat file open and re-reads it with
+ * a single pread() into a fixed buffer. SAMPLE_CLOCK skips /proc
+ * altogether and reads each thread's CPU time clock, which only knows
+ * the total of user and system time.
+ */
+typedef enum {
+  SAMPLE_STAT,
+  SAMPLE_PREAD,
+  SAMPLE_CLOCK
+} sample_method;
+
 /* GLOBALS */
-static philosopher diners[NUM_PHILS];
+static int num_phils = NUM_PHILS;
+static philosopher *diners;
 static int stop=0;
-static pthread_mutex_t chopstick[NUM_CHOPS];
-static unsigned long user_progress[NUM_PHILS];
-static unsigned long user_time[NUM_PHILS];
-static unsigned long sys_progress[NUM_PHILS];
-static unsigned long sys_time[NUM_PHILS];
+static int deadlock_order = DEADLOCK;
+static sample_method method = SAMPLE_STAT;
+static pthread_mutex_t *chopstick;
+static unsigned long *user_progress;
+static unsigned long *user_time;
+static unsigned long *sys_progress;
+static unsigned long *sys_time;
+static long ticks_per_sec;
+
+/* Cost of sampling, to show how much monitoring disturbs the diners */
+static unsigned long num_samples;
+static unsigned long long sample_ns;
 
 
 /*
@@ -41,7 +68,7 @@ static unsigned long sys_time[NUM_PHILS];
  */
 pthread_mutex_t *right_chop (philosopher *p)
 {
-  return &chopstick[(p->id == 0 ? NUM_CHOPS-1 : (p->id)-1)];
+  return &chopstick[(p->id == 0 ? num_phils-1 : (p->id)-1)];
 }
 
 pthread_mutex_t *left_chop (philosopher *p)
@@ -51,12 +78,12 @@ pthread_mutex_t *left_chop (philosopher *p)
 
 philosopher *left_phil (philosopher *p)
 {
-  return &diners[(p->id == 0 ? NUM_PHILS-1 : (p->id)-1)];
+  return &diners[(p->id == 0 ? num_phils-1 : (p->id)-1)];
 }
 
 philosopher *right_phil (philosopher *p)
 {
-  return &diners[(p->id == (NUM_PHILS-1) ? 0 : (p->id)+1)];
+  return &diners[(p->id == (num_phils-1) ? 0 : (p->id)+1)];
 }
 
 /*
@@ -115,24 +142,22 @@ static void *dp_thread(void *arg)
     /*
      * Grab both chopsticks
      */
-#if DEADLOCK
-    /*
-     * This order results in deadlock
-     */
-    pthread_mutex_lock(left_chop(me));
-    pthread_mutex_lock(right_chop(me));
-#else
-    /*
-     * This order avoids deadlock
-     */
-    if(me->id % 2 == 0) {
+    if (deadlock_order) {
+      /*
+       * This order results in deadlock
+       */
+      pthread_mutex_lock(left_chop(me));
+      pthread_mutex_lock(right_chop(me));
+    } else if(me->id % 2 == 0) {
+      /*
+       * This order avoids deadlock
+       */
       pthread_mutex_lock(left_chop(me));
       pthread_mutex_lock(right_chop(me));
     } else {
       pthread_mutex_lock(right_chop(me));
       pthread_mutex_lock(left_chop(me));
     }
-#endif
 
     /*
      * Eat some random amount of food
@@ -154,12 +179,25 @@ static void *dp_thread(void *arg)
 void set_table()
 {
   int i;
+  char filename[MAX_BUF];
+
+  diners = calloc(num_phils, sizeof(philosopher));
+  chopstick = calloc(num_phils, sizeof(pthread_mutex_t));
+  user_progress = calloc(num_phils, sizeof(unsigned long));
+  user_time = calloc(num_phils, sizeof(unsigned long));
+  sys_progress = calloc(num_phils, sizeof(unsigned long));
+  sys_time = calloc(num_phils, sizeof(unsigned long));
+  if (!diners || !chopstick || !user_progress || !user_time ||
+      !sys_progress || !sys_time) {
+    perror("calloc");
+    exit(1);
+  }
 
-  for (i = 0; i < NUM_CHOPS; i++) {
+  for (i = 0; i < num_phils; i++) {
     pthread_mutex_init(&chopstick[i], NULL);
   }
 
-  for (i = 0; i < NUM_PHILS; i++) {
+  for (i = 0; i < num_phils; i++) {
     diners[i].id = i;
     diners[i].tid = -1;
     user_progress[i] = 0;
@@ -168,7 +206,7 @@ void set_table()
     sys_time[i] = 0;
   }
 
-  for (i = 0; i < NUM_PHILS; i++) {
+  for (i = 0; i < num_phils; i++) {
     pthread_create(&(diners[i].thread), NULL, dp_thread, &diners[i]);
   }
 
@@ -176,20 +214,69 @@ void set_table()
    * Stall until the diners initialize their tids
    */
   i = 0;
-  while (i < NUM_PHILS) {
+  while (i < num_phils) {
     if(diners[i].tid != -1) i++;
     else sleep(1);
   }
+
+  /*
+   * Everything that can be looked up once is looked up here, so that
+   * each sample costs as little as possible.
+   */
+  for (i = 0; i < num_phils; i++) {
+    diners[i].statfd = -1;
+
+    if (method == SAMPLE_PREAD) {
+      sprintf(filename, "/proc/self/task/%d/stat", diners[i].tid);
+      diners[i].statfd = open(filename, O_RDONLY | O_CLOEXEC);
+      if (diners[i].statfd < 0) {
+        perror(filename);
+        exit(1);
+      }
+    } else if (method == SAMPLE_CLOCK) {
+      if (pthread_getcpuclockid(diners[i].thread, &diners[i].cpuclock)) {
+        fprintf(stderr, "Cannot get the CPU clock of diner %d\n", i);
+        exit(1);
+      }
+    }
+  }
 }
 
 void print_progress()
 {
   int i;
+  int min, max;
+  unsigned long total;
 
   char buf[MAX_BUF];
 
-  printf ("\nUser time:\t");
-  for (i = 0; i < NUM_PHILS; i++) {
+  /*
+   * A row per diner stops being readable long before hundreds of
+   * diners, so past that only print the spread of their progress.
+   */
+  if (num_phils > MAX_PRINTED_PHILS) {
+    min = max = 0;
+    total = 0;
+    for (i = 0; i < num_phils; i++) {
+      unsigned long prog = user_progress[i] + sys_progress[i];
+      if (prog < user_progress[min] + sys_progress[min])
+        min = i;
+      if (prog > user_progress[max] + sys_progress[max])
+        max = i;
+      total += prog;
+    }
+    printf("\nCPU progress:\ttotal %lu  min %lu (p%d)  max %lu (p%d)\n",
+           total, user_progress[min] + sys_progress[min], min,
+           user_progress[max] + sys_progress[max], max);
+    return;
+  }
+
+  /*
+   * The CPU time clocks do not split user and system time, so
+   * SAMPLE_CLOCK reports all of it as user time.
+   */
+  printf (method == SAMPLE_CLOCK ? "\nCPU time:\t" : "\nUser time:\t");
+  for (i = 0; i < num_phils; i++) {
     sprintf(buf, "%lu / %lu", user_progress[i], user_time[i]);
     if (strlen(buf) < 8)
       printf("%s\t\t", buf);
@@ -197,8 +284,13 @@ void print_progress()
       printf("%s\t", buf);
   }
 
+  if (method == SAMPLE_CLOCK) {
+    printf("\n");
+    return;
+  }
+
   printf ("\nSystem time:\t");
-  for (i = 0; i < NUM_PHILS; i++) {
+  for (i = 0; i < num_phils; i++) {
     sprintf(buf, "%lu / %lu", sys_progress[i], sys_time[i]);
     if (strlen(buf) < 8)
       printf("%s\t\t", buf);
@@ -209,20 +301,16 @@ void print_progress()
   printf("\n");
 }
 
-int check_for_deadlock()
+/*
+ * SAMPLE_STAT: read the user and system time of diner i with stdio
+ */
+int sample_stat(int i, unsigned long *new_user_time,
+                unsigned long *new_sys_time)
 {
-  int   deadlock;
   char  filename[MAX_BUF];
-  int   i;
   int   j;
   FILE *statf;
 
-  unsigned long new_sys_time;
-  unsigned long new_user_time;
-
-  deadlock = 1;
-  for (i = 0; i < NUM_PHILS; i++) {
-
     /*
      * 1. Store the stat filename for this diner into a buffer. Use the sprintf
      * library call.
@@ -234,9 +322,8 @@ int check_for_deadlock()
      * with read only permissions.
      */
      statf = fopen(filename, "r");
-
-
-
+     if (statf == NULL)
+       return -1;
 
     /*
      * 3. Seek over uninteresting fields. Use fscanf to perform the seek.  You
@@ -248,52 +335,221 @@ int check_for_deadlock()
 			fscanf(statf, "%*s");
 		}
 
+    /*
+     * 4. Read the time values you want. Use fscanf again.
+     */
+     fscanf(statf, "%lu %lu", new_user_time, new_sys_time);
 
+    /*
+     * 6. Close the stat file stream
+     */
+     fclose(statf);
 
+  return 0;
+}
 
+/*
+ * SAMPLE_PREAD: re-read the stat file of diner i, which stays open,
+ * and pick the times out of it by hand. The fields are counted from
+ * the last ')' because the command name can hold spaces and
+ * parentheses of its own.
+ */
+int sample_pread(int i, unsigned long *new_user_time,
+                 unsigned long *new_sys_time)
+{
+  char     buf[MAX_BUF * 4];
+  char    *p, *end;
+  ssize_t  len;
+  int      field;
+
+  len = pread(diners[i].statfd, buf, sizeof(buf) - 1, 0);
+  if (len <= 0)
+    return -1;
+  buf[len] = '\0';
+
+  p = strrchr(buf, ')');
+  if (p == NULL)
+    return -1;
+  end = buf + len;
+
+  /* The state is field 3, the times are fields 14 and 15 */
+  for (field = 2; field <= FIELDS_TO_IGNORE && p < end; p++)
+    if (*p == ' ')
+      field++;
+
+  *new_user_time = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; p++)
+    *new_user_time = *new_user_time * 10 + (*p - '0');
+  if (p++ >= end)
+    return -1;
+
+  *new_sys_time = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; p++)
+    *new_sys_time = *new_sys_time * 10 + (*p - '0');
 
+  return 0;
+}
 
-    /*
-     * 4. Read the time values you want. Use fscanf again.
-     */
-     fscanf(statf, "%lu %lu", &new_user_time, &new_sys_time);
+/*
+ * SAMPLE_CLOCK: read the CPU time clock of diner i, converted to the
+ * clock ticks /proc uses so that all the methods print the same units
+ */
+int sample_clock(int i, unsigned long *new_user_time,
+                 unsigned long *new_sys_time)
+{
+  struct timespec ts;
+
+  if (clock_gettime(diners[i].cpuclock, &ts))
+    return -1;
+
+  *new_user_time = ts.tv_sec * ticks_per_sec +
+                   ts.tv_nsec / (1000000000 / ticks_per_sec);
+  *new_sys_time = 0;
+  return 0;
+}
 
+/*
+ * Add the CPU time each diner used since the last sample to its
+ * progress in the current report period
+ */
+void take_sample()
+{
+  int   i;
+  int   ret;
+  struct timespec start, end;
+
+  unsigned long new_sys_time;
+  unsigned long new_user_time;
 
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (i = 0; i < num_phils; i++) {
+    switch (method) {
+    case SAMPLE_PREAD:
+      ret = sample_pread(i, &new_user_time, &new_sys_time);
+      break;
+    case SAMPLE_CLOCK:
+      ret = sample_clock(i, &new_user_time, &new_sys_time);
+      break;
+    default:
+      ret = sample_stat(i, &new_user_time, &new_sys_time);
+      break;
+    }
+
+    if (ret) {
+      fprintf(stderr, "Cannot sample diner %d\n", i);
+      exit(1);
+    }
 
     /*
      * 5. Use time values to determine if deadlock has occurred.
      */
      if (new_sys_time > sys_time[i] || new_user_time > user_time[i])
 		{
-			sys_progress[i] = new_sys_time - sys_time[i];
-			user_progress[i] = new_user_time - user_time[i];
+			sys_progress[i] += new_sys_time - sys_time[i];
+			user_progress[i] += new_user_time - user_time[i];
 			sys_time[i] = new_sys_time;
 			user_time[i] = new_user_time;
-			deadlock = 0;
 	  }
+  }
 
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  num_samples++;
+  sample_ns += (end.tv_sec - start.tv_sec) * 1000000000ULL +
+               end.tv_nsec - start.tv_nsec;
+}
 
+/*
+ * Deadlock has occurred if no diner used any CPU time during the
+ * report period
+ */
+int check_for_deadlock()
+{
+  int i;
 
+  for (i = 0; i < num_phils; i++)
+    if (user_progress[i] || sys_progress[i])
+      return 0;
 
+  return 1;
+}
 
+void print_sampling_cost()
+{
+  struct timespec self;
 
+  if (num_samples == 0)
+    return;
 
-    /*
-     * 6. Close the stat file stream
-     */
-     fclose(statf);
-  }
-
-  return deadlock;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &self);
+  printf("Sampling:\t%lu samples, %.1f us each (%.2f us per diner), "
+         "monitor CPU %.3f s\n", num_samples,
+         sample_ns / 1e3 / num_samples,
+         sample_ns / 1e3 / num_samples / num_phils,
+         self.tv_sec + self.tv_nsec / 1e9);
 }
 
+void usage(char *prog)
+{
+  fprintf(stderr, "Usage: %s [-n DINERS] [-m stat|pread|clock] "
+          "[-i MSEC] [-s]\n", prog);
+  fprintf(stderr, "  -i  time between samples (default %d)\n",
+          REPORT_PERIOD);
+  fprintf(stderr, "  -s  pick up the chopsticks in the order that "
+          "avoids deadlock\n");
+  exit(1);
+}
 
 int main(int argc, char **argv)
 {
   int i;
+  int opt;
   int deadlock;
+  int interval = REPORT_PERIOD;
+  int samples_per_report;
+  int s;
   deadlock = 0;
 
+  while ((opt = getopt(argc, argv, "n:m:i:s")) != -1) {
+    switch (opt) {
+    case 'n':
+      num_phils = atoi(optarg);
+      break;
+    case 'i':
+      interval = atoi(optarg);
+      break;
+    case 's':
+      deadlock_order = 0;
+      break;
+    case 'm':
+      if (strcmp(optarg, "stat") == 0)
+        method = SAMPLE_STAT;
+      else if (strcmp(optarg, "pread") == 0)
+        method = SAMPLE_PREAD;
+      else if (strcmp(optarg, "clock") == 0)
+        method = SAMPLE_CLOCK;
+      else
+        usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (num_phils < 2 || interval < 1)
+    usage(argv[0]);
+
+  ticks_per_sec = sysconf(_SC_CLK_TCK);
+
+  /*
+   * Sample as often as asked, but keep reporting and checking for
+   * deadlock every REPORT_PERIOD. The /proc times only move in clock
+   * ticks, so a single short interval says nothing about deadlock.
+   */
+  samples_per_report = REPORT_PERIOD / interval;
+  if (samples_per_report < 1)
+    samples_per_report = 1;
+
   srand(time(NULL));
 
   set_table();
@@ -302,7 +558,10 @@ int main(int argc, char **argv)
     /*
      * Let the philosophers do some thinking and eating
      */
-    sleep(5);
+    for (s = 0; s < samples_per_report; s++) {
+      usleep(interval * 1000);
+      take_sample();
+    }
 
     /*
      * Check for deadlock (i.e. none of the philosophers are
@@ -319,6 +578,12 @@ int main(int argc, char **argv)
      * Print out the philosophers progress
      */
     print_progress();
+    print_sampling_cost();
+
+    for (i = 0; i < num_phils; i++) {
+      user_progress[i] = 0;
+      sys_progress[i] = 0;
+    }
   } while (!deadlock);
 
   stop = 1;
@@ -327,13 +592,13 @@ int main(int argc, char **argv)
   /*
    * Release all locks so philosophers can exit
    */
-  for (i = 0; i < NUM_CHOPS; i++)
+  for (i = 0; i < num_phils; i++)
     pthread_mutex_unlock(&chopstick[i]);
 
   /*
    * Wait for philosophers to finish
    */
-  for (i = 0; i < NUM_PHILS; i++)
+  for (i = 0; i < num_phils; i++)
     pthread_join(diners[i].thread, NULL);
 
   return 0;
@@ -0,0 +1,311 @@
+/*
+ * Reads the whole process table out of /proc in one pass. See
+ * proctable.h.
+ *
+ * The directory is listed with getdents64 straight into a buffer and
+ * every stat file is opened relative to the /proc descriptor, read
+ * with one read() into a stack buffer and parsed in place, so a scan
+ * costs three system calls per process and nothing else.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "proctable.h"
+
+#define DIRENT_BUF     32768
+#define STAT_BUF        1024
+#define SCAN_CHUNK        64  /* pids a scan thread claims at a time */
+#define MAX_SCAN_THREADS  64
+#define FIRST_FIELD        4  /* ppid, the first field after state */
+#define LAST_FIELD        41  /* policy */
+#define MIN_FIELDS        24  /* rss, older kernels stop earlier */
+
+struct linux_dirent64 {
+  unsigned long long d_ino;
+  long long          d_off;
+  unsigned short     d_reclen;
+  unsigned char      d_type;
+  char               d_name[];
+};
+
+typedef struct {
+  proc_table *t;
+  size_t      num_pids;
+  size_t      next;      /* Next pid index to claim */
+} scan_job;
+
+/*
+ * Parse one decimal field, skipping the space in front of it
+ */
+static const char *parse_field(const char *p, const char *end,
+                               long long *val)
+{
+  int neg = 0;
+  unsigned long long v = 0;
+
+  while (p < end && *p == ' ')
+    p++;
+  if (p < end && *p == '-') {
+    neg = 1;
+    p++;
+  }
+  if (p >= end || *p < '0' || *p > '9')
+    return NULL;
+  for (; p < end && *p >= '0' && *p <= '9'; p++)
+    v = v * 10 + (*p - '0');
+
+  *val = neg ? -(long long) v : (long long) v;
+  return p;
+}
+
+int proc_parse_stat(const char *buf, size_t len, proc_stat *ps)
+{
+  const char *end = buf + len;
+  const char *open, *close, *p;
+  long long f[LAST_FIELD + 1];
+  long long pid;
+  size_t comm_len;
+  int i;
+
+  /*
+   * The command name is in parentheses and may itself hold spaces
+   * and parentheses, so it runs up to the last ')' in the line.
+   */
+  open = memchr(buf, '(', len);
+  for (close = end - 1; close > buf && *close != ')'; close--)
+    ;
+  if (open == NULL || close <= open || close + 2 >= end)
+    return -1;
+
+  if (parse_field(buf, open, &pid) == NULL)
+    return -1;
+
+  comm_len = close - open - 1;
+  if (comm_len >= PROC_COMM_LEN)
+    comm_len = PROC_COMM_LEN - 1;
+  memcpy(ps->tcomm, open + 1, comm_len);
+  ps->tcomm[comm_len] = '\0';
+  ps->state = close[2];
+
+  memset(f, 0, sizeof(f));
+  p = close + 3;
+  for (i = FIRST_FIELD; i <= LAST_FIELD; i++) {
+    p = parse_field(p, end, &f[i]);
+    if (p == NULL) {
+      if (i <= MIN_FIELDS)
+        return -1;
+      break;
+    }
+  }
+
+  ps->pid = pid;
+  ps->ppid = f[4];
+  ps->pgid = f[5];
+  ps->sid = f[6];
+  ps->tty_nr = f[7];
+  ps->tty_pgrp = f[8];
+  ps->flags = f[9];
+  ps->min_flt = f[10];
+  ps->cmin_flt = f[11];
+  ps->maj_flt = f[12];
+  ps->cmaj_flt = f[13];
+  ps->utime = f[14];
+  ps->stime = f[15];
+  ps->cutime = f[16];
+  ps->cstime = f[17];
+  ps->priority = f[18];
+  ps->nice = f[19];
+  ps->num_threads = f[20];
+  ps->start_time = f[22];
+  ps->vsize = f[23];
+  ps->rss = f[24];
+  ps->cpu = f[39];
+  ps->rt_priority = f[40];
+  ps->policy = f[41];
+  return 0;
+}
+
+int proc_table_init(proc_table *t)
+{
+  memset(t, 0, sizeof(*t));
+  t->procfd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  return t->procfd < 0 ? -1 : 0;
+}
+
+void proc_table_free(proc_table *t)
+{
+  if (t->procfd >= 0)
+    close(t->procfd);
+  free(t->procs);
+  free(t->pids);
+  memset(t, 0, sizeof(*t));
+  t->procfd = -1;
+}
+
+static int compare_pids(const void *a, const void *b)
+{
+  return *(const int *) a - *(const int *) b;
+}
+
+/*
+ * Collect the pid of every process directory in /proc, sorted
+ */
+static long list_pids(proc_table *t)
+{
+  char buf[DIRENT_BUF];
+  struct linux_dirent64 *d;
+  size_t num = 0;
+  long n, off;
+  const char *c;
+  int pid;
+  int *pids;
+
+  if (lseek(t->procfd, 0, SEEK_SET) < 0)
+    return -1;
+
+  while ((n = syscall(SYS_getdents64, t->procfd, buf, sizeof(buf))) > 0) {
+    for (off = 0; off < n; off += d->d_reclen) {
+      d = (struct linux_dirent64 *) (buf + off);
+      if (d->d_name[0] < '1' || d->d_name[0] > '9')
+        continue;
+
+      pid = 0;
+      for (c = d->d_name; *c >= '0' && *c <= '9'; c++)
+        pid = pid * 10 + (*c - '0');
+      if (*c != '\0')
+        continue;
+
+      if (num == t->pids_cap) {
+        t->pids_cap = t->pids_cap ? t->pids_cap * 2 : 1024;
+        pids = realloc(t->pids, t->pids_cap * sizeof(int));
+        if (pids == NULL)
+          return -1;
+        t->pids = pids;
+      }
+      t->pids[num++] = pid;
+    }
+  }
+  if (n < 0)
+    return -1;
+
+  /* /proc lists pids in order already, but nothing promises that */
+  qsort(t->pids, num, sizeof(int), compare_pids);
+  return num;
+}
+
+/*
+ * Read stat files until every pid has been claimed. A process that
+ * exits before its file is read gets a pid of 0.
+ */
+static void *scan_thread(void *arg)
+{
+  scan_job *job = arg;
+  proc_table *t = job->t;
+  char name[32];
+  char buf[STAT_BUF];
+  size_t i, first, last;
+  ssize_t n;
+  int fd;
+
+  for (;;) {
+    first = __atomic_fetch_add(&job->next, SCAN_CHUNK, __ATOMIC_RELAXED);
+    if (first >= job->num_pids)
+      break;
+    last = first + SCAN_CHUNK < job->num_pids ? first + SCAN_CHUNK
+                                               : job->num_pids;
+
+    for (i = first; i < last; i++) {
+      t->procs[i].pid = 0;
+      snprintf(name, sizeof(name), "%d/stat", t->pids[i]);
+      fd = openat(t->procfd, name, O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        continue;
+      n = read(fd, buf, sizeof(buf));
+      close(fd);
+      if (n <= 0 || proc_parse_stat(buf, n, &t->procs[i]) != 0)
+        t->procs[i].pid = 0;
+    }
+  }
+
+  return NULL;
+}
+
+long proc_table_scan(proc_table *t, int nthreads)
+{
+  scan_job job;
+  pthread_t threads[MAX_SCAN_THREADS];
+  proc_stat *procs;
+  long num;
+  size_t i, j;
+  int k;
+
+  num = list_pids(t);
+  if (num < 0)
+    return -1;
+
+  if ((size_t) num > t->cap) {
+    procs = realloc(t->procs, t->pids_cap * sizeof(proc_stat));
+    if (procs == NULL)
+      return -1;
+    t->procs = procs;
+    t->cap = t->pids_cap;
+  }
+
+  job.t = t;
+  job.num_pids = num;
+  job.next = 0;
+
+  /* Threads only pay for themselves with plenty of work each */
+  if (nthreads > MAX_SCAN_THREADS)
+    nthreads = MAX_SCAN_THREADS;
+  if (nthreads > (num + SCAN_CHUNK - 1) / SCAN_CHUNK)
+    nthreads = (num + SCAN_CHUNK - 1) / SCAN_CHUNK;
+
+  if (nthreads <= 1) {
+    scan_thread(&job);
+  } else {
+    for (k = 0; k < nthreads - 1; k++)
+      if (pthread_create(&threads[k], NULL, scan_thread, &job) != 0)
+        break;
+    scan_thread(&job);
+    while (k-- > 0)
+      pthread_join(threads[k], NULL);
+  }
+
+  /* Squeeze out the processes that went away */
+  for (i = j = 0; i < (size_t) num; i++) {
+    if (t->procs[i].pid == 0)
+      continue;
+    if (i != j)
+      t->procs[j] = t->procs[i];
+    j++;
+  }
+
+  t->num_procs = j;
+  return j;
+}
+
+proc_stat *proc_table_find(proc_table *t, int pid)
+{
+  size_t lo = 0, hi = t->num_procs, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (t->procs[mid].pid == pid)
+      return &t->procs[mid];
+    if (t->procs[mid].pid < pid)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return NULL;
+}
@@ -0,0 +1,83 @@
+/*
+ * Reads the whole process table out of /proc in one pass.
+ *
+ * The fields of /proc/<pid>/stat keep the names procstat.c prints
+ * them under. A proc_table keeps its buffers and its /proc directory
+ * between scans, so refreshing it does no allocation once it has
+ * grown to the number of processes on the host.
+ */
+
+#ifndef PROCTABLE_H
+#define PROCTABLE_H
+
+#include <stddef.h>
+
+#define PROC_COMM_LEN 64
+
+typedef struct {
+  int                 pid;
+  char                tcomm[PROC_COMM_LEN];
+  char                state;
+  int                 ppid;
+  int                 pgid;
+  int                 sid;
+  int                 tty_nr;
+  int                 tty_pgrp;
+  unsigned long       flags;
+  unsigned long       min_flt;
+  unsigned long       cmin_flt;
+  unsigned long       maj_flt;
+  unsigned long       cmaj_flt;
+  unsigned long       utime;        /* clock ticks */
+  unsigned long       stime;        /* clock ticks */
+  long                cutime;       /* clock ticks */
+  long                cstime;       /* clock ticks */
+  long                priority;
+  long                nice;
+  long                num_threads;
+  unsigned long long  start_time;   /* clock ticks since boot */
+  unsigned long       vsize;        /* bytes */
+  long                rss;          /* pages */
+  int                 cpu;          /* CPU it last ran on */
+  unsigned int        rt_priority;
+  unsigned int        policy;
+} proc_stat;
+
+typedef struct {
+  proc_stat *procs;      /* One entry per process, sorted by pid */
+  size_t     num_procs;
+  size_t     cap;
+  int       *pids;       /* Scratch list of the pids in /proc */
+  size_t     pids_cap;
+  int        procfd;     /* Open /proc directory */
+} proc_table;
+
+/*
+ * Parse the contents of a stat file. buf does not need to be
+ * terminated and is not modified. Returns 0 on success or -1 if buf
+ * is not a stat line.
+ */
+int proc_parse_stat(const char *buf, size_t len, proc_stat *ps);
+
+/*
+ * Open /proc for a table with no processes in it. Returns 0 on
+ * success or -1 with errno set.
+ */
+int proc_table_init(proc_table *t);
+
+/*
+ * Replace the contents of the table with every process that is
+ * running now, reading the stat files with nthreads threads.
+ * Processes that exit during the scan are left out. Returns the number
+ * of processes or -1 with errno set.
+ */
+long proc_table_scan(proc_table *t, int nthreads);
+
+/*
+ * Find pid in a scanned table, or NULL if it is not there
+ */
+proc_stat *proc_table_find(proc_table *t, int pid);
+
+void proc_table_free(proc_table *t);
+
+#endif
@@ -0,0 +1,170 @@
+/*
+ * A small top built on proctable. Every refresh scans the whole
+ * process table and sorts the processes by the CPU they used since
+ * the last refresh.
+ *
+ * Build: make ptop
+ * Usage: ptop [-d SECONDS] [-n REFRESHES] [-j THREADS] [-k LINES]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "proctable.h"
+
+#define DEFAULT_DELAY  2.0
+#define DEFAULT_LINES   20
+
+typedef struct {
+  double     pct;
+  proc_stat *ps;
+} row;
+
+long tickspersec;
+long pagesize;
+
+double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_rows(const void *a, const void *b)
+{
+  const row *ra = a, *rb = b;
+
+  if (ra->pct != rb->pct)
+    return ra->pct < rb->pct ? 1 : -1;
+  return ra->ps->pid - rb->ps->pid;
+}
+
+/*
+ * CPU ticks cur used since prev was scanned. A pid that was reused
+ * in between has a different start time, so all of its time is new.
+ */
+unsigned long cpu_delta(proc_table *prev, proc_stat *cur)
+{
+  proc_stat *old = proc_table_find(prev, cur->pid);
+  unsigned long total = cur->utime + cur->stime;
+
+  if (old == NULL || old->start_time != cur->start_time)
+    return total;
+  return total - (old->utime + old->stime);
+}
+
+void usage(char *prog)
+{
+  fprintf(stderr, "Usage: %s [-d SECONDS] [-n REFRESHES] [-j THREADS] "
+          "[-k LINES]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  proc_table  tables[2];
+  proc_table *cur, *prev, *tmp;
+  row        *rows = NULL;
+  size_t      rows_cap = 0;
+  double      delay = DEFAULT_DELAY;
+  double      last, start, scan_time;
+  int         refreshes = -1;
+  int         nthreads = 1;
+  int         lines = DEFAULT_LINES;
+  int         clear = isatty(STDOUT_FILENO);
+  int         opt, running;
+  size_t      i;
+  long        n;
+
+  while ((opt = getopt(argc, argv, "d:n:j:k:")) != -1) {
+    switch (opt) {
+    case 'd': delay = atof(optarg); break;
+    case 'n': refreshes = atoi(optarg); break;
+    case 'j': nthreads = atoi(optarg); break;
+    case 'k': lines = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+
+  if (delay <= 0 || nthreads < 1 || lines < 1)
+    usage(argv[0]);
+
+  tickspersec = sysconf(_SC_CLK_TCK);
+  pagesize = sysconf(_SC_PAGESIZE);
+
+  if (proc_table_init(&tables[0]) || proc_table_init(&tables[1])) {
+    perror("open /proc");
+    return 1;
+  }
+  cur = &tables[0];
+  prev = &tables[1];
+
+  /* The first refresh needs something to take the deltas from */
+  if (proc_table_scan(prev, nthreads) < 0) {
+    perror("scan /proc");
+    return 1;
+  }
+  last = now();
+
+  while (refreshes < 0 || refreshes-- > 0) {
+    usleep(delay * 1e6);
+
+    start = now();
+    n = proc_table_scan(cur, nthreads);
+    scan_time = now() - start;
+    if (n < 0) {
+      perror("scan /proc");
+      return 1;
+    }
+
+    if (cur->num_procs > rows_cap) {
+      rows_cap = cur->cap;
+      free(rows);
+      rows = malloc(rows_cap * sizeof(row));
+      if (rows == NULL) {
+        perror("malloc");
+        return 1;
+      }
+    }
+
+    running = 0;
+    for (i = 0; i < cur->num_procs; i++) {
+      rows[i].ps = &cur->procs[i];
+      rows[i].pct = cpu_delta(prev, &cur->procs[i]) * 100.0 /
+                    tickspersec / (start - last);
+      if (cur->procs[i].state == 'R')
+        running++;
+    }
+    qsort(rows, cur->num_procs, sizeof(row), compare_rows);
+
+    if (clear)
+      printf("\033[H\033[J");
+    printf("%zu processes, %d running, scanned in %.2f ms with %d "
+           "thread%s\n\n", cur->num_procs, running, scan_time * 1e3,
+           nthreads, nthreads == 1 ? "" : "s");
+    printf("%7s %1s %6s %10s %4s %s\n", "PID", "S", "%CPU", "RSS KiB",
+           "THR", "COMMAND");
+    for (i = 0; i < cur->num_procs && i < (size_t) lines; i++)
+      printf("%7d %c %6.1f %10ld %4ld %s\n", rows[i].ps->pid,
+             rows[i].ps->state, rows[i].pct,
+             rows[i].ps->rss * (pagesize / 1024), rows[i].ps->num_threads,
+             rows[i].ps->tcomm);
+    if (!clear)
+      printf("\n");
+    fflush(stdout);
+
+    tmp = prev;
+    prev = cur;
+    cur = tmp;
+    last = start;
+  }
+
+  free(rows);
+  proc_table_free(&tables[0]);
+  proc_table_free(&tables[1]);
+  return 0;
+}
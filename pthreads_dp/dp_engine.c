@@ -0,0 +1,645 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
+
+/*
+ * One engine for all the dining philosophers solutions. The number of
+ * philosophers and the strategy used to get the chopsticks are picked
+ * at run time, so the same code can be used to compare how the
+ * solutions behave with 5 philosophers or with thousands of them.
+ *
+ * The defaults match the other programs in this directory. The
+ * maximum thinking and eating periods can be changed from the command
+ * line to tune how much of its time a philosopher spends holding
+ * chopsticks.
+ */
+#define NUM_PHILS                     5
+#define MAX_PHIL_THINK_PERIOD      1000
+#define MAX_PHIL_EAT_PERIOD         100
+#define RUN_PERIOD                    5
+#define ACCOUNTING_PERIOD             1
+#define CACHE_LINE                   64
+#define THREAD_STACK_SIZE     (64*1024)
+#define MAX_BACKOFF                1024
+
+/*
+ * Wait times are kept in a log-linear histogram: exact below
+ * HIST_SUB nanoseconds, then HIST_SUB buckets for every power of
+ * two. That keeps each percentile within 12.5% of the real value
+ * while the histogram stays small enough to give every philosopher
+ * its own.
+ */
+#define HIST_SUB_BITS                 3
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS    ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/*
+ * Structure defining a philosopher and any state we need to know
+ * about to print out interesting data. It fills whole cache lines so
+ * that a philosopher updating its own counters never slows down its
+ * neighbors.
+ */
+typedef struct {
+  int                 id;        /* Int ID number assigned by
+                                    set_table() */
+  pthread_cond_t      can_eat;   /* Condition var used in the WAITER
+                                    SOLUTION */
+  unsigned int        seed;      /* Private rand_r() state */
+  long                meals;     /* Meals eaten so far */
+  long                retries;   /* Times both chopsticks were put
+                                    back in the TRYLOCK SOLUTION */
+  unsigned long long  wait_max;  /* Longest time spent hungry (ns) */
+  unsigned int       *wait_hist; /* Histogram of time spent hungry */
+  pthread_t           thread;    /* Thread structure for this
+                                    philosopher */
+} __attribute__((aligned(CACHE_LINE))) philosopher;
+
+/*
+ * Each chopstick is shared between two philosophers. Every strategy
+ * only uses the fields it needs.
+ */
+typedef struct {
+  pthread_mutex_t lock;      /* Held while eating (ASYMMETRIC and
+                                TRYLOCK) or while looking at the
+                                fields below (CHANDY/MISRA) */
+  pthread_cond_t  cond;      /* CHANDY/MISRA: signalled when the
+                                chopstick gets dirty */
+  int             owner;     /* CHANDY/MISRA: philosopher holding
+                                the chopstick */
+  int             dirty;     /* CHANDY/MISRA: used since it was last
+                                handed over */
+  int             in_use;    /* CHANDY/MISRA: owner is eating */
+  int             waiting;   /* CHANDY/MISRA: neighbors in cond */
+  int             available; /* WAITER: not held by either neighbor */
+} __attribute__((aligned(CACHE_LINE))) chopstick_t;
+
+typedef struct {
+  const char *name;
+  void (*pick_up)(philosopher *p);
+  void (*put_down)(philosopher *p);
+} strategy;
+
+/* GLOBALS */
+philosopher *Diners;
+chopstick_t *Chopsticks;
+int          Num_phils = NUM_PHILS;
+int          Think_period = MAX_PHIL_THINK_PERIOD;
+int          Eat_period = MAX_PHIL_EAT_PERIOD;
+int          Stop = 0;
+
+/*
+ * Philosophers wait here until everyone is seated. Otherwise, with
+ * fewer CPUs than philosophers, main() competes with every philosopher
+ * already eating and creating thousands of them takes minutes.
+ */
+static pthread_barrier_t seated;
+
+/* WAITER SOLUTION uses this lock to guard every available flag */
+static pthread_mutex_t waiter = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Helper functions for grabbing chopsticks, referencing neighbors.
+ * Numbering assumptions are the same as the other programs:
+ *   - Left philosopher is (number + 1) modulo Num_phils
+ *   - Right philosopher is (number - 1) modulo Num_phils
+ *   - Left chopstick has same number as philosopher
+ *   - Right chopstick is (philosopher number - 1) modulo Num_phils
+ */
+philosopher *left_phil (philosopher *p)
+{
+  return &Diners[(p->id == (Num_phils-1) ? 0 : (p->id)+1)];
+}
+
+philosopher *right_phil (philosopher *p)
+{
+  return &Diners[(p->id == 0 ? (Num_phils-1) : (p->id)-1)];
+}
+
+chopstick_t *left_chop (philosopher *p)
+{
+  return &Chopsticks[p->id];
+}
+
+chopstick_t *right_chop (philosopher *p)
+{
+  return &Chopsticks[(p->id == 0 ? Num_phils-1 : (p->id)-1)];
+}
+
+int stopped()
+{
+  return __atomic_load_n(&Stop, __ATOMIC_RELAXED);
+}
+
+unsigned long long now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int hist_bucket(unsigned long long v)
+{
+  int e;
+
+  if (v < HIST_SUB)
+    return v;
+
+  e = 63 - __builtin_clzll(v);
+  return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+         ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/*
+ * Smallest value that lands in bucket b
+ */
+unsigned long long hist_value(int b)
+{
+  int e;
+
+  if (b < HIST_SUB)
+    return b;
+
+  e = b / HIST_SUB + HIST_SUB_BITS - 1;
+  return (unsigned long long) (HIST_SUB + b % HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+/*
+ * Do a small amount of work that we can use to represent a
+ * philosopher thinking one thought. The engine is built optimized,
+ * so the empty asm keeps the compiler from dropping the call and the
+ * loops around it.
+ */
+__attribute__((noinline)) void think_one_thought()
+{
+  __asm__ __volatile__ ("");
+}
+
+/*
+ * Do a small amount of work that we can use to represent a
+ * philosopher eating one mouthful of food
+ */
+__attribute__((noinline)) void eat_one_mouthful()
+{
+  __asm__ __volatile__ ("");
+}
+
+/*
+ * ASYMMETRIC SOLUTION: odd philosophers pick up their right chopstick
+ * first and even ones their left, so there can never be a cycle of
+ * philosophers each waiting on the next.
+ */
+static void asymmetric_pick_up(philosopher *p)
+{
+  if (p->id % 2 != 0) {
+    pthread_mutex_lock(&right_chop(p)->lock);
+    pthread_mutex_lock(&left_chop(p)->lock);
+  } else {
+    pthread_mutex_lock(&left_chop(p)->lock);
+    pthread_mutex_lock(&right_chop(p)->lock);
+  }
+}
+
+static void mutex_put_down(philosopher *p)
+{
+  pthread_mutex_unlock(&right_chop(p)->lock);
+  pthread_mutex_unlock(&left_chop(p)->lock);
+}
+
+/*
+ * WAITER SOLUTION: a single waiter hands out both chopsticks at once.
+ * A hungry philosopher sleeps on its own condition variable, and only
+ * the two neighbors that share a chopstick with it ever wake it up.
+ */
+static void waiter_pick_up(philosopher *p)
+{
+  pthread_mutex_lock(&waiter);
+  while (!left_chop(p)->available || !right_chop(p)->available)
+    pthread_cond_wait(&p->can_eat, &waiter);
+  left_chop(p)->available = 0;
+  right_chop(p)->available = 0;
+  pthread_mutex_unlock(&waiter);
+}
+
+static void waiter_put_down(philosopher *p)
+{
+  pthread_mutex_lock(&waiter);
+  left_chop(p)->available = 1;
+  right_chop(p)->available = 1;
+  pthread_cond_signal(&left_phil(p)->can_eat);
+  pthread_cond_signal(&right_phil(p)->can_eat);
+  pthread_mutex_unlock(&waiter);
+}
+
+/*
+ * TRYLOCK SOLUTION: take the first chopstick, then only try for the
+ * second one. If it is busy put the first one back and back off for a
+ * random, exponentially growing amount of time so that two neighbors
+ * do not keep colliding.
+ */
+static void trylock_pick_up(philosopher *p)
+{
+  chopstick_t *first = left_chop(p);
+  chopstick_t *second = right_chop(p);
+  chopstick_t *tmp;
+  int backoff = 1;
+  int i, spin;
+
+  for (;;) {
+    pthread_mutex_lock(&first->lock);
+    if (pthread_mutex_trylock(&second->lock) == 0)
+      return;
+    pthread_mutex_unlock(&first->lock);
+    p->retries++;
+
+    /*
+     * Once the backoff is long, stop spinning and let the neighbor
+     * that holds the chopstick have the CPU.
+     */
+    if (backoff >= MAX_BACKOFF) {
+      sched_yield();
+    } else {
+      spin = rand_r(&p->seed) % backoff;
+      for (i = 0; i < spin; i++)
+        think_one_thought();
+      backoff *= 2;
+    }
+
+    /* Wait on the chopstick that was busy next time */
+    tmp = first;
+    first = second;
+    second = tmp;
+  }
+}
+
+/*
+ * CHANDY/MISRA SOLUTION: every chopstick always belongs to one of its
+ * two philosophers and is either clean or dirty. Eating makes both
+ * chopsticks dirty. A hungry philosopher may take a dirty chopstick
+ * that is not being eaten with, and it becomes clean; a clean one has
+ * to be left alone until its owner has eaten. Handing chopsticks out
+ * to the lower numbered philosopher at the start, all dirty, means the
+ * philosophers can never wait on each other in a cycle.
+ */
+static void cm_take(chopstick_t *c, int id)
+{
+  pthread_mutex_lock(&c->lock);
+  while (c->owner != id) {
+    if (c->dirty && !c->in_use) {
+      c->owner = id;
+      c->dirty = 0;
+    } else {
+      c->waiting++;
+      pthread_cond_wait(&c->cond, &c->lock);
+      c->waiting--;
+    }
+  }
+  pthread_mutex_unlock(&c->lock);
+}
+
+static void chandy_misra_pick_up(philosopher *p)
+{
+  chopstick_t *l = left_chop(p);
+  chopstick_t *r = right_chop(p);
+  chopstick_t *lo = l < r ? l : r;
+  chopstick_t *hi = l < r ? r : l;
+  int have_both;
+
+  /*
+   * A dirty chopstick we already hold can be taken by the neighbor
+   * while we are waiting on the other one, so check both under their
+   * locks before starting to eat and go around again if one has gone.
+   */
+  do {
+    cm_take(l, p->id);
+    cm_take(r, p->id);
+
+    pthread_mutex_lock(&lo->lock);
+    pthread_mutex_lock(&hi->lock);
+    have_both = l->owner == p->id && r->owner == p->id;
+    if (have_both) {
+      l->in_use = 1;
+      r->in_use = 1;
+    }
+    pthread_mutex_unlock(&hi->lock);
+    pthread_mutex_unlock(&lo->lock);
+  } while (!have_both);
+}
+
+static void cm_release(chopstick_t *c)
+{
+  pthread_mutex_lock(&c->lock);
+  c->in_use = 0;
+  c->dirty = 1;
+  if (c->waiting)
+    pthread_cond_signal(&c->cond);
+  pthread_mutex_unlock(&c->lock);
+}
+
+static void chandy_misra_put_down(philosopher *p)
+{
+  cm_release(right_chop(p));
+  cm_release(left_chop(p));
+}
+
+static const strategy Strategies[] = {
+  { "asymmetric", asymmetric_pick_up,   mutex_put_down },
+  { "waiter",     waiter_pick_up,       waiter_put_down },
+  { "trylock",    trylock_pick_up,      mutex_put_down },
+  { "chandy",     chandy_misra_pick_up, chandy_misra_put_down },
+};
+
+#define NUM_STRATEGIES (sizeof(Strategies) / sizeof(Strategies[0]))
+
+static const strategy *Strategy = &Strategies[0];
+
+/*
+ * Philosopher code which makes each philosopher eat and think for a
+ * random period of time, recording how long it stays hungry.
+ */
+static void *dp_thread(void *arg)
+{
+  int                 eat_rnd;
+  int                 i;
+  philosopher        *me;
+  int                 think_rnd;
+  unsigned long long  hungry, wait;
+
+  me = (philosopher *) arg;
+  pthread_barrier_wait(&seated);
+
+  while (!stopped()) {
+    think_rnd = Think_period ? rand_r(&me->seed) % Think_period : 0;
+    eat_rnd   = Eat_period ? rand_r(&me->seed) % Eat_period : 0;
+
+    for (i = 0; i < think_rnd; i++){
+      think_one_thought();
+    }
+
+    hungry = now_ns();
+    Strategy->pick_up(me);
+    wait = now_ns() - hungry;
+
+    for (i = 0; i < eat_rnd; i++){
+      eat_one_mouthful();
+    }
+
+    Strategy->put_down(me);
+
+    me->wait_hist[hist_bucket(wait)]++;
+    if (wait > me->wait_max)
+      me->wait_max = wait;
+
+    /* main() reads this while we run, so store it in one piece */
+    __atomic_store_n(&me->meals, me->meals + 1, __ATOMIC_RELAXED);
+  }
+
+  return NULL;
+}
+
+/*
+ * Set up the table with the correct number of chopsticks and
+ * philosophers and initialize everything.
+ */
+void set_table()
+{
+  int i;
+  pthread_attr_t attr;
+
+  Diners = aligned_alloc(CACHE_LINE, Num_phils * sizeof(philosopher));
+  Chopsticks = aligned_alloc(CACHE_LINE, Num_phils * sizeof(chopstick_t));
+  if (Diners == NULL || Chopsticks == NULL) {
+    perror("Failed to set the table");
+    exit(1);
+  }
+
+  /*
+   * Chopstick i sits between philosophers i and i+1. CHANDY/MISRA
+   * starts with each one dirty and held by the lower numbered of the
+   * two.
+   */
+  for (i = 0; i < Num_phils; i++) {
+    pthread_mutex_init(&Chopsticks[i].lock, NULL);
+    pthread_cond_init(&Chopsticks[i].cond, NULL);
+    Chopsticks[i].owner = i == Num_phils-1 ? 0 : i;
+    Chopsticks[i].dirty = 1;
+    Chopsticks[i].in_use = 0;
+    Chopsticks[i].waiting = 0;
+    Chopsticks[i].available = 1;
+  }
+
+  for (i = 0; i < Num_phils; i++) {
+    Diners[i].id = i;
+    pthread_cond_init(&Diners[i].can_eat, NULL);
+    Diners[i].seed = rand();
+    Diners[i].meals = 0;
+    Diners[i].retries = 0;
+    Diners[i].wait_max = 0;
+    Diners[i].wait_hist = calloc(HIST_BUCKETS, sizeof(unsigned int));
+    if (Diners[i].wait_hist == NULL) {
+      perror("Failed to set the table");
+      exit(1);
+    }
+  }
+
+  /*
+   * Philosophers need very little stack, and the default would
+   * reserve megabytes of address space for each of thousands of
+   * threads.
+   */
+  pthread_barrier_init(&seated, NULL, Num_phils + 1);
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE < PTHREAD_STACK_MIN ?
+                            PTHREAD_STACK_MIN : THREAD_STACK_SIZE);
+
+  for (i = 0; i < Num_phils; i++) {
+    if (pthread_create(&(Diners[i].thread), &attr, dp_thread, &Diners[i])) {
+      fprintf(stderr, "Failed to create philosopher %d\n", i);
+      exit(1);
+    }
+  }
+
+  pthread_attr_destroy(&attr);
+  pthread_barrier_wait(&seated);
+}
+
+/*
+ * Print meals/sec and the fairness of the whole run once every
+ * philosopher has left the table.
+ */
+void print_summary(double elapsed)
+{
+  int                  i, b;
+  int                  min_id, max_id;
+  long                 total, retries;
+  double               sum_sq;
+  unsigned long long   count, seen, wait_max;
+  unsigned long long  *hist;
+  struct rusage        usage;
+  static const double  pcts[] = { 50, 90, 99, 99.9 };
+  int                  p;
+
+  hist = calloc(HIST_BUCKETS, sizeof(unsigned long long));
+  total = retries = 0;
+  sum_sq = 0;
+  wait_max = 0;
+  min_id = max_id = 0;
+
+  for (i = 0; i < Num_phils; i++) {
+    total += Diners[i].meals;
+    retries += Diners[i].retries;
+    sum_sq += (double) Diners[i].meals * Diners[i].meals;
+    if (Diners[i].meals < Diners[min_id].meals)
+      min_id = i;
+    if (Diners[i].meals > Diners[max_id].meals)
+      max_id = i;
+    if (Diners[i].wait_max > wait_max)
+      wait_max = Diners[i].wait_max;
+    for (b = 0; b < HIST_BUCKETS; b++)
+      hist[b] += Diners[i].wait_hist[b];
+  }
+
+  printf("Strategy:    %s, %d philosophers, %.3f s\n",
+         Strategy->name, Num_phils, elapsed);
+  printf("Meals:       %ld (%.0f meals/s)\n", total, total / elapsed);
+
+  /*
+   * Jain's index is 1 when every philosopher ate the same amount and
+   * 1/N when a single one did all the eating.
+   */
+  printf("Fairness:    min %ld (p%d)  max %ld (p%d)  mean %.1f  "
+         "jain %.4f\n", Diners[min_id].meals, min_id, Diners[max_id].meals,
+         max_id, (double) total / Num_phils,
+         sum_sq ? (double) total * total / (Num_phils * sum_sq) : 1.0);
+
+  printf("Wait (us):  ");
+  count = total;
+  for (p = 0; p < (int) (sizeof(pcts) / sizeof(pcts[0])); p++) {
+    seen = 0;
+    for (b = 0; b < HIST_BUCKETS - 1; b++) {
+      seen += hist[b];
+      if (seen >= count * pcts[p] / 100)
+        break;
+    }
+    printf(" p%g %.1f ", pcts[p], hist_value(b) / 1e3);
+  }
+  printf(" max %.1f\n", wait_max / 1e3);
+
+  if (Strategy->pick_up == trylock_pick_up)
+    printf("Retries:     %ld (%.2f per meal)\n", retries,
+           total ? (double) retries / total : 0.0);
+
+  getrusage(RUSAGE_SELF, &usage);
+  printf("Ctx switch:  %ld voluntary, %ld involuntary\n",
+         usage.ru_nvcsw, usage.ru_nivcsw);
+
+  free(hist);
+}
+
+void usage(char *prog)
+{
+  int i;
+
+  fprintf(stderr, "Usage: %s [-n PHILOSOPHERS] [-s STRATEGY] [-t SECONDS]"
+          " [-p PERIOD] [-T THINK] [-E EAT]\n", prog);
+  fprintf(stderr, "  STRATEGY is one of:");
+  for (i = 0; i < (int) NUM_STRATEGIES; i++)
+    fprintf(stderr, " %s", Strategies[i].name);
+  fprintf(stderr, " (default %s)\n", Strategies[0].name);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  int                 i, opt;
+  int                 run_period = RUN_PERIOD;
+  int                 period = ACCOUNTING_PERIOD;
+  int                 elapsed, starving;
+  long                meals, total, last_total;
+  long               *last;
+  unsigned long long  start, end;
+
+  while ((opt = getopt(argc, argv, "n:s:t:p:T:E:")) != -1) {
+    switch (opt) {
+    case 'n': Num_phils = atoi(optarg); break;
+    case 't': run_period = atoi(optarg); break;
+    case 'p': period = atoi(optarg); break;
+    case 'T': Think_period = atoi(optarg); break;
+    case 'E': Eat_period = atoi(optarg); break;
+    case 's':
+      for (i = 0; i < (int) NUM_STRATEGIES; i++)
+        if (strcmp(optarg, Strategies[i].name) == 0)
+          break;
+      if (i == (int) NUM_STRATEGIES)
+        usage(argv[0]);
+      Strategy = &Strategies[i];
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (Num_phils < 2 || run_period < 1 || period < 1 ||
+      Think_period < 0 || Eat_period < 0)
+    usage(argv[0]);
+
+  last = calloc(Num_phils, sizeof(long));
+  srand(time(NULL));
+
+  set_table();
+  start = now_ns();
+  printf("\n");
+  printf("Dining Philosophers (%s, %d philosophers) update every %d "
+         "seconds\n", Strategy->name, Num_phils, period);
+  printf("-------------------------------------------\n");
+
+  /*
+   * Every accounting period, print how many meals were eaten and how
+   * many philosophers did not get to eat at all. If nobody ate, the
+   * table is deadlocked.
+   */
+  last_total = 0;
+  for (elapsed = 0; elapsed < run_period; elapsed += period) {
+    sleep(period);
+
+    total = 0;
+    starving = 0;
+    for (i = 0; i < Num_phils; i++) {
+      meals = __atomic_load_n(&Diners[i].meals, __ATOMIC_RELAXED);
+      if (meals == last[i])
+        starving++;
+      total += meals;
+      last[i] = meals;
+    }
+
+    printf("%4ds  %10ld meals  %10.0f meals/s  %6d starving\n",
+           elapsed + period, total - last_total,
+           (double) (total - last_total) / period, starving);
+    last_total = total;
+
+    if (starving == Num_phils) {
+      printf ("Deadlock Detected\n");
+      exit(1);
+    }
+  }
+
+  /*
+   * Set the Stop flag to tell all diners to stop. Each one finishes
+   * the meal it is on, so every blocked philosopher still gets woken.
+   */
+  end = now_ns();
+  __atomic_store_n(&Stop, 1, __ATOMIC_RELAXED);
+  for (i = 0; i < Num_phils; i++)
+    pthread_join(Diners[i].thread, NULL);
+
+  printf ("Finished without Deadlock\n\n");
+  print_summary((end - start) / 1e9);
+
+  return 0;
+}
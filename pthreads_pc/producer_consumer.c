@@ -2,7 +2,11 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <linux/futex.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 /*
  * Define constants for how big the shared queue should be and how
@@ -23,26 +27,84 @@
 #define CONSUMER_CPU   25
 #define CONSUMER_BLOCK 10
 
+/*
+ * Run time configuration. The defaults reproduce the narrative the
+ * constants above describe. Command line options change them, and
+ * benchmark mode (-b) turns off the per item tracing and the blocking
+ * in do_work() so the cost of the queue itself can be measured. See
+ * main() for the options.
+ */
+int    queue_size     = QUEUESIZE;
+int    work_max       = WORK_MAX;
+size_t payload_size   = 0;
+int    producer_cpu   = PRODUCER_CPU;
+int    producer_block = PRODUCER_BLOCK;
+int    consumer_cpu   = CONSUMER_CPU;
+int    consumer_block = CONSUMER_BLOCK;
+int    batch_size     = 1;
+int    trace          = 1;
+
+/*
+ * In benchmark mode, the enqueue-to-dequeue latency of every item in
+ * nanoseconds, indexed by the order in which items were consumed.
+ * NULL otherwise.
+ */
+unsigned long long *latency = NULL;
+
+/*
+ * Number of consumed items whose payload was not the one the producer
+ * wrote
+ */
+int payload_errors = 0;
+
+/*
+ * Read the monotonic clock in nanoseconds
+ */
+unsigned long long now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ((unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
 /*****************************************************
  *   Shared Queue Related Structures and Routines    *
  *****************************************************/
+/*
+ * Items are opaque to both queues. Each one is itemSize bytes that
+ * are copied in and out with memcpy(), so a queue can carry any
+ * payload type. The producers and consumers below use pcitem.
+ *
+ * Every operation moves a batch of up to n items, so the cost of
+ * taking the mutex and waking waiters is paid once per batch rather
+ * than once per item. The single item operations are batches of one.
+ */
 typedef struct {
-  int buf[QUEUESIZE];   /* Array for Queue contents, managed as circular queue */
+  char   *buf;          /* Array for Queue contents, managed as circular queue */
+  size_t  itemSize;     /* Size of each item in bytes */
+  int     size;         /* Number of items buf holds */
+  int     count;        /* Number of items in the queue */
+
   int head;             /* Index of the queue head */
   int tail;             /* Index of the queue tail, the next empty slot */
 
   int full;             /* Flag set when queue is full  */
   int empty;            /* Flag set when queue is empty */
 
+  int fullWaiters;      /* Producers waiting on notFull */
+  int emptyWaiters;     /* Consumers waiting on notEmpty */
+
   pthread_mutex_t *mutex;     /* Mutex protecting this Queue's data */
   pthread_cond_t  *notFull;   /* Used by producers to await room to produce*/
   pthread_cond_t  *notEmpty;  /* Used by consumers to await something to consume*/
 } queue;
 
 /*
- * Create the queue shared among all producers and consumers
+ * Create the queue shared among all producers and consumers, with
+ * room for size items of itemSize bytes each
  */
-queue *queueInit (void)
+queue *queueInit (int size, size_t itemSize)
 {
   queue *q;
 
@@ -52,16 +114,31 @@ queue *queueInit (void)
   q = (queue *)malloc (sizeof (queue));
   if (q == NULL) return (NULL);
 
+  /*
+   * Allocate the slots
+   */
+  q->size     = size;
+  q->itemSize = itemSize;
+  q->buf      = (char *) malloc (size * itemSize);
+  if (q->buf == NULL) {
+    free (q);
+    return (NULL);
+  }
+
   /*
    * Initialize the state variables. See the definition of the Queue
    * structure for the definition of each.
    */
   q->empty = 1;
   q->full  = 0;
+  q->count = 0;
 
   q->head  = 0;
   q->tail  = 0;
 
+  q->fullWaiters  = 0;
+  q->emptyWaiters = 0;
+
   /*
    * Allocate and initialize the queue mutex
    */
@@ -102,73 +179,443 @@ void queueDelete (queue *q)
   free (q->notEmpty);
 
   /*
-   * Deallocate the queue structure
+   * Deallocate the slots and the queue structure
    */
+  free (q->buf);
   free (q);
 }
 
-void queueAdd (queue *q, int in)
+/*
+ * Add up to n items from the array in to the queue, as many as there
+ * is room for, and return how many were added. The caller must hold
+ * the queue mutex.
+ */
+int queueAddBatch (queue *q, const void *in, int n)
 {
+  const char *src;
+  int         first;
+
+  src = (const char *) in;
+
+  if (n > q->size - q->count)
+    n = q->size - q->count;
+  if (n == 0)
+    return (0);
 
   /*
-   * Put the input item into the free slot
+   * Copy the items into the free slots starting at tail. If they run
+   * past the end of the array, the rest wrap around to the start.
+   * This implements the circularity of the queue in the array.
    */
-  q->buf[q->tail] = in;
-  q->tail++;
+  first = q->size - q->tail;
+  if (first > n)
+    first = n;
+
+  memcpy (q->buf + q->tail * q->itemSize, src, first * q->itemSize);
+  memcpy (q->buf, src + first * q->itemSize, (n - first) * q->itemSize);
+
+  q->tail += n;
+  if (q->tail >= q->size)
+    q->tail -= q->size;
 
   /*
-   * wrap the value of tail around to zero if we reached the end of
-   * the array. This implements the circularity of the queue inthe
-   * array.
+   * The queue is FULL once every slot is occupied. Since we just
+   * added something, it is certainly not empty.
    */
-  if (q->tail == QUEUESIZE)
-    q->tail = 0;
+  q->count += n;
+  q->full   = q->count == q->size;
+  q->empty  = 0;
+
+  return (n);
+}
+
+void queueAdd (queue *q, const void *in)
+{
+  queueAddBatch (q, in, 1);
+}
+
+/*
+ * Remove up to n items from the head of the queue into the array out
+ * and return how many were removed. The caller must hold the queue
+ * mutex.
+ */
+int queueRemoveBatch (queue *q, void *out, int n)
+{
+  char *dst;
+  int   first;
+
+  dst = (char *) out;
+
+  if (n > q->count)
+    n = q->count;
+  if (n == 0)
+    return (0);
 
   /*
-   * If the tail pointer is equal to the head, then the enxt empty
-   * slot in the queue is occupied and the queue is FULL
+   * Copy the items starting at head out, wrapping around to the
+   * start of the array if they run past its end
    */
-  if (q->tail == q->head)
-    q->full = 1;
+  first = q->size - q->head;
+  if (first > n)
+    first = n;
+
+  memcpy (dst, q->buf + q->head * q->itemSize, first * q->itemSize);
+  memcpy (dst + first * q->itemSize, q->buf, (n - first) * q->itemSize);
+
+  q->head += n;
+  if (q->head >= q->size)
+    q->head -= q->size;
 
   /*
-   * Since we just added an element to the queue, it is certainly not
-   * empty.
+   * If we took the last item the queue is empty, and since we took
+   * something out it is certainly not full
    */
-  q->empty = 0;
+  q->count -= n;
+  q->empty  = q->count == 0;
+  q->full   = 0;
 
-  return;
+  return (n);
 }
 
-void queueRemove (queue *q, int *out)
+void queueRemove (queue *q, void *out)
+{
+  queueRemoveBatch (q, out, 1);
+}
+
+/*
+ * Wake as many threads waiting on cond as there are items, or slots,
+ * for them, instead of broadcasting to all of them. The caller must
+ * hold the queue mutex.
+ */
+void queueSignal (pthread_cond_t *cond, int waiters, int n)
 {
+  int i;
+
+  for (i = 0; i < n && i < waiters; i++)
+    pthread_cond_signal (cond);
+}
+
+/*****************************************************
+ *  Lock-free Queue Related Structures and Routines  *
+ *****************************************************/
+/*
+ * The lock-free queue is a bounded multi-producer/multi-consumer ring
+ * in which every slot carries a sequence number. A slot whose
+ * sequence equals a tail position is free for the producer that
+ * claims that position, and a slot whose sequence is one past a head
+ * position holds the item for the consumer that claims that
+ * position. Producers and consumers claim a run of positions with a
+ * single compare-and-swap on tail or head, so they never take a lock.
+ *
+ * The capacity is the requested size rounded up to a power of two so
+ * that a position is turned into a slot index with a mask.
+ *
+ * Threads only block when the queue is truly full or empty. They
+ * sleep on a futex word that is bumped, and woken, by the other side
+ * only when someone is registered as waiting, so the fast path makes
+ * no system calls at all.
+ */
+#define CACHE_LINE 64
+
+typedef struct {
   /*
-   * Copy the element at head into the output variable and increment
-   * the head pointer to move to the next element.
+   * head and tail are written by every consumer and producer
+   * respectively, so each gets a cache line of its own to keep the
+   * two sides from invalidating each other's lines.
    */
-  *out = q->buf[q->head];
-  q->head++;
+  unsigned long head __attribute__ ((aligned (CACHE_LINE))); /* Next position to remove */
+  unsigned long tail __attribute__ ((aligned (CACHE_LINE))); /* Next position to fill */
+
+  int notEmpty __attribute__ ((aligned (CACHE_LINE))); /* Futex consumers sleep on */
+  int emptyWaiters;                                    /* Consumers asleep or about to be */
+
+  int notFull __attribute__ ((aligned (CACHE_LINE)));  /* Futex producers sleep on */
+  int fullWaiters;                                     /* Producers asleep or about to be */
+
+  unsigned long mask __attribute__ ((aligned (CACHE_LINE))); /* Capacity - 1 */
+  unsigned long *seq;   /* Position each slot is ready for */
+  char          *items; /* itemSize bytes per slot */
+  size_t         itemSize; /* Size of each item in bytes */
+} lfqueue;
+
+static void futexWait (int *addr, int val)
+{
+  syscall (SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+/*
+ * Wake up to n threads sleeping on the futex word, but only if a
+ * thread has registered itself in waiters. The fence orders the
+ * caller's update of the ring before the check, pairing with the
+ * waiter that registers itself before checking the ring one last
+ * time.
+ */
+static void futexWakeWaiters (int *addr, int *waiters, int n)
+{
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n (waiters, __ATOMIC_RELAXED) > 0) {
+    __atomic_fetch_add (addr, 1, __ATOMIC_SEQ_CST);
+    syscall (SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+  }
+}
+
+/*
+ * Create the lock-free queue shared among all producers and consumers,
+ * with room for at least size items of itemSize bytes each
+ */
+lfqueue *lfqueueInit (int size, size_t itemSize)
+{
+  lfqueue       *q;
+  unsigned long  cap;
+  unsigned long  i;
+
+  if (posix_memalign ((void **) &q, CACHE_LINE, sizeof (lfqueue)) != 0)
+    return (NULL);
+
+  memset (q, 0, sizeof (lfqueue));
+
+  for (cap = 1; cap < (unsigned long) size; cap <<= 1)
+    ;
+
+  q->mask     = cap - 1;
+  q->itemSize = itemSize;
+  q->seq      = (unsigned long *) malloc (cap * sizeof (unsigned long));
+  q->items    = (char *) malloc (cap * itemSize);
+  if (q->seq == NULL || q->items == NULL) {
+    free (q->seq);
+    free (q->items);
+    free (q);
+    return (NULL);
+  }
 
   /*
-   * Wrap the index around to zero if it reached the size of the
-   * array. This implements the circualrity of the queue int he array.
+   * Slot i is ready for the producer that claims position i
    */
-  if (q->head == QUEUESIZE)
-    q->head = 0;
+  for (i = 0; i < cap; i++)
+    q->seq[i] = i;
+
+  return (q);
+}
+
+/*
+ * Delete the lock-free queue
+ */
+void lfqueueDelete (lfqueue *q)
+{
+  free (q->seq);
+  free (q->items);
+  free (q);
+}
+
+/*
+ * Copy n items between the array buf and the slots starting at
+ * position pos, wrapping around the end of the ring
+ */
+static void lfqueueCopy (lfqueue *q, unsigned long pos, char *buf, int n,
+                         int toRing)
+{
+  unsigned long idx;
+  unsigned long first;
+  char         *slot;
+
+  idx   = pos & q->mask;
+  first = q->mask + 1 - idx;
+  if (first > (unsigned long) n)
+    first = n;
+
+  slot = q->items + idx * q->itemSize;
+  if (toRing) {
+    memcpy (slot, buf, first * q->itemSize);
+    memcpy (q->items, buf + first * q->itemSize, (n - first) * q->itemSize);
+  } else {
+    memcpy (buf, slot, first * q->itemSize);
+    memcpy (buf + first * q->itemSize, q->items, (n - first) * q->itemSize);
+  }
+}
+
+/*
+ * Claim a run of up to n positions from *end whose slots all have the
+ * sequence position + offset, i.e. are free (offset 0) or full
+ * (offset 1) for this lap. Returns the length of the run, with its
+ * first position in *pos, or 0 if the first slot is not ready.
+ *
+ * Only the thread that claims a position changes its slot, and that
+ * requires moving *end past it, so a run found ready stays ready until
+ * the compare-and-swap either claims it or fails.
+ */
+static int lfqueueClaim (lfqueue *q, unsigned long *end, unsigned long *pos,
+                         int n, unsigned long offset)
+{
+  unsigned long p;
+  long          diff;
+  int           k;
+
+  p = __atomic_load_n (end, __ATOMIC_RELAXED);
+  while (1) {
+    diff = 0;
+    for (k = 0; k < n; k++) {
+      diff = (long) (__atomic_load_n (&q->seq[(p + k) & q->mask],
+                                      __ATOMIC_ACQUIRE) - (p + k + offset));
+      if (diff != 0)
+        break;
+    }
+
+    if (k > 0) {
+      /*
+       * On failure the CAS reloads p with the current value of *end
+       */
+      if (__atomic_compare_exchange_n (end, &p, p + k, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        *pos = p;
+        return (k);
+      }
+    }
+    /*
+     * The first slot is a lap behind, so the queue is full (for
+     * producers) or empty (for consumers)
+     */
+    else if (diff < 0) {
+      return (0);
+    }
+    /*
+     * Another thread claimed the first position first
+     */
+    else {
+      p = __atomic_load_n (end, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/*
+ * Try to add up to n items from the array in without blocking.
+ * Returns how many were added, 0 if the queue was full.
+ */
+int lfqueueTryAddBatch (lfqueue *q, const void *in, int n)
+{
+  unsigned long pos;
+  int           k;
+  int           i;
+
+  k = lfqueueClaim (q, &q->tail, &pos, n, 0);
+  if (k == 0)
+    return (0);
 
   /*
-   * If head catches up to tail as we delete an item, then the queue
-   * is empty.
+   * Fill the slots and then publish each to the consumer of its
+   * position
    */
-  if (q->head == q->tail)
-    q->empty = 1;
+  lfqueueCopy (q, pos, (char *) in, k, 1);
+  for (i = 0; i < k; i++)
+    __atomic_store_n (&q->seq[(pos + i) & q->mask], pos + i + 1,
+                      __ATOMIC_RELEASE);
+
+  futexWakeWaiters (&q->notEmpty, &q->emptyWaiters, k);
+
+  return (k);
+}
+
+int lfqueueTryAdd (lfqueue *q, const void *in)
+{
+  return (lfqueueTryAddBatch (q, in, 1));
+}
+
+/*
+ * Try to remove up to n items into the array out without blocking.
+ * Returns how many were removed, 0 if the queue was empty.
+ */
+int lfqueueTryRemoveBatch (lfqueue *q, void *out, int n)
+{
+  unsigned long pos;
+  int           k;
+  int           i;
+
+  k = lfqueueClaim (q, &q->head, &pos, n, 1);
+  if (k == 0)
+    return (0);
 
   /*
-   * since we took an item out, the queue is certainly not full
+   * Take the items and hand each slot to the producer one lap ahead
    */
-  q->full = 0;
+  lfqueueCopy (q, pos, (char *) out, k, 0);
+  for (i = 0; i < k; i++)
+    __atomic_store_n (&q->seq[(pos + i) & q->mask], pos + i + q->mask + 1,
+                      __ATOMIC_RELEASE);
+
+  futexWakeWaiters (&q->notFull, &q->fullWaiters, k);
+
+  return (k);
+}
+
+int lfqueueTryRemove (lfqueue *q, void *out)
+{
+  return (lfqueueTryRemoveBatch (q, out, 1));
+}
+
+/*
+ * Add all n items, sleeping whenever the queue is full. A producer
+ * registers as a waiter and samples the futex word before its last
+ * attempt, so a consumer that frees a slot after that attempt either
+ * is seen by the attempt or changes the word and makes the wait
+ * return at once.
+ */
+void lfqueueAddBatch (lfqueue *q, const void *in, int n)
+{
+  const char *src;
+  int         seq;
+  int         done;
+
+  src = (const char *) in;
+  while (n > 0) {
+    done = lfqueueTryAddBatch (q, src, n);
+    if (done == 0) {
+      __atomic_fetch_add (&q->fullWaiters, 1, __ATOMIC_SEQ_CST);
+      seq  = __atomic_load_n (&q->notFull, __ATOMIC_SEQ_CST);
+      done = lfqueueTryAddBatch (q, src, n);
+      if (done == 0)
+        futexWait (&q->notFull, seq);
+      __atomic_fetch_sub (&q->fullWaiters, 1, __ATOMIC_SEQ_CST);
+    }
+
+    src += done * q->itemSize;
+    n   -= done;
+  }
+}
+
+void lfqueueAdd (lfqueue *q, const void *in)
+{
+  lfqueueAddBatch (q, in, 1);
+}
 
-  return;
+/*
+ * Remove exactly n items, sleeping whenever the queue is empty
+ */
+void lfqueueRemoveBatch (lfqueue *q, void *out, int n)
+{
+  char *dst;
+  int   seq;
+  int   done;
+
+  dst = (char *) out;
+  while (n > 0) {
+    done = lfqueueTryRemoveBatch (q, dst, n);
+    if (done == 0) {
+      __atomic_fetch_add (&q->emptyWaiters, 1, __ATOMIC_SEQ_CST);
+      seq  = __atomic_load_n (&q->notEmpty, __ATOMIC_SEQ_CST);
+      done = lfqueueTryRemoveBatch (q, dst, n);
+      if (done == 0)
+        futexWait (&q->notEmpty, seq);
+      __atomic_fetch_sub (&q->emptyWaiters, 1, __ATOMIC_SEQ_CST);
+    }
+
+    dst += done * q->itemSize;
+    n   -= done;
+  }
+}
+
+void lfqueueRemove (lfqueue *q, void *out)
+{
+  lfqueueRemoveBatch (q, out, 1);
 }
 
 /******************************************************
@@ -180,6 +627,9 @@ void queueRemove (queue *q, int *out)
  *
  * q     - arg provides a pointer to the shared queue.
  *
+ * lfq   - arg provides a pointer to the shared lock-free queue when
+ *         running in lock-free mode.
+ *
  * count - arg is a pointer to a counter for this thread to track how
  *         much work it did.
  *
@@ -188,11 +638,27 @@ void queueRemove (queue *q, int *out)
  *
  */
 typedef struct {
-  queue *q;
-  int   *count;
-  int    tid;
+  queue   *q;
+  lfqueue *lfq;
+  int     *count;
+  int      tid;
 } pcdata;
 
+/*
+ * The item the producers and consumers pass through the queue. data
+ * holds payload_size bytes, so items are item_size bytes long. Use
+ * ITEM() to find an item in an array of them.
+ */
+typedef struct {
+  int                id;     /* Number of the item */
+  unsigned long long stamp;  /* Time the item was produced */
+  char               data[]; /* Data carried with the item */
+} pcitem;
+
+size_t item_size;
+
+#define ITEM(items, i) ((pcitem *) ((char *) (items) + (size_t) (i) * item_size))
+
 int memory_access_area[100000];
 
 
@@ -244,7 +710,7 @@ void do_work(int cpu_iterations, int blocking_time)
 {
   int i;
   int j;
-  int local_var;
+  volatile int local_var;   /* Or -O2 drops the loop */
 
   local_var = 0;
   for (j = 0; j < cpu_iterations; j++ ) {
@@ -252,19 +718,81 @@ void do_work(int cpu_iterations, int blocking_time)
       local_var = memory_access_area[i];
     }
   }
+  (void) local_var;
 
   if ( blocking_time > 0 ) {
     msleep(blocking_time);
   }
 }
 
+/*
+ * Fill the data carried with an item. The pattern comes from the time
+ * the item was produced, which travels with it through the queue, so
+ * the consumer can tell whether it got the data that belongs to the
+ * item.
+ */
+void fillPayload (char *data, unsigned long long stamp)
+{
+  if (payload_size > 0)
+    memset (data, (int) (stamp & 0xff), payload_size);
+}
+
+/*
+ * Read all of the data carried with an item, as a real consumer
+ * would, and count it as an error if it is not what the producer
+ * wrote
+ */
+void checkPayload (const char *data, unsigned long long stamp)
+{
+  size_t i;
+  int    bad;
+
+  bad = 0;
+  for (i = 0; i < payload_size; i++)
+    bad |= data[i] != (char) (stamp & 0xff);
+
+  if (bad)
+    __atomic_fetch_add (&payload_errors, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Produce one item into the given slot of a batch: do the work, then
+ * stamp it and fill in its data
+ */
+void produceItem (pcitem *item)
+{
+  do_work(producer_cpu, producer_block);
+
+  item->stamp = now_ns ();
+  fillPayload (item->data, item->stamp);
+}
+
+/*
+ * Consume one item removed from the queue at time now. ticket is the
+ * order in which it was consumed.
+ */
+void consumeItem (pcitem *item, int ticket, unsigned long long now, int my_tid)
+{
+  if (latency != NULL)
+    latency[ticket] = now - item->stamp;
+
+  checkPayload (item->data, item->stamp);
+  do_work(consumer_cpu, consumer_block);
+
+  if (trace)
+    printf ("con %d:   %d.\n", my_tid, item->id);
+}
+
 void *producer (void *parg)
 {
   queue  *fifo;
-  int     item_produced;
   pcdata *mydata;
   int     my_tid;
   int    *total_produced;
+  char   *items;
+  int     pending;
+  int     n;
+  int     i;
 
   mydata = (pcdata *) parg;
 
@@ -272,65 +800,97 @@ void *producer (void *parg)
   total_produced = mydata->count;
   my_tid         = mydata->tid;
 
+  items   = (char *) malloc (batch_size * item_size);
+  pending = 0;
+
   /*
    * Continue producing until the total produced reaches the
    * configured maximum
    */
   while (1) {
     /*
-     * Do work to produce an item. Tthe get a slot in the queue for
-     * it. Finally, at the end of the loop, outside the critical
-     * section, announce that we produced it.
+     * Do work to produce a batch of items. Tthe get slots in the
+     * queue for them. Finally, at the end of the loop, outside the
+     * critical section, announce that we produced them. Items that
+     * did not fit last time are still pending and are not produced
+     * again.
      */
-    do_work(PRODUCER_CPU, PRODUCER_BLOCK);
+    for (; pending < batch_size; pending++)
+      produceItem (ITEM (items, pending));
 
     /*
      * If the queue is full, we have no place to put anything we
      * produce, so wait until it is not full.
      */
     pthread_mutex_lock(fifo->mutex);
-    while (fifo->full && *total_produced != WORK_MAX) {
-      printf ("prod %d:  FULL.\n", my_tid);
+    while (fifo->full && *total_produced != work_max) {
+      if (trace)
+        printf ("prod %d:  FULL.\n", my_tid);
+      fifo->fullWaiters++;
       pthread_cond_wait(fifo->notFull, fifo->mutex);
+      fifo->fullWaiters--;
     }
 
     /*
      * Check to see if the total produced by all producers has reached
      * the configured maximum, if so, we can quit.
      */
-    if (*total_produced >= WORK_MAX) {
+    if (*total_produced >= work_max) {
       pthread_mutex_unlock(fifo->mutex);
       break;
     }
 
     /*
-     * OK, so we produce an item. Increment the counter of total
-     * widgets produced, and add the new widget ID, its number, to the
-     * queue.
+     * OK, so we produce the items. Give each its widget ID, its
+     * number, add as many as fit to the queue and count them in the
+     * total widgets produced.
      */
-    item_produced = (*total_produced)++;
-    queueAdd (fifo, item_produced);
-    pthread_cond_broadcast(fifo->notEmpty);
+    n = work_max - *total_produced;
+    if (n > pending)
+      n = pending;
+    for (i = 0; i < n; i++)
+      ITEM (items, i)->id = *total_produced + i;
+
+    n = queueAddBatch (fifo, items, n);
+    *total_produced += n;
+
+    /*
+     * Wake one consumer per item added. Once the last item is in,
+     * wake every producer still waiting for room so it can quit.
+     */
+    queueSignal (fifo->notEmpty, fifo->emptyWaiters, n);
+    if (*total_produced == work_max)
+      pthread_cond_broadcast(fifo->notFull);
     pthread_mutex_unlock(fifo->mutex);
 
     /*
      * Announce the production outside the critical section
      */
-    printf("prod %d:  %d.\n", my_tid, item_produced);
+    if (trace)
+      for (i = 0; i < n; i++)
+        printf("prod %d:  %d.\n", my_tid, ITEM (items, i)->id);
 
+    pending -= n;
+    memmove (items, ITEM (items, n), pending * item_size);
   }
 
-  printf("prod %d:  exited\n", my_tid);
+  if (trace)
+    printf("prod %d:  exited\n", my_tid);
+  free (items);
   return (NULL);
 }
 
 void *consumer (void *carg)
 {
   queue  *fifo;
-  int     item_consumed;
   pcdata *mydata;
   int     my_tid;
   int    *total_consumed;
+  int     ticket;
+  char   *items;
+  int     n;
+  int     i;
+  unsigned long long now;
 
   mydata = (pcdata *) carg;
 
@@ -338,6 +898,8 @@ void *consumer (void *carg)
   total_consumed = mydata->count;
   my_tid         = mydata->tid;
 
+  items = (char *) malloc (batch_size * item_size);
+
   /*
    * Continue producing until the total consumed by all consumers
    * reaches the configured maximum
@@ -348,44 +910,243 @@ void *consumer (void *carg)
      * si not empty.
      */
      pthread_mutex_lock(fifo->mutex);
-    while (fifo->empty && *total_consumed != WORK_MAX) {
-      printf ("con %d:   EMPTY.\n", my_tid);
+    while (fifo->empty && *total_consumed != work_max) {
+      if (trace)
+        printf ("con %d:   EMPTY.\n", my_tid);
+      fifo->emptyWaiters++;
       pthread_cond_wait(fifo->notEmpty, fifo->mutex);
+      fifo->emptyWaiters--;
     }
 
     /*
      * If total consumption has reached the configured limit, we can
      * stop
      */
-    if (*total_consumed >= WORK_MAX) {
+    if (*total_consumed >= work_max) {
       pthread_mutex_unlock(fifo->mutex);
       break;
     }
 
     /*
-     * Remove the next item from the queue. Increment the count of the
-     * total consumed. Note that item_consumed is a local copy so this
-     * thread can retain a memory of which item it consumed even if
-     * others are busy consuming them.
+     * Remove the next batch of items from the queue. Increment the
+     * count of the total consumed. Note that items is a local copy so
+     * this thread can retain a memory of which items it consumed even
+     * if others are busy consuming them.
      */
-    queueRemove (fifo, &item_consumed);
-    (*total_consumed)++;
+    n      = queueRemoveBatch (fifo, items, batch_size);
+    ticket = *total_consumed;
+    *total_consumed += n;
 
-    pthread_cond_broadcast(fifo->notFull);
+    /*
+     * Wake one producer per slot freed. Once the last item is out,
+     * wake every consumer still waiting so it can quit.
+     */
+    queueSignal (fifo->notFull, fifo->fullWaiters, n);
+    if (*total_consumed == work_max)
+      pthread_cond_broadcast(fifo->notEmpty);
     pthread_mutex_unlock(fifo->mutex);
+
+    /*
+     * Do work outside the critical region to consume the items
+     * obtained from the queue and then announce their consumption.
+     */
+    now = now_ns ();
+    for (i = 0; i < n; i++)
+      consumeItem (ITEM (items, i), ticket + i, now, my_tid);
+
+  }
+
+  if (trace)
+    printf("con %d:   exited\n", my_tid);
+  free (items);
+  return (NULL);
+}
+
+/*
+ * Producer for the lock-free queue. Instead of checking the shared
+ * counter under the queue mutex, each producer claims the numbers of
+ * the next batch of items it will produce with an atomic add, and
+ * stops once the claimed numbers reach the configured maximum.
+ */
+void *lfProducer (void *parg)
+{
+  lfqueue *fifo;
+  pcdata  *mydata;
+  int      my_tid;
+  int     *total_produced;
+  char    *items;
+  int      first;
+  int      added;
+  int      n;
+  int      i;
+
+  mydata = (pcdata *) parg;
+
+  fifo           = mydata->lfq;
+  total_produced = mydata->count;
+  my_tid         = mydata->tid;
+
+  items = (char *) malloc (batch_size * item_size);
+
+  while (1) {
+    first = __atomic_fetch_add (total_produced, batch_size, __ATOMIC_RELAXED);
+    if (first >= work_max)
+      break;
+
+    n = work_max - first;
+    if (n > batch_size)
+      n = batch_size;
+
+    for (i = 0; i < n; i++) {
+      ITEM (items, i)->id = first + i;
+      produceItem (ITEM (items, i));
+    }
+
     /*
-     * Do work outside the critical region to consume the item
-     * obtained from the queue and then announce its consumption.
+     * Only go to sleep when the queue is actually full
      */
-    do_work(CONSUMER_CPU,CONSUMER_CPU);
-    printf ("con %d:   %d.\n", my_tid, item_consumed);
+    added = lfqueueTryAddBatch (fifo, items, n);
+    if (added < n) {
+      if (trace)
+        printf ("prod %d:  FULL.\n", my_tid);
+      lfqueueAddBatch (fifo, ITEM (items, added), n - added);
+    }
+
+    if (trace)
+      for (i = 0; i < n; i++)
+        printf("prod %d:  %d.\n", my_tid, first + i);
+  }
+
+  if (trace)
+    printf("prod %d:  exited\n", my_tid);
+  free (items);
+  return (NULL);
+}
+
+/*
+ * Consumer for the lock-free queue. Each consumer claims the right to
+ * consume the next batch of items with an atomic add before removing
+ * them. Since exactly work_max items are produced, every claim below
+ * work_max is eventually matched by an item.
+ */
+void *lfConsumer (void *carg)
+{
+  lfqueue *fifo;
+  pcdata  *mydata;
+  int      my_tid;
+  int     *total_consumed;
+  int      ticket;
+  char    *items;
+  int      got;
+  int      n;
+  int      i;
+  unsigned long long now;
+
+  mydata = (pcdata *) carg;
+
+  fifo           = mydata->lfq;
+  total_consumed = mydata->count;
+  my_tid         = mydata->tid;
+
+  items = (char *) malloc (batch_size * item_size);
+
+  while (1) {
+    ticket = __atomic_fetch_add (total_consumed, batch_size, __ATOMIC_RELAXED);
+    if (ticket >= work_max)
+      break;
+
+    n = work_max - ticket;
+    if (n > batch_size)
+      n = batch_size;
+
+    got = lfqueueTryRemoveBatch (fifo, items, n);
+    if (got < n) {
+      if (trace)
+        printf ("con %d:   EMPTY.\n", my_tid);
+      lfqueueRemoveBatch (fifo, ITEM (items, got), n - got);
+    }
 
+    now = now_ns ();
+    for (i = 0; i < n; i++)
+      consumeItem (ITEM (items, i), ticket + i, now, my_tid);
   }
 
-  printf("con %d:   exited\n", my_tid);
+  if (trace)
+    printf("con %d:   exited\n", my_tid);
+  free (items);
   return (NULL);
 }
 
+/*
+ * Compare two latencies for qsort()
+ */
+int compareLatency (const void *a, const void *b)
+{
+  unsigned long long x = *(const unsigned long long *) a;
+  unsigned long long y = *(const unsigned long long *) b;
+
+  return ((x > y) - (x < y));
+}
+
+/*
+ * Latency of the given percentile in microseconds. The latencies must
+ * already be sorted.
+ */
+double percentile (double pct)
+{
+  int i;
+
+  i = (int) (pct / 100.0 * (work_max - 1) + 0.5);
+  return (latency[i] / 1000.0);
+}
+
+/*
+ * Print the results of a benchmark run
+ */
+void printBenchmark (const char *mode, int pros, int cons,
+                     unsigned long long elapsed, struct rusage *before,
+                     struct rusage *after)
+{
+  printf ("queue %s  producers %d  consumers %d  size %d  items %d  "
+          "batch %d  payload %zu B  work %d\n", mode, pros, cons, queue_size,
+          work_max, batch_size, payload_size, producer_cpu);
+  printf ("throughput   %.0f items/s (%.3f s)\n",
+          work_max / (elapsed / 1e9), elapsed / 1e9);
+
+  if (work_max > 0) {
+    qsort (latency, work_max, sizeof (unsigned long long), compareLatency);
+    printf ("latency us   p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+            percentile (50), percentile (90), percentile (99),
+            percentile (99.9), latency[work_max - 1] / 1000.0);
+  }
+
+  printf ("ctx switches voluntary %ld  involuntary %ld\n",
+          after->ru_nvcsw - before->ru_nvcsw,
+          after->ru_nivcsw - before->ru_nivcsw);
+
+  if (payload_errors > 0)
+    fprintf (stderr, "main: %d items had the wrong payload.\n",
+             payload_errors);
+}
+
+/*
+ * Print how to run the program
+ */
+void usage (void)
+{
+  printf("Usage: producer_consumer [-b] [-q queue_size] [-n items] [-B batch] [-s payload_bytes] [-w cpu_work]\n"
+         "                         number_of_producers number_of_consumers [mutex|lockfree]\n"
+         "\n"
+         "  -b  benchmark mode: no tracing or blocking, print throughput, latency\n"
+         "      and context switches (defaults to -q 1024 -n 1000000 -w 0)\n"
+         "  -q  number of items the queue holds\n"
+         "  -n  number of items to produce and consume\n"
+         "  -B  number of items moved per queue operation\n"
+         "  -s  bytes of data copied through the queue with each item\n"
+         "  -w  CPU work per item for producers and consumers, in units of\n"
+         "      1000 memory reads\n");
+}
+
 /***************************************************
  *   Main allocates structures, creates threads,   *
  *   waits to tear down.                           *
@@ -397,6 +1158,8 @@ int main (int argc, char *argv[])
   int       *concount;
 
   queue     *fifo;
+  lfqueue   *lffifo;
+  int        lockfree;
   int        i;
 
   pthread_t *pro;
@@ -405,25 +1168,125 @@ int main (int argc, char *argv[])
 
   pcdata    *thread_args;
 
+  int        bench;
+  int        opt;
+  int        size_opt;
+  int        items_opt;
+  int        work_opt;
+
+  unsigned long long start;
+  unsigned long long elapsed;
+  struct rusage      usage_before;
+  struct rusage      usage_after;
+
+  /*
+   * Parse the options. The sizes are applied after all options are
+   * read since benchmark mode changes the defaults.
+   */
+  bench     = 0;
+  size_opt  = -1;
+  items_opt = -1;
+  work_opt  = -1;
+  while ((opt = getopt (argc, argv, "bq:n:B:s:w:")) != -1) {
+    switch (opt) {
+    case 'b':
+      bench = 1;
+      break;
+    case 'q':
+      size_opt = atoi (optarg);
+      break;
+    case 'n':
+      items_opt = atoi (optarg);
+      break;
+    case 'B':
+      batch_size = atoi (optarg);
+      break;
+    case 's':
+      payload_size = (size_t) atol (optarg);
+      break;
+    case 'w':
+      work_opt = atoi (optarg);
+      break;
+    default:
+      usage ();
+      exit(0);
+    }
+  }
+
+  if (bench) {
+    trace          = 0;
+    queue_size     = 1024;
+    work_max       = 1000000;
+    producer_cpu   = consumer_cpu   = 0;
+    producer_block = consumer_block = 0;
+  }
+
+  if (size_opt != -1)
+    queue_size = size_opt;
+  if (items_opt != -1)
+    work_max = items_opt;
+  if (work_opt != -1)
+    producer_cpu = consumer_cpu = work_opt;
+
+  if (queue_size < 1 || work_max < 0 || batch_size < 1 || producer_cpu < 0) {
+    usage ();
+    exit(0);
+  }
+
   /*
    * Check the number of arguments and determine the numebr of
-   * producers and consumers
+   * producers and consumers, and which queue to use
    */
-  if (argc != 3) {
-    printf("Usage: producer_consumer number_of_producers number_of_consumers\n");
+  if (argc - optind != 2 && argc - optind != 3) {
+    usage ();
     exit(0);
   }
 
-  pros = atoi(argv[1]);
-  cons = atoi(argv[2]);
+  pros = atoi(argv[optind]);
+  cons = atoi(argv[optind + 1]);
+
+  lockfree = 0;
+  if (argc - optind == 3) {
+    if (strcmp (argv[optind + 2], "lockfree") == 0) {
+      lockfree = 1;
+    } else if (strcmp (argv[optind + 2], "mutex") != 0) {
+      fprintf (stderr, "main: Unknown queue mode %s.\n", argv[optind + 2]);
+      exit (1);
+    }
+  }
+
+  if (bench) {
+    latency = (unsigned long long *) malloc ((work_max + 1) * sizeof (unsigned long long));
+    if (latency == NULL) {
+      fprintf(stderr, "latency allocation failed\n");
+      exit(1);
+    }
+  }
+
+  /*
+   * Each item carries payload_size bytes of data, rounded up so items
+   * in an array stay aligned
+   */
+  item_size = sizeof (pcitem) + payload_size;
+  item_size = (item_size + __alignof__ (pcitem) - 1) & ~(__alignof__ (pcitem) - 1);
 
   /*
    * Create the shared queue
    */
-  fifo = queueInit ();
-  if (fifo ==  NULL) {
-    fprintf (stderr, "main: Queue Init failed.\n");
-    exit (1);
+  fifo   = NULL;
+  lffifo = NULL;
+  if (lockfree) {
+    lffifo = lfqueueInit (queue_size, item_size);
+    if (lffifo == NULL) {
+      fprintf (stderr, "main: Lock-free Queue Init failed.\n");
+      exit (1);
+    }
+  } else {
+    fifo = queueInit (queue_size, item_size);
+    if (fifo ==  NULL) {
+      fprintf (stderr, "main: Queue Init failed.\n");
+      exit (1);
+    }
   }
 
   /*
@@ -443,6 +1306,9 @@ int main (int argc, char *argv[])
     exit(1);
   }
 
+  *procount = 0;
+  *concount = 0;
+
   /*
    * Create arrays of thread structures, one for each producer and
    * consumer
@@ -459,6 +1325,12 @@ int main (int argc, char *argv[])
     exit(1);
   }
 
+  /*
+   * Start the clock just before the first thread is created
+   */
+  getrusage (RUSAGE_SELF, &usage_before);
+  start = now_ns ();
+
   /*
    * Create the specified number of producers
    */
@@ -476,9 +1348,11 @@ int main (int argc, char *argv[])
      * Fill them in and then create the producer thread
      */
     thread_args->q     = fifo;
+    thread_args->lfq   = lffifo;
     thread_args->count = procount;
     thread_args->tid   = i;
-    pthread_create (&pro[i], NULL, producer, thread_args);
+    pthread_create (&pro[i], NULL, lockfree ? lfProducer : producer,
+                    thread_args);
   }
 
   /*
@@ -498,9 +1372,11 @@ int main (int argc, char *argv[])
      * Fill them in and create the thread
      */
     thread_args->q     = fifo;
+    thread_args->lfq   = lffifo;
     thread_args->count = concount;
     thread_args->tid   = i;
-    pthread_create (&con[i], NULL, consumer, thread_args);
+    pthread_create (&con[i], NULL, lockfree ? lfConsumer : consumer,
+                    thread_args);
   }
 
   /*
@@ -514,12 +1390,27 @@ int main (int argc, char *argv[])
   for (i=0; i<cons; i++)
     pthread_join (con[i], NULL);
 
+  elapsed = now_ns () - start;
+  getrusage (RUSAGE_SELF, &usage_after);
+
+  if (bench)
+    printBenchmark (lockfree ? "lockfree" : "mutex", pros, cons, elapsed,
+                    &usage_before, &usage_after);
+  else if (payload_errors > 0)
+    fprintf (stderr, "main: %d items had the wrong payload.\n",
+             payload_errors);
+
   /*
    * Delete the shared fifo, now that we know there are no users of
    * it. Since we are about to exit we could skip this step, but we
    * put it here for neatness' sake.
    */
-  queueDelete (fifo);
+  if (lockfree)
+    lfqueueDelete (lffifo);
+  else
+    queueDelete (fifo);
+
+  free (latency);
 
   return 0;
 }
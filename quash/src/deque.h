@@ -11,6 +11,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /**
  * @def IMPLEMENT_DEQUE_STRUCT(struct_name, type)
@@ -66,10 +67,14 @@
   size_t length_##struct_name(struct_name*);                            \
   type* as_array_##struct_name(struct_name*, size_t*);                  \
   void apply_##struct_name(struct_name*, void (*)(type));               \
+  void reserve_##struct_name(struct_name*, size_t);                     \
   void push_front_##struct_name(struct_name*, type);                    \
   void push_back_##struct_name(struct_name*, type);                     \
+  void push_back_array_##struct_name(struct_name*, type const*, size_t);\
+  void extend_##struct_name(struct_name*, struct_name*);                \
   type pop_front_##struct_name(struct_name*);                           \
   type pop_back_##struct_name(struct_name*);                            \
+  size_t pop_front_array_##struct_name(struct_name*, type*, size_t);    \
   type peek_front_##struct_name(struct_name*);                          \
   type peek_back_##struct_name(struct_name*);                           \
   void update_front_##struct_name(struct_name*, type);                  \
@@ -78,38 +83,41 @@
   void update_and_destroy_back_##struct_name(struct_name*, type);
 
 /**
- * @def IMPLEMENT_DEQUE(struct_name, type)
+ * @def IMPLEMENT_DEQUE_FUNCTIONS(struct_name, type)
  *
- * @brief Generates a @a malloc based set of functions for use with a structure
- * generated by @a IMPLEMENT_DEQUE_STRUCT()
+ * @brief Generates the functions of a deque on top of three allocation hooks
+ *
+ * This is the shared body of @a IMPLEMENT_DEQUE() and
+ * IMPLEMENT_DEQUE_MEMORY_POOL(). Those macros define the static functions
+ * __alloc_##struct_name(cap), __realloc_##struct_name(data, old_cap, cap) and
+ * __free_##struct_name(data) before expanding this one. The hooks must never
+ * return NULL.
+ *
+ * The capacity is always a power of two so indices wrap with a mask instead of
+ * a division. Growing doubles the capacity in place and only moves the shorter
+ * of the two wrapped segments.
  *
  * @param struct_name The name of the structure
  *
  * @param type The name of the type of elements stored in the @a struct_name
  * structure
  *
- * @sa IMPLEMENT_DEQUE_STRUCT(), PROTOTYPE_DEQUE()
+ * @sa IMPLEMENT_DEQUE(), IMPLEMENT_DEQUE_STRUCT(), PROTOTYPE_DEQUE()
  */
-#define IMPLEMENT_DEQUE(struct_name, type)                              \
+#define IMPLEMENT_DEQUE_FUNCTIONS(struct_name, type)                    \
                                                                         \
   void apply_##struct_name(struct_name*, void (*)(type));               \
                                                                         \
   struct_name new_##struct_name(size_t init_cap) {                      \
     struct_name ret;                                                    \
                                                                         \
-    if (init_cap > 0)                                                   \
-      ret.cap = init_cap;                                               \
-    else                                                                \
-      ret.cap = 1;                                                      \
+    /* Keep the capacity a power of two so indices wrap with a mask */  \
+    ret.cap = 1;                                                        \
                                                                         \
-    ret.data = (type*) malloc(ret.cap * sizeof(type));                  \
-                                                                        \
-    if (ret.data == NULL) {                                             \
-      fprintf(stderr, "ERROR: Failed to allocate struct_name"           \
-              " contents");                                             \
-      exit(-1);                                                         \
-    }                                                                   \
+    while (ret.cap < init_cap)                                          \
+      ret.cap <<= 1;                                                    \
                                                                         \
+    ret.data = __alloc_##struct_name(ret.cap);                          \
     ret.front = ret.back = 0;                                           \
     ret.destructor = NULL;                                              \
                                                                         \
@@ -132,8 +140,7 @@
     if (deq->destructor != NULL)                                        \
       apply_##struct_name(deq, deq->destructor);                        \
                                                                         \
-    if (deq->data != NULL)                                              \
-      free(deq->data);                                                  \
+    __free_##struct_name(deq->data);                                    \
                                                                         \
     deq->data = NULL;                                                   \
     deq->cap = deq->front = deq->back = 0;                              \
@@ -158,35 +165,64 @@
   size_t length_##struct_name(struct_name* deq) {                       \
     assert(deq != NULL);                                                \
     assert(deq->data != NULL); /* Make sure the structure is valid */   \
-    return (deq->back - deq->front + deq->cap) % deq->cap;              \
+    return (deq->back - deq->front) & (deq->cap - 1);                   \
   }                                                                     \
                                                                         \
-  static void __reallign_##struct_name(struct_name* deq) {              \
-    assert(deq != NULL);                                                \
-    assert(deq->data != NULL); /* Make sure the structure is valid */   \
+  /* Grow to the smallest power of two of at least min_cap. Only the    \
+   * shorter of the two wrapped segments is moved afterwards. */        \
+  static void __grow_##struct_name(struct_name* deq, size_t min_cap) {  \
+    size_t old_cap = deq->cap;                                          \
+    size_t new_cap = old_cap;                                           \
                                                                         \
-    if (deq->front != 0) {                                              \
-      type* old_data = deq->data;                                       \
-      size_t len = length_##struct_name(deq);                           \
+    while (new_cap < min_cap)                                           \
+      new_cap <<= 1;                                                    \
+                                                                        \
+    if (new_cap == old_cap)                                             \
+      return;                                                           \
+                                                                        \
+    deq->data = __realloc_##struct_name(deq->data, old_cap, new_cap);   \
+    deq->cap = new_cap;                                                 \
                                                                         \
-      deq->data = (type*) malloc(deq->cap * sizeof(type));              \
+    if (deq->back < deq->front) {                                       \
+      size_t tail = old_cap - deq->front;                               \
                                                                         \
-      if (deq->data == NULL) {                                          \
-        fprintf(stderr, "ERROR: Failed to reallocate struct_name"       \
-                " contents");                                           \
-        abort();                                                        \
+      if (tail <= deq->back) {                                          \
+        memcpy(deq->data + new_cap - tail, deq->data + deq->front,      \
+               tail * sizeof(type));                                    \
+        deq->front = new_cap - tail;                                    \
       }                                                                 \
+      else {                                                            \
+        memcpy(deq->data + old_cap, deq->data,                          \
+               deq->back * sizeof(type));                               \
+        deq->back += old_cap;                                           \
+      }                                                                 \
+    }                                                                   \
+  }                                                                     \
                                                                         \
-      size_t i;                                                         \
+  static void __reallign_##struct_name(struct_name* deq) {              \
+    assert(deq != NULL);                                                \
+    assert(deq->data != NULL); /* Make sure the structure is valid */   \
                                                                         \
-      for (i = 0; i < len; ++i)                                         \
-        deq->data[i] = old_data[(deq->front + i) % deq->cap];           \
+    if (deq->front == 0)                                                \
+      return;                                                           \
                                                                         \
-      free(old_data);                                                   \
+    size_t len = length_##struct_name(deq);                             \
                                                                         \
-      deq->front = 0;                                                   \
-      deq->back = i;                                                    \
+    if (deq->front + len <= deq->cap) {                                 \
+      memmove(deq->data, deq->data + deq->front, len * sizeof(type));   \
     }                                                                   \
+    else {                                                              \
+      type* old_data = deq->data;                                       \
+      size_t tail = deq->cap - deq->front;                              \
+                                                                        \
+      deq->data = __alloc_##struct_name(deq->cap);                      \
+      memcpy(deq->data, old_data + deq->front, tail * sizeof(type));    \
+      memcpy(deq->data + tail, old_data, deq->back * sizeof(type));     \
+      __free_##struct_name(old_data);                                   \
+    }                                                                   \
+                                                                        \
+    deq->front = 0;                                                     \
+    deq->back = len;                                                    \
   }                                                                     \
                                                                         \
   type* as_array_##struct_name(struct_name* deq, size_t* len) {         \
@@ -210,43 +246,29 @@
     assert(deq != NULL);                                                \
     assert(deq->data != NULL); /* Make sure the structure is valid */   \
                                                                         \
-    size_t len = length_##struct_name(deq);                             \
+    size_t mask = deq->cap - 1;                                         \
                                                                         \
-    for (size_t i = 0; i < len; ++i) {                                  \
-      func(deq->data[(deq->front + i) % deq->cap]);                     \
-    }                                                                   \
+    for (size_t i = deq->front; i != deq->back; i = (i + 1) & mask)     \
+      func(deq->data[i]);                                               \
   }                                                                     \
                                                                         \
-  static void __on_push_##struct_name(struct_name* deq) {               \
-    if (deq->front == (deq->back + 1) % deq->cap) {                     \
-      type* old_data = deq->data;                                       \
-      size_t old_cap = deq->cap;                                        \
-                                                                        \
-      deq->cap = 2 * deq->cap;                                          \
-      deq->data = (type*) malloc(deq->cap * sizeof(type));              \
-                                                                        \
-      if (deq->data == NULL) {                                          \
-        fprintf(stderr, "ERROR: Failed to reallocate struct_name"       \
-                " contents\n");                                         \
-        abort();                                                        \
-      }                                                                 \
-                                                                        \
-      size_t i;                                                         \
-                                                                        \
-      for (i = 0; i < old_cap - 1; ++i)                                 \
-        deq->data[i] = old_data[(deq->front + i) % old_cap];            \
+  void reserve_##struct_name(struct_name* deq, size_t n) {              \
+    assert(deq != NULL);                                                \
+    assert(deq->data != NULL); /* Make sure the structure is valid */   \
                                                                         \
-      free(old_data);                                                   \
+    /* One slot stays open to tell a full deque from an empty one */    \
+    __grow_##struct_name(deq, length_##struct_name(deq) + n + 1);       \
+  }                                                                     \
                                                                         \
-      deq->front = 0;                                                   \
-      deq->back = i;                                                    \
-    }                                                                   \
+  static void __on_push_##struct_name(struct_name* deq) {               \
+    if (deq->front == ((deq->back + 1) & (deq->cap - 1)))               \
+      __grow_##struct_name(deq, 2 * deq->cap);                          \
   }                                                                     \
                                                                         \
   static void __on_pop_##struct_name(struct_name* deq) {                \
     if (is_empty_##struct_name(deq)) {                                  \
-      fprintf(stderr, "ERROR: Cannot pop from of struct_name while it " \
-              "is empty\n");                                            \
+      fprintf(stderr, "ERROR: Cannot pop from " #struct_name            \
+              " while it is empty\n");                                  \
       abort();                                                          \
     }                                                                   \
   }                                                                     \
@@ -255,7 +277,7 @@
     assert(deq != NULL);                                                \
     assert(deq->data != NULL); /* Make sure the structure is valid */   \
     __on_push_##struct_name(deq);                                       \
-    deq->front = (deq->front + deq->cap - 1) % deq->cap;                \
+    deq->front = (deq->front - 1) & (deq->cap - 1);                     \
     deq->data[deq->front] = element;                                    \
   }                                                                     \
                                                                         \
@@ -264,7 +286,42 @@
     assert(deq->data != NULL); /* Make sure the structure is valid */   \
     __on_push_##struct_name(deq);                                       \
     deq->data[deq->back] = element;                                     \
-    deq->back = (deq->back + 1) % deq->cap;                             \
+    deq->back = (deq->back + 1) & (deq->cap - 1);                       \
+  }                                                                     \
+                                                                        \
+  void push_back_array_##struct_name(struct_name* deq,                  \
+                                     type const* elements, size_t n) {  \
+    assert(deq != NULL);                                                \
+    assert(deq->data != NULL); /* Make sure the structure is valid */   \
+    assert(elements != NULL || n == 0);                                 \
+                                                                        \
+    reserve_##struct_name(deq, n);                                      \
+                                                                        \
+    size_t first = deq->cap - deq->back;                                \
+                                                                        \
+    if (first > n)                                                      \
+      first = n;                                                        \
+                                                                        \
+    memcpy(deq->data + deq->back, elements, first * sizeof(type));      \
+    memcpy(deq->data, elements + first, (n - first) * sizeof(type));    \
+    deq->back = (deq->back + n) & (deq->cap - 1);                       \
+  }                                                                     \
+                                                                        \
+  void extend_##struct_name(struct_name* deq, struct_name* other) {     \
+    assert(deq != NULL && other != NULL);                               \
+    assert(deq != other);                                               \
+    assert(other->data != NULL); /* Make sure the structure is valid */ \
+                                                                        \
+    size_t len = length_##struct_name(other);                           \
+    size_t first = other->cap - other->front;                           \
+                                                                        \
+    if (first > len)                                                    \
+      first = len;                                                      \
+                                                                        \
+    reserve_##struct_name(deq, len);                                    \
+    push_back_array_##struct_name(deq, other->data + other->front,      \
+                                  first);                               \
+    push_back_array_##struct_name(deq, other->data, len - first);       \
   }                                                                     \
                                                                         \
   type pop_front_##struct_name(struct_name* deq) {                      \
@@ -272,7 +329,7 @@
     assert(deq->data != NULL); /* Make sure the structure is valid */   \
     __on_pop_##struct_name(deq);                                        \
     size_t old_front = deq->front;                                      \
-    deq->front = (deq->front + 1) % deq->cap;                           \
+    deq->front = (deq->front + 1) & (deq->cap - 1);                     \
     return deq->data[old_front];                                        \
   }                                                                     \
                                                                         \
@@ -280,10 +337,35 @@
     assert(deq != NULL);                                                \
     assert(deq->data != NULL); /* Make sure the structure is valid */   \
     __on_pop_##struct_name(deq);                                        \
-    deq->back = (deq->back + deq->cap - 1) % deq->cap;                  \
+    deq->back = (deq->back - 1) & (deq->cap - 1);                       \
     return deq->data[deq->back];                                        \
   }                                                                     \
                                                                         \
+  size_t pop_front_array_##struct_name(struct_name* deq, type* out,     \
+                                       size_t n) {                      \
+    assert(deq != NULL);                                                \
+    assert(deq->data != NULL); /* Make sure the structure is valid */   \
+                                                                        \
+    size_t len = length_##struct_name(deq);                             \
+                                                                        \
+    if (n > len)                                                        \
+      n = len;                                                          \
+                                                                        \
+    size_t first = deq->cap - deq->front;                               \
+                                                                        \
+    if (first > n)                                                      \
+      first = n;                                                        \
+                                                                        \
+    if (out != NULL) {                                                  \
+      memcpy(out, deq->data + deq->front, first * sizeof(type));        \
+      memcpy(out + first, deq->data, (n - first) * sizeof(type));       \
+    }                                                                   \
+                                                                        \
+    deq->front = (deq->front + n) & (deq->cap - 1);                     \
+                                                                        \
+    return n;                                                           \
+  }                                                                     \
+                                                                        \
   type peek_front_##struct_name(struct_name* deq) {                     \
     assert(deq != NULL);                                                \
     assert(deq->data != NULL); /* Make sure the structure is valid */   \
@@ -295,7 +377,7 @@
     assert(deq != NULL);                                                \
     assert(deq->data != NULL); /* Make sure the structure is valid */   \
     assert(!is_empty_##struct_name(deq));                               \
-    return deq->data[(deq->back + deq->cap - 1) % deq->cap];            \
+    return deq->data[(deq->back - 1) & (deq->cap - 1)];                 \
   }                                                                     \
                                                                         \
   void update_front_##struct_name(struct_name* deq, type element) {     \
@@ -309,7 +391,7 @@
     assert(deq != NULL);                                                \
     assert(deq->data != NULL); /* Make sure the structure is valid */   \
     assert(!is_empty_##struct_name(deq));                               \
-    deq->data[(deq->back + deq->cap - 1) % deq->cap] = element;         \
+    deq->data[(deq->back - 1) & (deq->cap - 1)] = element;              \
   }                                                                     \
                                                                         \
   void update_and_destroy_front_##struct_name(struct_name* deq,         \
@@ -332,7 +414,7 @@
     assert(deq->data != NULL); /* Make sure the structure is valid */   \
     assert(!is_empty_##struct_name(deq));                               \
                                                                         \
-    size_t idx = (deq->back + deq->cap - 1) % deq->cap;                 \
+    size_t idx = (deq->back - 1) & (deq->cap - 1);                      \
                                                                         \
     if (deq->destructor != NULL)                                        \
       deq->destructor(deq->data[idx]);                                  \
@@ -340,6 +422,54 @@
     deq->data[idx] = element;                                           \
   }
 
+/**
+ * @def IMPLEMENT_DEQUE(struct_name, type)
+ *
+ * @brief Generates a @a malloc based set of functions for use with a structure
+ * generated by @a IMPLEMENT_DEQUE_STRUCT()
+ *
+ * @param struct_name The name of the structure
+ *
+ * @param type The name of the type of elements stored in the @a struct_name
+ * structure
+ *
+ * @sa IMPLEMENT_DEQUE_STRUCT(), PROTOTYPE_DEQUE()
+ */
+#define IMPLEMENT_DEQUE(struct_name, type)                              \
+                                                                        \
+  static type* __alloc_##struct_name(size_t cap) {                      \
+    type* ret = (type*) malloc(cap * sizeof(type));                     \
+                                                                        \
+    if (ret == NULL) {                                                  \
+      fprintf(stderr, "ERROR: Failed to allocate " #struct_name         \
+              " contents\n");                                           \
+      exit(-1);                                                         \
+    }                                                                   \
+                                                                        \
+    return ret;                                                         \
+  }                                                                     \
+                                                                        \
+  static type* __realloc_##struct_name(type* data, size_t old_cap,      \
+                                       size_t cap) {                    \
+    (void) old_cap;                                                     \
+                                                                        \
+    type* ret = (type*) realloc(data, cap * sizeof(type));              \
+                                                                        \
+    if (ret == NULL) {                                                  \
+      fprintf(stderr, "ERROR: Failed to reallocate " #struct_name       \
+              " contents\n");                                           \
+      exit(-1);                                                         \
+    }                                                                   \
+                                                                        \
+    return ret;                                                         \
+  }                                                                     \
+                                                                        \
+  static void __free_##struct_name(type* data) {                        \
+    free(data);                                                         \
+  }                                                                     \
+                                                                        \
+  IMPLEMENT_DEQUE_FUNCTIONS(struct_name, type)
+
 // The following deque is for example and documentation purposes only
 
 /** @brief An example type used for example purposes only */
@@ -484,6 +614,17 @@ typedef struct Example {
  *
  * @sa Example, Type
  */
+/**
+ * @fn void reserve_Example(Example* deq, size_t n)
+ *
+ * @brief Make sure @a n more elements can be pushed without growing the deque
+ *
+ * @param deq A pointer to the deque to grow
+ *
+ * @param n Number of elements about to be pushed
+ *
+ * @sa Example
+ */
 /**
  * @fn void push_front_Example(Example* deq, Type element)
  *
@@ -506,6 +647,37 @@ typedef struct Example {
  *
  * @sa Example, Type
  */
+/**
+ * @fn void push_back_array_Example(Example* deq, Type const* elements, size_t n)
+ *
+ * @brief Insert @a n elements to the back of the deque in order
+ *
+ * This grows the deque at most once and copies the elements in at most two
+ * blocks.
+ *
+ * @param deq A pointer to the deque to insert the elements
+ *
+ * @param elements Array of at least @a n elements to copy into the deque
+ *
+ * @param n Number of elements to insert
+ *
+ * @sa Example, Type
+ */
+/**
+ * @fn void extend_Example(Example* deq, Example* other)
+ *
+ * @brief Copy every element of @a other to the back of @a deq in order
+ *
+ * @a other is left unchanged. The destructor of @a deq will be called on the
+ * copies, so be careful not to destroy the same elements twice.
+ *
+ * @param deq A pointer to the deque to insert the elements
+ *
+ * @param other A pointer to the deque to copy the elements from. Must not be
+ * @a deq.
+ *
+ * @sa Example
+ */
 /**
  * @fn Type pop_front_Example(Example* deq)
  *
@@ -528,6 +700,22 @@ typedef struct Example {
  *
  * @sa Example, Type
  */
+/**
+ * @fn size_t pop_front_array_Example(Example* deq, Type* out, size_t n)
+ *
+ * @brief Remove up to @a n elements from the front of the deque
+ *
+ * @param deq A pointer to the deque to remove elements from
+ *
+ * @param out Array of at least @a n elements receiving copies of the removed
+ * elements in order. May be NULL to just drop them.
+ *
+ * @param n Maximum number of elements to remove
+ *
+ * @return The number of elements removed
+ *
+ * @sa Example, Type
+ */
 /**
  * @fn Type peek_front_Example(Example* deq)
  *
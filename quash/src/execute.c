@@ -7,6 +7,8 @@
 * @note As you add things to this file you may want to change the method signature
 */
 
+#define _GNU_SOURCE
+
 #include "execute.h"
 
 #include <stdio.h>
@@ -21,31 +23,47 @@
 
 #include "deque.h"
 
+#include "jobs.h"
+
+#include "parallel.h"
+
+#include "profile.h"
+
 #include <sys/types.h>
 
+#include <signal.h>
+
+#include <fcntl.h>
+
+#include <errno.h>
+
+#include <string.h>
+
+#include <sys/sendfile.h>
+
+#include <sys/stat.h>
+
+#include <poll.h>
+
 #define READ 0
 #define WRITE 1
-int run = true;
-static int m_pipes[2][2];
+#define COPY_CHUNK (1 << 20)
+
+// One pipe per adjacent pair of commands in the current pipeline. Pipe i
+// connects the output of command i to the input of command i + 1.
+static int (*m_pipes)[2] = NULL;
+static int m_num_pipes = 0;
+
+// While profiling, the read end of each command's exec pipe and the time it
+// was forked. They are only looked at once the whole pipeline is running.
+static int* m_exec_fds = NULL;
+static uint64_t* m_exec_starts = NULL;
+static int m_num_cmds = 0;
 
 IMPLEMENT_DEQUE_STRUCT (pid_deque, pid_t);
 IMPLEMENT_DEQUE (pid_deque, pid_t);
 pid_deque pobject;
 
-typedef struct Job {
-int job_id;
-char* cmd;
-pid_deque pobject;
-}Job;
-
-IMPLEMENT_DEQUE_STRUCT (job_deque, struct Job);
-IMPLEMENT_DEQUE (job_deque, struct Job);
-job_deque jobject;
-int num = 1;
-
-bool init = 0;
-static int m_pipes[2][2];
-
 /***************************************************************************
 * Interface Functions
 ***************************************************************************/
@@ -68,50 +86,32 @@ const char* lookup_env(const char* env_var) {
 }
 
 // Check the status of background jobs
-  void check_jobs_bg_status() {
-    // int queuelength = length_job_deque(&jobject);
-    // for (int i = 0; i < queuelength; i++) {
-    //   Job cur = pop_front_job_deque (&jobject);
-    //   int pidlength = length_pid_deque (&cur.pobject);
-	  //   //pid_t front = peek_front_pid_deque (&cur.pobject);
-    //   for (int j = 0; j < pidlength; j++) {
-    //     pid_t curr_pid = pop_front_pid_deque (&cur.pobject);
-		//     int status;
-    //     if (waitpid (curr_pid, &status, WNOHANG)==curr_pid) {
-    //       print_job_bg_complete (cur.job_id, curr_pid, cur.cmd);
-    //     }
-    //     else if(waitpid (curr_pid, &status, WNOHANG)==0) {
-    //       push_back_pid_deque (&pobject, curr_pid);
-    //     }
-    //     else{
-    //       perror("Fail");
-    //     }
-    //   }
-    //   if(!is_empty_pid_deque(&cur.pobject)){
-    //     push_back_job_deque (&jobject, cur);
-    //   }
-    // }
-    int queuelength = length_job_deque(&jobject);
-    for(int i=0; i<queuelength;i++)
-    {
-      Job cur = pop_front_job_deque (&jobject);
-      pid_t top = peek_front_pid_deque (&cur.pobject);
-      int pidlength = length_pid_deque (&cur.pobject);
-      for(int j=0; j<pidlength;j++)
-      {
-        pid_t curpid = pop_front_pid_deque(&cur.pobject);
-        int status;
-        if(waitpid(curpid,&status,WNOHANG)==0)
-        {
-          push_back_pid_deque(&cur.pobject, curpid);
-        }
-      }
-    if(is_empty_pid_deque(&cur.pobject))
-    {
-      print_job_bg_complete(cur.job_id, top, cur.cmd);
-    }
-    else{
-      push_back_job_deque(&jobject, cur);
+void check_jobs_bg_status() {
+  pid_t pid;
+  int status;
+  struct rusage usage;
+  bool any_done = false;
+
+  // Foreground processes are always waited on directly, so anything reaped
+  // here belongs to a background job
+  while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+    Job* job = reap_job_process(pid);
+
+    profile_background_rusage(&usage);
+
+    if (job != NULL && job->num_running == 0)
+      any_done = true;
+  }
+
+  if (!any_done)
+    return;
+
+  for (int id = 1; id <= max_job_id(); ++id) {
+    Job* job = get_job(id);
+
+    if (job != NULL && job->num_running == 0) {
+      print_job_bg_complete(job->job_id, job->pids[0], job->cmd);
+      remove_job(id);
     }
   }
 }
@@ -148,6 +148,117 @@ void run_generic(GenericCommand cmd) {
   perror ("ERROR: Failed to execute program");
 }
 
+// Decide if a generic command can be served by run_copy() instead of exec'ing
+// cat. Anything with options is left to the real program.
+static bool is_copy_command(GenericCommand cmd) {
+  if (strcmp(cmd.args[0], "cat") != 0)
+    return false;
+
+  for (int i = 1; cmd.args[i] != NULL; ++i) {
+    if (cmd.args[i][0] == '-' && cmd.args[i][1] != '\0')
+      return false;
+  }
+
+  return true;
+}
+
+// Move everything left in the file descriptor in to the file descriptor out.
+// The kernel copies the data directly whenever the pair of descriptors allows
+// it. Otherwise, or if the kernel refuses, fall back to read and write.
+static bool copy_fd(int in, int out) {
+  struct stat in_st;
+  struct stat out_st;
+
+  bool fast = fstat(in, &in_st) == 0 && fstat(out, &out_st) == 0;
+
+  while (fast) {
+    ssize_t n;
+
+    if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode))
+      n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+    else if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode))
+      n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0);
+    else if (S_ISREG(in_st.st_mode))
+      n = sendfile(out, in, NULL, COPY_CHUNK);
+    else
+      break;
+
+    if (n == 0)
+      return true;
+
+    if (n < 0 && errno != EINTR)
+      break;
+  }
+
+  char buf[BUFSIZ];
+  ssize_t n;
+
+  while ((n = read(in, buf, sizeof(buf))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+
+      return false;
+    }
+
+    for (ssize_t off = 0; off < n; ) {
+      ssize_t w = write(out, buf + off, n - off);
+
+      if (w < 0) {
+        if (errno == EINTR)
+          continue;
+
+        return false;
+      }
+
+      off += w;
+    }
+  }
+
+  return true;
+}
+
+// Concatenate files (or standard in) to standard out without an exec
+void run_copy(GenericCommand cmd) {
+  char** files = cmd.args + 1;
+  bool failed = false;
+
+  if (files[0] == NULL && !copy_fd(STDIN_FILENO, STDOUT_FILENO)) {
+    perror("ERROR: Failed to copy standard in");
+    failed = true;
+  }
+
+  for (int i = 0; files[i] != NULL; ++i) {
+    if (strcmp(files[i], "-") == 0) {
+      if (!copy_fd(STDIN_FILENO, STDOUT_FILENO)) {
+        perror("ERROR: Failed to copy standard in");
+        failed = true;
+      }
+
+      continue;
+    }
+
+    int fd = open(files[i], O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+      fprintf(stderr, "cat: %s: %s\n", files[i], strerror(errno));
+      failed = true;
+      continue;
+    }
+
+    if (!copy_fd(fd, STDOUT_FILENO)) {
+      fprintf(stderr, "cat: %s: %s\n", files[i], strerror(errno));
+      failed = true;
+    }
+
+    close(fd);
+  }
+
+  // The same status as the cat this stands in for
+  if (failed)
+    exit(EXIT_FAILURE);
+}
+
 // Print strings
 void run_echo(EchoCommand cmd) {
   char** str = cmd.args;
@@ -187,45 +298,19 @@ void run_cd(CDCommand cmd) {
 
 // Sends a signal to all processes contained in a job
 void run_kill(KillCommand cmd) {
-int signal = cmd.sig;
-int job_id = cmd.job;
-int queuelength = length_job_deque (&jobject);
-struct Job temp;
-// find job
-for (int i = 0; i < queuelength; i++) {
-  temp = pop_front_job_deque (&jobject);
-  if (temp.job_id == job_id) {
-		// kill all processes
-		pid_deque curr_pobject = temp.pobject;
-    int pidlength = length_pid_deque (&curr_pobject);
-		while (pidlength!= 0) {
-	    pid_t curr_pid = pop_front_pid_deque (&curr_pobject);
-	    kill (curr_pid, signal);
-      pidlength = length_pid_deque (&curr_pobject);
-	   }
-    }
-  push_back_job_deque (&jobject, temp);
-  }
-// int signal = cmd.sig;
-// int job_id = cmd.job;
-//
-// int queuelength = length_job_deque (&jobject);
-// Job temp;
-// // find job
-// for (int i = 0; i < queuelength; i++) {
-//   temp = pop_front_job_deque (&jobject);
-//   if (temp.job_id == job_id) {
-//     pid_t kill_pid;
-// 		while (!is_empty_pid_deque(&temp.pobject)) {
-// 	    kill_pid = pop_front_pid_deque (&temp.pobject);
-// 	    kill (kill_pid, signal);
-// 	   }
-//         print_job_bg_complete(temp.job_id, kill_pid, temp.cmd);
-//     }
-//   else{
-//     push_back_pid_deque(&pobject,kill_pid);
-//     }
-//   }
+  Job* job = get_job(cmd.job);
+
+  if (job == NULL) {
+    fprintf(stderr, "ERROR: No such job: %d\n", cmd.job);
+    return;
+  }
+
+  // Skip processes that were already reaped. Their pids may belong to
+  // something else by now.
+  for (size_t i = 0; i < job->num_pids; ++i) {
+    if (get_job_by_pid(job->pids[i]) == job)
+      kill(job->pids[i], cmd.sig);
+  }
 }
 
 // Prints the current working directory to stdout
@@ -242,13 +327,13 @@ void run_pwd() {
 
 // Prints all background jobs currently in the job list to stdout
 void run_jobs() {
-  int queuelength = length_job_deque (&jobject);
-  for (int j = 0; j < queuelength; j++){
-    struct Job cur = pop_front_job_deque (&jobject);
-    pid_t process = peek_front_pid_deque(&cur.pobject);
-  	print_job (cur.job_id, process, cur.cmd);
-  	push_back_job_deque (&jobject, cur);
+  for (int id = 1; id <= max_job_id(); ++id) {
+    Job* job = get_job(id);
+
+    if (job != NULL)
+      print_job(job->job_id, job->pids[0], job->cmd);
   }
+
   // Flush the buffer before returning
   fflush(stdout);
 }
@@ -273,7 +358,12 @@ void child_run_command(Command cmd) {
 
   switch (type) {
     case GENERIC:
-    run_generic(cmd.generic);
+    if (is_parallel_command(cmd.generic))
+      run_parallel(cmd.generic);
+    else if (is_copy_command(cmd.generic))
+      run_copy(cmd.generic);
+    else
+      run_generic(cmd.generic);
     break;
 
     case ECHO:
@@ -341,6 +431,244 @@ void parent_run_command(Command cmd) {
   }
 }
 
+/**
+* @brief Allocate the pipe table for every command in @a holders
+*
+* The table holds exactly one slot per pipe in the pipeline. The pipes
+* themselves are only opened right before the command that writes to them is
+* forked, so quash never holds more than a single pipe at a time no matter how
+* long the pipeline is.
+*
+* @param holders The EOC terminated array of commands about to be run
+*/
+static void init_pipeline(CommandHolder* holders) {
+  int num_cmds = 0;
+
+  while (get_command_holder_type(holders[num_cmds]) != EOC)
+    ++num_cmds;
+
+  m_num_pipes = num_cmds > 1 ? num_cmds - 1 : 0;
+  m_pipes = NULL;
+  m_num_cmds = 0;
+
+  if (is_profiling() && num_cmds > 0) {
+    m_exec_fds = malloc(num_cmds * sizeof(*m_exec_fds));
+    m_exec_starts = malloc(num_cmds * sizeof(*m_exec_starts));
+
+    if (m_exec_fds == NULL || m_exec_starts == NULL) {
+      perror("ERROR: Failed to allocate pipeline");
+      exit(EXIT_FAILURE);
+    }
+
+    m_num_cmds = num_cmds;
+
+    for (int i = 0; i < num_cmds; ++i)
+      m_exec_fds[i] = -1;
+  }
+
+  if (m_num_pipes == 0)
+    return;
+
+  m_pipes = malloc(m_num_pipes * sizeof(*m_pipes));
+
+  if (m_pipes == NULL) {
+    perror("ERROR: Failed to allocate pipeline");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < m_num_pipes; ++i)
+    m_pipes[i][READ] = m_pipes[i][WRITE] = -1;
+}
+
+/**
+* @brief Close any pipe ends quash still holds and free the pipe table
+*/
+static void destroy_pipeline() {
+  for (int i = 0; i < m_num_pipes; ++i) {
+    if (m_pipes[i][READ] >= 0)
+      close(m_pipes[i][READ]);
+
+    if (m_pipes[i][WRITE] >= 0)
+      close(m_pipes[i][WRITE]);
+  }
+
+  free(m_pipes);
+  m_pipes = NULL;
+  m_num_pipes = 0;
+
+  for (int i = 0; i < m_num_cmds; ++i)
+    if (m_exec_fds[i] >= 0)
+      close(m_exec_fds[i]);
+
+  free(m_exec_fds);
+  free(m_exec_starts);
+  m_exec_fds = NULL;
+  m_exec_starts = NULL;
+  m_num_cmds = 0;
+}
+
+// Close one end of a pipe and mark its slot unused
+static void close_pipe_end(int* fd) {
+  if (*fd >= 0) {
+    close(*fd);
+    *fd = -1;
+  }
+}
+
+/**
+* @brief Open the file a command redirects to or from
+*
+* @param holder The CommandHolder with the redirect
+*
+* @param target_fd Either STDIN_FILENO or STDOUT_FILENO
+*
+* @return The new file descriptor or -1 on failure
+*/
+static int open_redirect(CommandHolder holder, int target_fd) {
+  int flags;
+  const char* path;
+
+  if (target_fd == STDIN_FILENO) {
+    path = holder.redirect_in;
+    flags = O_RDONLY;
+  }
+  else {
+    path = holder.redirect_out;
+    flags = O_WRONLY | O_CREAT |
+      ((holder.flags & REDIRECT_APPEND) ? O_APPEND : O_TRUNC);
+  }
+
+  int fd = open(path, flags | O_CLOEXEC, 0666);
+
+  if (fd < 0)
+    perror("ERROR: Failed to open redirect file");
+
+  return fd;
+}
+
+/**
+* @brief Replace the file descriptor @a target_fd with the redirect file of @a
+* holder
+*
+* Only called from the child of a fork. Quash does not keep the newly opened
+* descriptor around, only the duplicate on @a target_fd.
+*
+* @param holder The CommandHolder with the redirect
+*
+* @param target_fd Either STDIN_FILENO or STDOUT_FILENO
+*/
+static void redirect_file(CommandHolder holder, int target_fd) {
+  int fd = open_redirect(holder, target_fd);
+
+  if (fd < 0)
+    exit(EXIT_FAILURE);
+
+  dup2(fd, target_fd);
+  close(fd);
+}
+
+/**
+* @brief Charge the time until each command of the pipeline exec'd to the
+* profile
+*
+* The exec pipe of a command sees EOF once the child has exec'd or, for a
+* builtin, exited. A background job is not waited for: only the commands that
+* got that far already are counted.
+*
+* @param wait True to block until every command is done
+*/
+static void collect_exec_pipes(bool wait) {
+  struct pollfd fds[m_num_cmds > 0 ? m_num_cmds : 1];
+  int left = 0;
+
+  // poll() skips the negative descriptors of commands without an exec pipe
+  for (int i = 0; i < m_num_cmds; ++i) {
+    fds[i].fd = m_exec_fds[i];
+    fds[i].events = POLLIN;
+    left += m_exec_fds[i] >= 0;
+  }
+
+  while (left > 0) {
+    int ready = poll(fds, m_num_cmds, wait ? -1 : 0);
+
+    if (ready < 0 && errno == EINTR)
+      continue;
+
+    if (ready <= 0)
+      break;
+
+    for (int i = 0; i < m_num_cmds; ++i) {
+      if (fds[i].fd < 0 || fds[i].revents == 0)
+        continue;
+
+      profile_record(PROFILE_EXEC, m_exec_starts[i]);
+      close_pipe_end(&m_exec_fds[i]);
+      fds[i].fd = -1;
+      --left;
+    }
+  }
+}
+
+/**
+* @brief Check if a command only writes to standard out and has no effect on
+* quash, so it can run inside quash without a fork
+*
+* @param type The type of the command
+*
+* @return True if the command can be run in the quash process
+*/
+static bool is_output_builtin(CommandType type) {
+  return type == ECHO || type == PWD || type == JOBS;
+}
+
+/**
+* @brief Run an output only builtin at the end of a pipeline in the quash
+* process itself
+*
+* Standard out is temporarily pointed at the redirect file when there is one.
+* Output builtins never read their input, so the pipe feeding them is simply
+* closed like it would be when a forked builtin exits.
+*
+* @param holder The CommandHolder to run
+*
+* @param i Position of @a holder in the pipeline
+*/
+static void run_in_process(CommandHolder holder, int i) {
+  int saved_stdout = -1;
+
+  if (holder.flags & PIPE_IN)
+    close_pipe_end(&m_pipes[i - 1][READ]);
+
+  if (holder.flags & REDIRECT_OUT) {
+    int fd = open_redirect(holder, STDOUT_FILENO);
+
+    if (fd < 0)
+      return;
+
+    // Without a copy of standard out there is no getting it back, so leave
+    // it alone
+    fflush(stdout);
+    saved_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+
+    if (saved_stdout < 0) {
+      perror("ERROR: Failed to save standard out");
+      close(fd);
+      return;
+    }
+
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+  }
+
+  child_run_command(holder.cmd);
+
+  if (saved_stdout >= 0) {
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+  }
+}
+
 /**
 * @brief Creates one new process centered around the @a Command in the @a
 * CommandHolder setting up redirects and pipes where needed
@@ -354,113 +682,146 @@ void parent_run_command(Command cmd) {
 *
 * @param holder The CommandHolder to try to run
 *
+* @param i Position of @a holder in the pipeline
+*
+* @return False if the process could not be set up, in which case the rest of
+* the pipeline must not be started
+*
 * @sa Command CommandHolder
 */
-void create_process(CommandHolder holder, int i) {
-// Read the flags field from the parser
-bool p_in  = holder.flags & PIPE_IN;
-bool p_out = holder.flags & PIPE_OUT;
-bool r_in  = holder.flags & REDIRECT_IN;
-bool r_out = holder.flags & REDIRECT_OUT;
-bool r_app = holder.flags & REDIRECT_APPEND;
+bool create_process(CommandHolder holder, int i) {
+  // Read the flags field from the parser
+  bool p_in  = holder.flags & PIPE_IN;
+  bool p_out = holder.flags & PIPE_OUT;
+  bool r_in  = holder.flags & REDIRECT_IN;
+  bool r_out = holder.flags & REDIRECT_OUT;
+
+  if (!p_out && !(holder.flags & BACKGROUND) &&
+      is_output_builtin(get_command_holder_type(holder))) {
+    run_in_process(holder, i);
+    return true;
+  }
 
-int write_end = i % 2;
-	int read_end = (i - 1) % 2;
+  // The only pipe ends open in quash at this point are the read end of the
+  // previous pipe and, after this call, both ends of this command's pipe
+  if (p_out && pipe2(m_pipes[i], O_CLOEXEC) < 0) {
+    perror("ERROR: Failed to create pipe");
+    return false;
+  }
 
-  if (p_out)
-	{
-		pipe (m_pipes[write_end]);
-	}
+  // While profiling, a close on exec pipe tells quash when the child has
+  // exec'd: the read end sees EOF once the last copy of the write end is gone
+  int exec_pipe[2] = { -1, -1 };
+
+  if (is_profiling() && pipe2(exec_pipe, O_CLOEXEC) < 0)
+    exec_pipe[READ] = exec_pipe[WRITE] = -1;
+
+  uint64_t fork_start = profile_clock();
   pid_t pid = fork();
 
-  push_back_pid_deque(&pobject, pid);
-  if (pid == 0) {
+  profile_record(PROFILE_FORK, fork_start);
 
-		if (p_in)
-		{
-			dup2 (m_pipes[read_end][READ], STDIN_FILENO);
-			close (m_pipes[read_end][READ]);
-		}
-		if (p_out)
-		{
-			dup2 (m_pipes[write_end][WRITE], STDOUT_FILENO);
-			close (m_pipes[write_end][WRITE]);
-		}
-	  if (r_in)
-	  {
-		  FILE* f = fopen (holder.redirect_in, "r");
-		  dup2 (fileno (f), STDIN_FILENO);
-	  }
-	  if (r_out)
-	  {
-		  if (r_app)
-		  {
-			  FILE* f = fopen (holder.redirect_out, "a");
-			  dup2 (fileno (f), STDOUT_FILENO);
-		  }
-		  else
-		  {
-			  FILE* f = fopen (holder.redirect_out, "w");
-			  dup2 (fileno (f), STDOUT_FILENO);
-		  }
-	  }
-
-    child_run_command (holder.cmd);
-    exit(0);
+  if (pid < 0) {
+    perror("ERROR: Failed to fork");
+    close_pipe_end(&exec_pipe[READ]);
+    close_pipe_end(&exec_pipe[WRITE]);
+    return false;
   }
-  else
+
+  if (pid == 0) {
+    close_pipe_end(&exec_pipe[READ]);
+
+    if (p_in) {
+      dup2(m_pipes[i - 1][READ], STDIN_FILENO);
+      close(m_pipes[i - 1][READ]);
+    }
+
     if (p_out) {
-      close (m_pipes[write_end][WRITE]);
+      dup2(m_pipes[i][WRITE], STDOUT_FILENO);
+      close(m_pipes[i][WRITE]);
+      close(m_pipes[i][READ]);
     }
 
-    parent_run_command(holder.cmd);
- }
+    if (r_in)
+      redirect_file(holder, STDIN_FILENO);
 
-// Run a list of commands
-void run_script(CommandHolder* holders) {
+    if (r_out)
+      redirect_file(holder, STDOUT_FILENO);
 
-if (run){
-	jobject = new_job_deque (1);
-  run = false;
-}
-pobject = new_pid_deque(1);
-if (holders == NULL)
- return;
+    child_run_command(holder.cmd);
+    exit(0);
+  }
 
-check_jobs_bg_status();
+  push_back_pid_deque(&pobject, pid);
 
-if (get_command_holder_type(holders[0]) == EXIT &&
-   get_command_holder_type(holders[1]) == EOC) {
- end_main_loop();
- return;
-}
+  // Waiting here for the exec would hold up the rest of the pipeline, which a
+  // child that never execs may need to make progress
+  if (exec_pipe[READ] >= 0) {
+    close_pipe_end(&exec_pipe[WRITE]);
+    m_exec_fds[i] = exec_pipe[READ];
+    m_exec_starts[i] = profile_clock();
+  }
 
-CommandType type;
+  // Each end is owned by exactly one child now
+  if (p_in)
+    close_pipe_end(&m_pipes[i - 1][READ]);
 
+  if (p_out)
+    close_pipe_end(&m_pipes[i][WRITE]);
 
-// Run all commands in the `holder` array
-for (int i = 0; (type = get_command_holder_type(holders[i]) ) != EOC; ++i){
- create_process(holders[i], i );
+  parent_run_command(holder.cmd);
+  return true;
 }
 
+// Run a list of commands
+void run_script(CommandHolder* holders) {
+  if (holders == NULL)
+    return;
+
+  check_jobs_bg_status();
+
+  if (get_command_holder_type(holders[0]) == EXIT &&
+      get_command_holder_type(holders[1]) == EOC) {
+    end_main_loop();
+    return;
+  }
+
+  pobject = new_pid_deque(1);
+
+  // Run all commands in the `holder` array
+  init_pipeline(holders);
+  // A stage that could not start leaves the next one without its input, so
+  // the rest are not started. Those already running see their pipe close.
+  for (int i = 0; get_command_holder_type(holders[i]) != EOC; ++i)
+    if (!create_process(holders[i], i))
+      break;
+  collect_exec_pipes(!(holders[0].flags & BACKGROUND));
+  destroy_pipeline();
 
   if (!(holders[0].flags & BACKGROUND)) {
+    uint64_t wait_start = profile_clock();
 
-   while (!is_empty_pid_deque (&pobject)) {
-     int status;
-     waitpid (pop_front_pid_deque (&pobject), &status, 0);
-   }
-   destroy_pid_deque (&pobject);
-  }
+    while (!is_empty_pid_deque(&pobject)) {
+      int status;
+      struct rusage usage;
 
+      if (wait4(pop_front_pid_deque(&pobject), &status, 0, &usage) > 0)
+        profile_rusage(&usage);
+    }
+
+    profile_record(PROFILE_WAIT, wait_start);
+
+    destroy_pid_deque(&pobject);
+  }
+  else if (is_empty_pid_deque(&pobject)) {
+    destroy_pid_deque(&pobject);
+  }
+  else { // background job
+    pid_t last = peek_back_pid_deque(&pobject);
+    size_t num_pids;
+    pid_t* pids = as_array_pid_deque(&pobject, &num_pids);
+    Job* job = add_job(pids, num_pids, get_command_string());
 
-  else {// background job
-     struct Job cur;
-     cur.job_id = num;
-     num = num +1;
-     cur.pobject = pobject;
-     cur.cmd = get_command_string ();
-     push_back_job_deque (&jobject, cur);
-     print_job_bg_start (cur.job_id, peek_back_pid_deque (&pobject), cur.cmd);
-   }
+    print_job_bg_start(job->job_id, last, job->cmd);
+  }
 }
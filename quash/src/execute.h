@@ -100,6 +100,19 @@ void print_job_bg_complete(int job_id, pid_t pid, const char* cmd);
  */
 void run_generic(GenericCommand cmd);
 
+/**
+ * @brief Run cat without exec'ing it
+ *
+ * Copies each file named in the arguments (or standard in when there are none)
+ * to standard out with splice(), copy_file_range() or sendfile() so the data
+ * never passes through quash's memory. Only used for cat without options.
+ *
+ * @param cmd A @a GenericCommand whose first argument is "cat"
+ *
+ * @sa GenericCommand
+ */
+void run_copy(GenericCommand cmd);
+
 /**
  * @brief Run the builtin echo command
  *
@@ -0,0 +1,230 @@
+/**
+ * @file jobs.c
+ *
+ * @brief Implements the table of background jobs
+ */
+
+#include "jobs.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Markers for unused slots in the pid map. Real process ids are always
+// positive.
+#define PID_EMPTY     ((pid_t) 0)
+#define PID_TOMBSTONE ((pid_t) -1)
+
+/**
+ * @brief One entry of the open addressing pid to job id map
+ */
+typedef struct PidEntry {
+  pid_t pid;  /**< Process id, @a PID_EMPTY or @a PID_TOMBSTONE */
+  int job_id; /**< Id of the job the process belongs to */
+} PidEntry;
+
+// Jobs indexed by job id - 1
+static Job* m_jobs = NULL;
+static int m_jobs_cap = 0;
+static int m_max_id = 0;
+
+// Power of two sized hash table from pid to job id
+static PidEntry* m_pid_map = NULL;
+static size_t m_pid_map_cap = 0;
+static size_t m_pid_map_used = 0; // Live entries plus tombstones
+
+static void* __checked_realloc(void* ptr, size_t size) {
+  void* ret = realloc(ptr, size);
+
+  if (ret == NULL) {
+    perror("ERROR: Failed to allocate job table");
+    exit(EXIT_FAILURE);
+  }
+
+  return ret;
+}
+
+static size_t __pid_hash(pid_t pid) {
+  return ((uint32_t) pid * 2654435761u) & (m_pid_map_cap - 1);
+}
+
+// Find the slot holding pid or NULL if pid is not in the map
+static PidEntry* __find_pid(pid_t pid) {
+  if (m_pid_map_cap == 0)
+    return NULL;
+
+  for (size_t i = __pid_hash(pid); ; i = (i + 1) & (m_pid_map_cap - 1)) {
+    if (m_pid_map[i].pid == pid)
+      return &m_pid_map[i];
+
+    if (m_pid_map[i].pid == PID_EMPTY)
+      return NULL;
+  }
+}
+
+static void __insert_pid(pid_t pid, int job_id);
+
+// Rebuild the map with at least four times as many slots as live entries,
+// dropping all tombstones
+static void __grow_pid_map(size_t live) {
+  PidEntry* old_map = m_pid_map;
+  size_t old_cap = m_pid_map_cap;
+
+  m_pid_map_cap = 16;
+
+  while (m_pid_map_cap < 4 * (live + 1))
+    m_pid_map_cap *= 2;
+
+  m_pid_map = calloc(m_pid_map_cap, sizeof(PidEntry));
+
+  if (m_pid_map == NULL) {
+    perror("ERROR: Failed to allocate job table");
+    exit(EXIT_FAILURE);
+  }
+
+  m_pid_map_used = 0;
+
+  for (size_t i = 0; i < old_cap; ++i) {
+    if (old_map[i].pid > 0)
+      __insert_pid(old_map[i].pid, old_map[i].job_id);
+  }
+
+  free(old_map);
+}
+
+static void __insert_pid(pid_t pid, int job_id) {
+  PidEntry* entry = __find_pid(pid);
+
+  if (entry != NULL) {
+    entry->job_id = job_id;
+    return;
+  }
+
+  // Keep the map at most half full so probes stay short
+  if (2 * (m_pid_map_used + 1) > m_pid_map_cap) {
+    size_t live = 0;
+
+    for (size_t i = 0; i < m_pid_map_cap; ++i)
+      live += m_pid_map[i].pid > 0;
+
+    __grow_pid_map(live);
+  }
+
+  size_t i = __pid_hash(pid);
+
+  while (m_pid_map[i].pid > 0)
+    i = (i + 1) & (m_pid_map_cap - 1);
+
+  if (m_pid_map[i].pid == PID_EMPTY)
+    ++m_pid_map_used;
+
+  m_pid_map[i] = (PidEntry) { pid, job_id };
+}
+
+// Add a job to the job table
+Job* add_job(pid_t* pids, size_t num_pids, char* cmd) {
+  int job_id = m_max_id + 1;
+
+  if (job_id > m_jobs_cap) {
+    int new_cap = m_jobs_cap > 0 ? 2 * m_jobs_cap : 8;
+
+    m_jobs = __checked_realloc(m_jobs, new_cap * sizeof(Job));
+    memset(m_jobs + m_jobs_cap, 0, (new_cap - m_jobs_cap) * sizeof(Job));
+    m_jobs_cap = new_cap;
+  }
+
+  Job* job = &m_jobs[job_id - 1];
+
+  *job = (Job) {
+    job_id,
+    cmd,
+    pids,
+    num_pids,
+    num_pids
+  };
+
+  m_max_id = job_id;
+
+  for (size_t i = 0; i < num_pids; ++i)
+    __insert_pid(pids[i], job_id);
+
+  return job;
+}
+
+// Find a job by its id
+Job* get_job(int job_id) {
+  if (job_id < 1 || job_id > m_max_id || m_jobs[job_id - 1].job_id == 0)
+    return NULL;
+
+  return &m_jobs[job_id - 1];
+}
+
+// Find the job a process belongs to
+Job* get_job_by_pid(pid_t pid) {
+  PidEntry* entry = __find_pid(pid);
+
+  if (entry == NULL)
+    return NULL;
+
+  return get_job(entry->job_id);
+}
+
+// Record that a process has been reaped
+Job* reap_job_process(pid_t pid) {
+  PidEntry* entry = __find_pid(pid);
+
+  if (entry == NULL)
+    return NULL;
+
+  Job* job = get_job(entry->job_id);
+
+  entry->pid = PID_TOMBSTONE;
+
+  if (job != NULL && job->num_running > 0)
+    --job->num_running;
+
+  return job;
+}
+
+// Remove a job from the table and free its memory
+void remove_job(int job_id) {
+  Job* job = get_job(job_id);
+
+  if (job == NULL)
+    return;
+
+  for (size_t i = 0; i < job->num_pids; ++i) {
+    PidEntry* entry = __find_pid(job->pids[i]);
+
+    if (entry != NULL && entry->job_id == job_id)
+      entry->pid = PID_TOMBSTONE;
+  }
+
+  free(job->pids);
+  free(job->cmd);
+  memset(job, 0, sizeof(Job));
+
+  // Hand out the ids of the newest jobs again once they are gone
+  while (m_max_id > 0 && m_jobs[m_max_id - 1].job_id == 0)
+    --m_max_id;
+}
+
+// Get the largest job id in use
+int max_job_id() {
+  return m_max_id;
+}
+
+// Free every job and the table itself
+void destroy_job_table() {
+  while (m_max_id > 0)
+    remove_job(m_max_id);
+
+  free(m_jobs);
+  free(m_pid_map);
+
+  m_jobs = NULL;
+  m_pid_map = NULL;
+  m_jobs_cap = 0;
+  m_pid_map_cap = m_pid_map_used = 0;
+}
@@ -0,0 +1,98 @@
+/**
+ * @file jobs.h
+ *
+ * @brief The table of background jobs
+ *
+ * Jobs live in a dense array indexed by job id, so finding a job for @a kill
+ * or listing them for @a jobs never has to search. A second table maps each
+ * process id to the job that owns it, so a process reaped with waitpid() can
+ * be charged to its job without scanning every job.
+ */
+
+#ifndef SRC_JOBS_H
+#define SRC_JOBS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * @brief A background job and the processes that belong to it
+ */
+typedef struct Job {
+  int job_id;         /**< Job id number. Zero marks an unused slot */
+  char* cmd;          /**< The command string the user typed for this job */
+  pid_t* pids;        /**< Every process started for the job in pipeline
+                       * order */
+  size_t num_pids;    /**< Length of @a pids */
+  size_t num_running; /**< Number of processes in @a pids not yet reaped */
+} Job;
+
+/**
+ * @brief Add a job to the job table
+ *
+ * Like bash, the new job gets an id one greater than the largest id still in
+ * use, so ids are handed out again once the newest jobs finish.
+ *
+ * @param pids A malloc'd array of process ids. The job table takes ownership.
+ *
+ * @param num_pids Length of @a pids. Must be greater than zero.
+ *
+ * @param cmd A malloc'd command string. The job table takes ownership.
+ *
+ * @return A pointer to the new job. It stays valid until the next call to @a
+ * add_job() or @a remove_job().
+ */
+Job* add_job(pid_t* pids, size_t num_pids, char* cmd);
+
+/**
+ * @brief Find a job by its id
+ *
+ * @param job_id Job identifier number
+ *
+ * @return The job or NULL if there is no job with this id
+ */
+Job* get_job(int job_id);
+
+/**
+ * @brief Find the job a process belongs to
+ *
+ * @param pid Process id of a process that has not been reaped yet
+ *
+ * @return The job or NULL if the process is not part of a background job
+ */
+Job* get_job_by_pid(pid_t pid);
+
+/**
+ * @brief Record that a process has been reaped
+ *
+ * @param pid Process id returned by waitpid()
+ *
+ * @return The job the process belonged to or NULL if it was not part of a
+ * background job
+ */
+Job* reap_job_process(pid_t pid);
+
+/**
+ * @brief Remove a job from the table and free its memory
+ *
+ * @param job_id Job identifier number
+ */
+void remove_job(int job_id);
+
+/**
+ * @brief Get the largest job id in use
+ *
+ * Iterate over the jobs with `for (int id = 1; id <= max_job_id(); ++id)`
+ * skipping ids where @a get_job() returns NULL.
+ *
+ * @return The largest job id in use or zero if there are no jobs
+ */
+int max_job_id();
+
+/**
+ * @brief Free every job and the table itself
+ */
+void destroy_job_table();
+
+#endif
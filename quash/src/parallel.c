@@ -0,0 +1,443 @@
+/**
+ * @file parallel.c
+ *
+ * @brief Implements the parallel builtin
+ *
+ * The builtin always runs in a child of quash (it is a generic command as far
+ * as the parser is concerned), so it is a single quash job no matter how many
+ * tasks it starts. It can be put in the background, piped and killed like any
+ * other command.
+ */
+
+#define _GNU_SOURCE
+
+#include "parallel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * @brief Growable buffer holding output that cannot be written yet
+ */
+typedef struct OutBuf {
+  char* data; /**< Buffered bytes */
+  size_t len; /**< Number of bytes in @a data */
+  size_t cap; /**< Capacity of @a data */
+} OutBuf;
+
+/**
+ * @brief One slot of the task pool
+ */
+typedef struct Task {
+  pid_t pid;         /**< Process running the task or 0 if the slot is free */
+  int fd;            /**< Read end of the pipe connected to the task's standard
+                      * out */
+  size_t input;      /**< Index of the input this task was started with */
+  unsigned long seq; /**< Order in which the task was started */
+  OutBuf out;        /**< Output held back while another task owns standard
+                      * out */
+} Task;
+
+// Read by the signal handler to forward signals to the running tasks
+static Task* m_tasks = NULL;
+static int m_num_slots = 0;
+static volatile sig_atomic_t m_stop = 0;
+
+static void __usage() {
+  fprintf(stderr, "parallel: usage: parallel [-j jobs] command [args...] "
+          "[::: inputs...]\n");
+}
+
+static void __forward_signal(int sig) {
+  m_stop = 1;
+
+  for (int i = 0; i < m_num_slots; ++i) {
+    if (m_tasks[i].pid > 0)
+      kill(m_tasks[i].pid, sig);
+  }
+}
+
+static void __write_all(int fd, const char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+
+      return;
+    }
+
+    buf += n;
+    len -= n;
+  }
+}
+
+static void __append(OutBuf* out, const char* buf, size_t len) {
+  if (out->len + len > out->cap) {
+    size_t cap = out->cap > 0 ? out->cap : 4096;
+
+    while (cap < out->len + len)
+      cap *= 2;
+
+    char* data = realloc(out->data, cap);
+
+    if (data == NULL) {
+      perror("ERROR: Failed to buffer parallel output");
+      exit(EXIT_FAILURE);
+    }
+
+    out->data = data;
+    out->cap = cap;
+  }
+
+  memcpy(out->data + out->len, buf, len);
+  out->len += len;
+}
+
+// Read one input per line from standard in. This goes around stdio on
+// purpose: the stdin FILE of a forked child still holds whatever quash had
+// buffered from its own input.
+static char** __read_inputs(size_t* num_inputs, char** text) {
+  OutBuf in = { NULL, 0, 0 };
+  char buf[BUFSIZ];
+  ssize_t n;
+
+  while ((n = read(STDIN_FILENO, buf, sizeof(buf))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+
+      perror("ERROR: Failed to read parallel inputs");
+      break;
+    }
+
+    __append(&in, buf, n);
+  }
+
+  __append(&in, "", 1);
+
+  size_t max_inputs = 1;
+
+  for (size_t i = 0; i < in.len; ++i)
+    max_inputs += in.data[i] == '\n';
+
+  char** inputs = malloc(max_inputs * sizeof(char*));
+
+  if (inputs == NULL) {
+    perror("ERROR: Failed to read parallel inputs");
+    exit(EXIT_FAILURE);
+  }
+
+  *num_inputs = 0;
+
+  for (char* line = strtok(in.data, "\n"); line != NULL;
+       line = strtok(NULL, "\n"))
+    inputs[(*num_inputs)++] = line;
+
+  *text = in.data;
+
+  return inputs;
+}
+
+// Replace every {} in arg with input. Returns arg itself if there is none.
+static char* __substitute(char* arg, const char* input, bool* replaced) {
+  if (strstr(arg, "{}") == NULL)
+    return arg;
+
+  OutBuf out = { NULL, 0, 0 };
+  char* hit;
+
+  while ((hit = strstr(arg, "{}")) != NULL) {
+    __append(&out, arg, hit - arg);
+    __append(&out, input, strlen(input));
+    arg = hit + 2;
+  }
+
+  __append(&out, arg, strlen(arg) + 1);
+  *replaced = true;
+
+  return out.data;
+}
+
+// Fork a task running command with input substituted or appended
+static bool __start_task(Task* task, char** command, int cmd_len,
+                         char* input) {
+  int fds[2];
+
+  if (pipe2(fds, O_CLOEXEC) < 0) {
+    perror("ERROR: Failed to create pipe");
+    return false;
+  }
+
+  pid_t pid = fork();
+
+  if (pid < 0) {
+    perror("ERROR: Failed to fork");
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+
+  if (pid == 0) {
+    char** argv = malloc((cmd_len + 2) * sizeof(char*));
+    bool replaced = false;
+
+    if (argv == NULL)
+      _exit(127);
+
+    for (int i = 0; i < cmd_len; ++i)
+      argv[i] = __substitute(command[i], input, &replaced);
+
+    argv[cmd_len] = replaced ? NULL : input;
+    argv[cmd_len + 1] = NULL;
+
+    // The duplicate does not inherit close on exec
+    dup2(fds[1], STDOUT_FILENO);
+    execvp(argv[0], argv);
+    perror("ERROR: Failed to execute program");
+    _exit(127);
+  }
+
+  close(fds[1]);
+
+  task->pid = pid;
+  task->fd = fds[0];
+  task->out.len = 0;
+
+  return true;
+}
+
+// Check if a generic command is a call to the parallel builtin
+bool is_parallel_command(GenericCommand cmd) {
+  return strcmp(cmd.args[0], "parallel") == 0;
+}
+
+// Run the parallel builtin
+void run_parallel(GenericCommand cmd) {
+  char** args = cmd.args + 1;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (args[0] != NULL && strncmp(args[0], "-j", 2) == 0) {
+    const char* val = args[0][2] != '\0' ? args[0] + 2 : args[1];
+
+    if (val == NULL || (jobs = atol(val)) < 1) {
+      __usage();
+      return;
+    }
+
+    args += args[0][2] != '\0' ? 1 : 2;
+  }
+
+  if (jobs < 1)
+    jobs = 1;
+
+  int cmd_len = 0;
+
+  while (args[cmd_len] != NULL && strcmp(args[cmd_len], ":::") != 0)
+    ++cmd_len;
+
+  if (cmd_len == 0) {
+    __usage();
+    return;
+  }
+
+  char** inputs;
+  char* input_text = NULL;
+  size_t num_inputs = 0;
+  bool from_stdin = args[cmd_len] == NULL;
+
+  if (from_stdin) {
+    inputs = __read_inputs(&num_inputs, &input_text);
+  }
+  else {
+    inputs = args + cmd_len + 1;
+
+    while (inputs[num_inputs] != NULL)
+      ++num_inputs;
+  }
+
+  if ((size_t) jobs > num_inputs)
+    jobs = num_inputs > 0 ? num_inputs : 1;
+
+  Task* tasks = calloc(jobs, sizeof(Task));
+  struct pollfd* pfds = malloc(jobs * sizeof(struct pollfd));
+  int* pslots = malloc(jobs * sizeof(int));
+  OutBuf* pending = malloc((num_inputs + 1) * sizeof(OutBuf));
+
+  if (tasks == NULL || pfds == NULL || pslots == NULL || pending == NULL) {
+    perror("ERROR: Failed to allocate parallel tasks");
+    exit(EXIT_FAILURE);
+  }
+
+  struct sigaction sa;
+  struct sigaction old_sa[4];
+  const int signals[4] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM };
+
+  m_tasks = tasks;
+  m_num_slots = jobs;
+  m_stop = 0;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = __forward_signal;
+  sigemptyset(&sa.sa_mask);
+
+  for (int i = 0; i < 4; ++i)
+    sigaction(signals[i], &sa, &old_sa[i]);
+
+  size_t next = 0;
+  size_t num_pending = 0;
+  size_t failed = 0;
+  unsigned long seq = 0;
+  int running = 0;
+  int owner = -1; // Slot whose output goes straight to standard out
+
+  while ((next < num_inputs && !m_stop) || running > 0) {
+    // Keep every slot busy
+    for (int s = 0; s < jobs && next < num_inputs && !m_stop; ++s) {
+      if (tasks[s].pid != 0)
+        continue;
+
+      if (!__start_task(&tasks[s], args, cmd_len, inputs[next])) {
+        m_stop = 1;
+        break;
+      }
+
+      tasks[s].input = next++;
+      tasks[s].seq = seq++;
+      ++running;
+
+      if (owner < 0)
+        owner = s;
+    }
+
+    if (running == 0)
+      break;
+
+    int num_fds = 0;
+
+    for (int s = 0; s < jobs; ++s) {
+      if (tasks[s].pid != 0) {
+        pfds[num_fds] = (struct pollfd) { tasks[s].fd, POLLIN, 0 };
+        pslots[num_fds++] = s;
+      }
+    }
+
+    if (poll(pfds, num_fds, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+
+      perror("ERROR: Failed to wait for parallel tasks");
+      break;
+    }
+
+    for (int k = 0; k < num_fds; ++k) {
+      if (pfds[k].revents == 0)
+        continue;
+
+      int s = pslots[k];
+      Task* task = &tasks[s];
+      char buf[BUFSIZ];
+      ssize_t n = read(task->fd, buf, sizeof(buf));
+
+      if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        continue;
+
+      if (n > 0) {
+        if (s == owner)
+          __write_all(STDOUT_FILENO, buf, n);
+        else
+          __append(&task->out, buf, n);
+
+        continue;
+      }
+
+      // End of output. The task is exiting or has exited.
+      int status;
+
+      close(task->fd);
+
+      while (waitpid(task->pid, &status, 0) < 0 && errno == EINTR)
+        continue;
+
+      task->pid = 0;
+      --running;
+
+      if (WIFSIGNALED(status)) {
+        ++failed;
+        fprintf(stderr, "parallel: %s: killed by signal %d\n",
+                inputs[task->input], WTERMSIG(status));
+      }
+      else if (WEXITSTATUS(status) != 0) {
+        ++failed;
+        fprintf(stderr, "parallel: %s: exited with status %d\n",
+                inputs[task->input], WEXITSTATUS(status));
+      }
+
+      if (s != owner) {
+        pending[num_pending++] = task->out;
+        task->out = (OutBuf) { NULL, 0, 0 };
+        continue;
+      }
+
+      // Write out everything that finished while this task owned standard
+      // out, then hand standard out to the oldest task still running
+      for (size_t i = 0; i < num_pending; ++i) {
+        __write_all(STDOUT_FILENO, pending[i].data, pending[i].len);
+        free(pending[i].data);
+      }
+
+      num_pending = 0;
+      owner = -1;
+
+      for (int t = 0; t < jobs; ++t) {
+        if (tasks[t].pid != 0 &&
+            (owner < 0 || tasks[t].seq < tasks[owner].seq))
+          owner = t;
+      }
+
+      if (owner >= 0) {
+        __write_all(STDOUT_FILENO, tasks[owner].out.data, tasks[owner].out.len);
+        tasks[owner].out.len = 0;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < num_pending; ++i) {
+    __write_all(STDOUT_FILENO, pending[i].data, pending[i].len);
+    free(pending[i].data);
+  }
+
+  for (int i = 0; i < 4; ++i)
+    sigaction(signals[i], &old_sa[i], NULL);
+
+  if (failed > 0)
+    fprintf(stderr, "parallel: %zu of %zu tasks failed\n", failed, next);
+
+  for (int s = 0; s < jobs; ++s)
+    free(tasks[s].out.data);
+
+  if (from_stdin) {
+    free(inputs);
+    free(input_text);
+  }
+
+  m_tasks = NULL;
+  m_num_slots = 0;
+
+  free(tasks);
+  free(pfds);
+  free(pslots);
+  free(pending);
+
+  // Like GNU parallel, so scripts can tell how many tasks failed
+  if (failed > 0)
+    exit(failed < 101 ? failed : 101);
+}
@@ -0,0 +1,49 @@
+/**
+ * @file parallel.h
+ *
+ * @brief The parallel builtin for running many short tasks at once
+ */
+
+#ifndef SRC_PARALLEL_H
+#define SRC_PARALLEL_H
+
+#include <stdbool.h>
+
+#include "command.h"
+
+/**
+ * @brief Check if a generic command is a call to the parallel builtin
+ *
+ * @param cmd A @a GenericCommand
+ *
+ * @return True if @a cmd should be run with @a run_parallel()
+ */
+bool is_parallel_command(GenericCommand cmd);
+
+/**
+ * @brief Run the parallel builtin
+ *
+ * Usage: `parallel [-j jobs] command [args...] [::: inputs...]`
+ *
+ * Runs `command args... input` once for every input with at most @a jobs
+ * tasks alive at a time (the number of online CPUs by default). If any
+ * argument contains `{}`, every `{}` is replaced by the input instead of
+ * appending it. When there is no `:::` the inputs are read from standard in,
+ * one per line.
+ *
+ * The output of a task is never interleaved with the output of another. The
+ * oldest running task writes straight through while the others are buffered
+ * and written out as a block once they finish. Tasks that fail are reported on
+ * standard error along with their exit status, and the builtin exits with the
+ * number of them (at most 101).
+ *
+ * Signals that would terminate the builtin (e.g. from the kill command) are
+ * forwarded to every running task.
+ *
+ * @param cmd A @a GenericCommand whose first argument is "parallel"
+ *
+ * @sa GenericCommand
+ */
+void run_parallel(GenericCommand cmd);
+
+#endif
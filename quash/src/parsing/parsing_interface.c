@@ -8,12 +8,8 @@
 #include "parse.tab.h"
 
 IMPLEMENT_DEQUE_STRUCT(SizeStack, size_t);
-IMPLEMENT_DEQUE_STRUCT(StrBuilder, char);
-IMPLEMENT_DEQUE_STRUCT(MPStrBuilder, char);
 
 IMPLEMENT_DEQUE(SizeStack, size_t);
-IMPLEMENT_DEQUE(StrBuilder, char);
-IMPLEMENT_DEQUE_MEMORY_POOL(MPStrBuilder, char);
 IMPLEMENT_DEQUE_MEMORY_POOL(CmdStrs, char*);
 IMPLEMENT_DEQUE_MEMORY_POOL(Cmds, CommandHolder);
 
@@ -165,53 +161,80 @@ static char* __condense_string_array(char** str_arr) {
   return ret;
 }
 
-// Helper for __interpret_deref: Checks if the character is a valid first
-// character for an identifier
+// Helper for __expand_var: Checks if the character is a valid first character
+// for an identifier
 static inline bool __is_first_identifier_char(char c) {
   return isalpha(c) || c == '_';
 }
 
-// Helper for __interpret_deref: Checks if the character is a valid non-leading
+// Helper for __expand_var: Checks if the character is a valid non-leading
 // identifier character
 static inline bool __is_identifier_char(char c) {
   return isalnum(c) || c == '_';
 }
 
-// Expand an environment variable onto a string
-static void __interpret_deref(MPStrBuilder* bld, const char* str, int* idx) {
-  assert(str != NULL);
-  assert(str[*idx] == '$');
-  assert(peek_back_MPStrBuilder(bld) == '$');
+/**
+ * @brief Output buffer for @a interpret_complex_string_token()
+ *
+ * Escapes and quotes only ever shrink a token, so the buffer starts out large
+ * enough for the whole token and only has to grow when a variable expands to
+ * something longer than its name.
+ */
+typedef struct Expansion {
+  char* data; /**< Buffer allocated in the memory pool */
+  size_t len; /**< Number of characters written so far */
+  size_t cap; /**< Capacity of @a data */
+} Expansion;
+
+// Append n characters to the expansion
+static inline void __append_span(Expansion* exp, const char* src, size_t n) {
+  memcpy(exp->data + exp->len, src, n);
+  exp->len += n;
+}
+
+// Expand the environment variable whose name starts at str onto exp. Returns
+// the number of characters in the name.
+static size_t __expand_var(Expansion* exp, const char* str, size_t rest) {
+  assert(__is_first_identifier_char(str[0]));
+
+  size_t n = 1;
+
+  while (__is_identifier_char(str[n]))
+    ++n;
 
-  // Remove the dereference symbol at the back of the bld deque
-  pop_back_MPStrBuilder(bld);
+  // Names are nearly always short enough to terminate on the stack
+  char small[64];
+  char* id = n < sizeof(small) ? small : memory_pool_alloc(n + 1);
 
-  StrBuilder tmp = new_StrBuilder(16);
-  char c;
+  memcpy(id, str, n);
+  id[n] = '\0';
 
-  // Extract the identifier characters. Since this is intended only as a helper
-  // function we assume that interpret_complex_string token has already noticed
-  // a valid first identifier character after the dereference symbol.
-  while (__is_identifier_char((c = str[++(*idx)])))
-    push_back_StrBuilder(&tmp, c);
+  const char* val = lookup_env(id);
 
-  // idx increments one too far in the while loop so bring it back down
-  --(*idx);
+  if (val == NULL)
+    return n;
 
-  // Add the null terminator to the string
-  push_back_StrBuilder(&tmp, '\0');
+  size_t val_len = strlen(val);
 
-  // Extract the id string and lookup the environment variable
-  char* id = as_array_StrBuilder(&tmp, NULL);
-  const char* env_var = lookup_env(id);
+  // Everything left in the token still has to fit after the value
+  size_t need = exp->len + val_len + rest - n + 1;
 
-  free(id);
+  if (need > exp->cap) {
+    size_t cap = 2 * exp->cap;
 
-  // Append env_var to the string builder
-  if (env_var != NULL) {
-    for (int i = 0; env_var[i] != '\0'; ++i)
-      push_back_MPStrBuilder(bld, env_var[i]);
+    while (cap < need)
+      cap *= 2;
+
+    char* data = memory_pool_alloc(cap);
+
+    memcpy(data, exp->data, exp->len);
+    exp->data = data;
+    exp->cap = cap;
   }
+
+  __append_span(exp, val, val_len);
+
+  return n;
 }
 
 // Cleans up escapes and unescaped single quotes and expands environment
@@ -219,18 +242,33 @@ static void __interpret_deref(MPStrBuilder* bld, const char* str, int* idx) {
 char* interpret_complex_string_token(const char* str) {
   assert(str != NULL);
 
-  MPStrBuilder bld = new_MPStrBuilder(64);
-  int i;
-  int len = strlen(str);
+  size_t len = strlen(str);
+  const char* end = str + len;
+  const char* p = str;
   bool in_quotes = false;
+  Expansion exp = { memory_pool_alloc(len + 1), 0, len + 1 };
 
-  for (i = 0; i <= len; ++i) {
-    push_back_MPStrBuilder(&bld, str[i]);
+  // Most tokens have no escapes, quotes or variables at all
+  if (memchr(str, '$', len) == NULL && memchr(str, '\\', len) == NULL &&
+      memchr(str, '\'', len) == NULL) {
+    memcpy(exp.data, str, len + 1);
+    return exp.data;
+  }
+
+  while (p < end) {
+    // Copy the literal run up to the next special character in one go
+    size_t run = strcspn(p, in_quotes ? "\\'" : "\\'$");
+
+    __append_span(&exp, p, run);
+    p += run;
+
+    if (p == end)
+      break;
 
-    switch (str[i]) {
+    switch (*p) {
     case '\\':                // Remove valid escape characters
       if (!in_quotes) {
-        switch (str[i+1]) {
+        switch (p[1]) {
         case '\\':
         case '\'':
         case '#':
@@ -241,32 +279,44 @@ char* interpret_complex_string_token(const char* str) {
         case ';':
         case ' ':
         case '\t':
-          update_back_MPStrBuilder(&bld, str[++i]);
+          __append_span(&exp, p + 1, 1);
+          p += 2;
           break;
 
         case '\n':
-          pop_back_MPStrBuilder(&bld);
-          ++i;
+          p += 2;
           break;
 
         default:
+          __append_span(&exp, p, 1);
+          ++p;
           break;
         }
       }
-      else if (str[i+1] == '\'') {
-        update_back_MPStrBuilder(&bld, '\'');
-        ++i;
+      else if (p[1] == '\'') {
+        __append_span(&exp, p + 1, 1);
+        p += 2;
+      }
+      else {
+        __append_span(&exp, p, 1);
+        ++p;
       }
       break;
 
     case '\'':                // Remove single quotes and toggle quote state
       in_quotes = !in_quotes;
-      pop_back_MPStrBuilder(&bld);
+      ++p;
       break;
 
     case '$':                 // Try to dereference environment variables
-      if (!in_quotes && __is_first_identifier_char(str[i + 1]))
-        __interpret_deref(&bld, str, &i);
+      if (__is_first_identifier_char(p[1])) {
+        ++p;
+        p += __expand_var(&exp, p, end - p);
+      }
+      else {
+        __append_span(&exp, p, 1);
+        ++p;
+      }
       break;
 
     default:
@@ -275,11 +325,11 @@ char* interpret_complex_string_token(const char* str) {
   }
 
   // Add a null terminator
-  update_back_MPStrBuilder(&bld, '\0');
+  exp.data[exp.len] = '\0';
 
   assert(!in_quotes);
 
-  return as_array_MPStrBuilder(&bld, NULL);
+  return exp.data;
 }
 
 // Build a Redirect structure
@@ -0,0 +1,228 @@
+/**
+ * @file profile.c
+ *
+ * @brief Implements the optional timing and resource usage instrumentation
+ */
+
+#include "profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @brief Measurements collected for one command or for the whole session
+ */
+typedef struct CommandProfile {
+  uint64_t phase_ns[NUM_PROFILE_PHASES]; /**< Time charged to each phase */
+  uint64_t wall_ns;  /**< Time from the end of parsing to the end of the
+                      * command */
+  uint64_t num_procs; /**< Number of processes reaped */
+  uint64_t utime_us; /**< User CPU time of the reaped processes */
+  uint64_t stime_us; /**< System CPU time of the reaped processes */
+  long maxrss_kb;    /**< Largest resident set of any reaped process */
+  long minflt;       /**< Minor page faults */
+  long majflt;       /**< Major page faults */
+  long nvcsw;        /**< Voluntary context switches */
+  long nivcsw;       /**< Involuntary context switches */
+} CommandProfile;
+
+static const char* phase_names[NUM_PROFILE_PHASES] = {
+  "parse",
+  "fork",
+  "exec",
+  "wait"
+};
+
+static bool m_enabled = false;
+static pid_t m_quash_pid = 0;
+static FILE* m_trace = NULL;
+static uint64_t m_session_start = 0;
+static uint64_t m_command_start = 0;
+static uint64_t m_num_commands = 0;
+static CommandProfile m_current;
+static CommandProfile m_total;
+static CommandProfile m_background;
+
+static uint64_t __timeval_us(struct timeval tv) {
+  return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void __add_rusage(CommandProfile* prof, const struct rusage* usage) {
+  prof->num_procs += 1;
+  prof->utime_us += __timeval_us(usage->ru_utime);
+  prof->stime_us += __timeval_us(usage->ru_stime);
+  prof->minflt += usage->ru_minflt;
+  prof->majflt += usage->ru_majflt;
+  prof->nvcsw += usage->ru_nvcsw;
+  prof->nivcsw += usage->ru_nivcsw;
+
+  if (usage->ru_maxrss > prof->maxrss_kb)
+    prof->maxrss_kb = usage->ru_maxrss;
+}
+
+static void __add_profile(CommandProfile* dst, const CommandProfile* src) {
+  for (int i = 0; i < NUM_PROFILE_PHASES; ++i)
+    dst->phase_ns[i] += src->phase_ns[i];
+
+  dst->wall_ns += src->wall_ns;
+  dst->num_procs += src->num_procs;
+  dst->utime_us += src->utime_us;
+  dst->stime_us += src->stime_us;
+  dst->minflt += src->minflt;
+  dst->majflt += src->majflt;
+  dst->nvcsw += src->nvcsw;
+  dst->nivcsw += src->nivcsw;
+
+  if (src->maxrss_kb > dst->maxrss_kb)
+    dst->maxrss_kb = src->maxrss_kb;
+}
+
+static void __print_rusage(const char* who, const CommandProfile* prof) {
+  fprintf(stderr, "%-12s user %.3f s  sys %.3f s  max rss %ld KiB  "
+          "faults %ld/%ld  ctx switches %ld/%ld\n", who,
+          prof->utime_us / 1e6, prof->stime_us / 1e6, prof->maxrss_kb,
+          prof->minflt, prof->majflt, prof->nvcsw, prof->nivcsw);
+}
+
+// Turn profiling on if the environment asks for it
+void init_profile() {
+  const char* enable = getenv("QUASH_PROFILE");
+
+  m_enabled = enable != NULL && enable[0] != '\0' && strcmp(enable, "0") != 0;
+
+  if (!m_enabled)
+    return;
+
+  m_quash_pid = getpid();
+  m_session_start = profile_clock();
+
+  const char* trace = getenv("QUASH_PROFILE_TRACE");
+
+  if (trace != NULL && trace[0] != '\0') {
+    // Close on exec so children never see the trace file
+    if ((m_trace = fopen(trace, "ae")) == NULL) {
+      perror("ERROR: Failed to open QUASH_PROFILE_TRACE");
+    }
+    else {
+      fprintf(m_trace, "#parse_us\tfork_us\texec_us\twait_us\twall_us\tprocs\t"
+              "user_us\tsys_us\tmaxrss_kb\tminflt\tmajflt\tnvcsw\tnivcsw\tcmd\n");
+      fflush(m_trace);
+    }
+  }
+}
+
+// Print the profiling summary and close the trace file
+void destroy_profile() {
+  // Forked children run the atexit handlers too. Only quash reports.
+  if (!m_enabled || getpid() != m_quash_pid)
+    return;
+
+  uint64_t session_ns = profile_clock() - m_session_start;
+  struct rusage self;
+
+  getrusage(RUSAGE_SELF, &self);
+
+  fprintf(stderr, "\nQUASH PROFILE: %lu commands, %lu processes, %.3f s\n",
+          (unsigned long) m_num_commands,
+          (unsigned long) (m_total.num_procs + m_background.num_procs),
+          session_ns / 1e9);
+  fprintf(stderr, "%-12s %12s %12s\n", "phase", "total ms", "mean ms");
+
+  for (int i = 0; i < NUM_PROFILE_PHASES; ++i) {
+    fprintf(stderr, "%-12s %12.3f %12.3f\n", phase_names[i],
+            m_total.phase_ns[i] / 1e6,
+            m_num_commands ? m_total.phase_ns[i] / 1e6 / m_num_commands : 0.0);
+  }
+
+  fprintf(stderr, "%-12s %12.3f %12.3f\n", "wall", m_total.wall_ns / 1e6,
+          m_num_commands ? m_total.wall_ns / 1e6 / m_num_commands : 0.0);
+
+  __print_rusage("foreground", &m_total);
+  __print_rusage("background", &m_background);
+
+  CommandProfile quash;
+
+  memset(&quash, 0, sizeof(quash));
+  __add_rusage(&quash, &self);
+  __print_rusage("quash", &quash);
+
+  if (m_trace != NULL) {
+    fclose(m_trace);
+    m_trace = NULL;
+  }
+
+  m_enabled = false;
+}
+
+// Query if profiling is on
+bool is_profiling() {
+  return m_enabled;
+}
+
+// Read the clock used for all profiling measurements
+uint64_t profile_clock() {
+  if (!m_enabled)
+    return 0;
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Charge the time since start to a phase of the current command
+void profile_record(ProfilePhase phase, uint64_t start) {
+  if (m_enabled)
+    m_current.phase_ns[phase] += profile_clock() - start;
+}
+
+// Add the resource usage of a reaped process to the current command
+void profile_rusage(const struct rusage* usage) {
+  if (m_enabled)
+    __add_rusage(&m_current, usage);
+}
+
+// Add the resource usage of a reaped background process to the totals
+void profile_background_rusage(const struct rusage* usage) {
+  if (m_enabled)
+    __add_rusage(&m_background, usage);
+}
+
+// Mark the start of executing the current command
+void profile_begin_command() {
+  m_command_start = profile_clock();
+}
+
+// Finish the current command
+void profile_end_command(const char* cmd) {
+  if (!m_enabled)
+    return;
+
+  m_current.wall_ns = profile_clock() - m_command_start;
+
+  if (m_trace != NULL) {
+    fprintf(m_trace, "%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%ld\t%ld\t%ld\t"
+            "%ld\t%ld\t%s\n",
+            (unsigned long) (m_current.phase_ns[PROFILE_PARSE] / 1000),
+            (unsigned long) (m_current.phase_ns[PROFILE_FORK] / 1000),
+            (unsigned long) (m_current.phase_ns[PROFILE_EXEC] / 1000),
+            (unsigned long) (m_current.phase_ns[PROFILE_WAIT] / 1000),
+            (unsigned long) (m_current.wall_ns / 1000),
+            (unsigned long) m_current.num_procs,
+            (unsigned long) m_current.utime_us,
+            (unsigned long) m_current.stime_us,
+            m_current.maxrss_kb, m_current.minflt, m_current.majflt,
+            m_current.nvcsw, m_current.nivcsw, cmd != NULL ? cmd : "");
+
+    // Flush now so a fork never inherits buffered trace lines
+    fflush(m_trace);
+  }
+
+  __add_profile(&m_total, &m_current);
+  ++m_num_commands;
+  memset(&m_current, 0, sizeof(m_current));
+}
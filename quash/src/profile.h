@@ -0,0 +1,102 @@
+/**
+ * @file profile.h
+ *
+ * @brief Optional timing and resource usage instrumentation
+ *
+ * Profiling is off unless the QUASH_PROFILE environment variable is set to a
+ * non-empty value other than "0" when Quash starts. While it is on, Quash
+ * measures how long each command spends in every @a ProfilePhase, collects
+ * the rusage of every foreground process it waits on and prints a summary to
+ * standard error on exit. If QUASH_PROFILE_TRACE names a file, one tab
+ * separated line per command is appended to it as well.
+ *
+ * All functions are cheap no-ops while profiling is off.
+ */
+
+#ifndef SRC_PROFILE_H
+#define SRC_PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/resource.h>
+
+/**
+ * @brief The parts of running a command that are timed separately
+ */
+typedef enum ProfilePhase {
+  PROFILE_PARSE = 0, /**< Reading and parsing the command line. Includes time
+                      * spent waiting for input on a TTY */
+  PROFILE_FORK,      /**< Time spent inside fork() */
+  PROFILE_EXEC,      /**< From fork() returning in Quash until the child has
+                      * exec'd (or exited, for builtins) */
+  PROFILE_WAIT,      /**< Time Quash is blocked waiting for foreground
+                      * processes */
+  NUM_PROFILE_PHASES
+} ProfilePhase;
+
+/**
+ * @brief Turn profiling on if the environment asks for it
+ *
+ * Must be called once before any other function in this file.
+ */
+void init_profile();
+
+/**
+ * @brief Print the profiling summary and close the trace file
+ */
+void destroy_profile();
+
+/**
+ * @brief Query if profiling is on
+ *
+ * @return True if Quash is recording profiling information
+ */
+bool is_profiling();
+
+/**
+ * @brief Read the clock used for all profiling measurements
+ *
+ * @return Monotonic time in nanoseconds or zero while profiling is off
+ */
+uint64_t profile_clock();
+
+/**
+ * @brief Charge the time since @a start to @a phase of the current command
+ *
+ * @param phase Phase to charge
+ *
+ * @param start Value of @a profile_clock() when the phase started
+ */
+void profile_record(ProfilePhase phase, uint64_t start);
+
+/**
+ * @brief Add the resource usage of a reaped process to the current command
+ *
+ * @param usage Resource usage filled in by wait4()
+ */
+void profile_rusage(const struct rusage* usage);
+
+/**
+ * @brief Add the resource usage of a reaped background process to the totals
+ *
+ * Background processes finish long after the command that started them, so
+ * they only show up in the summary.
+ *
+ * @param usage Resource usage filled in by wait4()
+ */
+void profile_background_rusage(const struct rusage* usage);
+
+/**
+ * @brief Mark the start of executing the current command
+ */
+void profile_begin_command();
+
+/**
+ * @brief Finish the current command, writing its trace line and adding it to
+ * the totals
+ *
+ * @param cmd String representation of the command
+ */
+void profile_end_command(const char* cmd);
+
+#endif
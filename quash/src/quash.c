@@ -17,8 +17,10 @@
 
 #include "command.h"
 #include "execute.h"
+#include "jobs.h"
 #include "parsing_interface.h"
 #include "memory_pool.h"
+#include "profile.h"
 
 /**************************************************************************
  * Private Variables
@@ -109,6 +111,7 @@ void end_main_loop() {
  */
 int main(int argc, char** argv) {
   state = initial_state();
+  init_profile();
 
   if (is_tty()) {
     puts("Welcome to Quash!");
@@ -119,6 +122,8 @@ int main(int argc, char** argv) {
 
   atexit(destroy_parser);
   atexit(destroy_memory_pool);
+  atexit(destroy_job_table);
+  atexit(destroy_profile);
 
   // Main execution loop
   while (is_running()) {
@@ -126,10 +131,17 @@ int main(int argc, char** argv) {
       print_prompt();
 
     initialize_memory_pool(1024);
+
+    uint64_t parse_start = profile_clock();
     CommandHolder* script = parse(&state);
 
-    if (script != NULL)
+    profile_record(PROFILE_PARSE, parse_start);
+
+    if (script != NULL) {
+      profile_begin_command();
       run_script(script);
+      profile_end_command(state.parsed_str);
+    }
 
     destroy_memory_pool();
   }
@@ -1,13 +1,47 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
 #define BSIZE 256
 #define NSTRS 3
 #define SOCKET_ADDRESS "mysock"
 
+/* Load generator defaults */
+#define LOAD_CONNS      64
+#define LOAD_THREADS     1
+#define LOAD_DEPTH       8
+#define LOAD_SIZE       64
+#define LOAD_SECONDS     5
+#define RECV_BSIZE   65536
+#define MAX_EVENTS     256
+#define MAX_IOV       1024
+#define FRAME_HDR        4  /* Big endian payload length with -f */
+
+/*
+ * Round trip times are kept in a log-linear histogram: exact below
+ * HIST_SUB nanoseconds, then HIST_SUB buckets for every power of two,
+ * so each percentile is within 12.5% of the real value.
+ */
+#define HIST_SUB_BITS    3
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS    ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
 /*
  * This is the set of strings we will send through the socket for
  * conversion
@@ -18,13 +52,103 @@ char *strs[NSTRS] = {
   "this is the third string from the client\n"
 };
 
-int main(int argc, char *argv[])
+/*
+ * One connection of the load generator. Requests go out back to back
+ * and the server answers each with the same number of bytes, so the
+ * byte counts alone say which request a reply belongs to. A request
+ * is unit bytes: the message, with a length header in front of it in
+ * framed mode.
+ */
+typedef struct {
+  int                 fd;
+  int                 events;    /* What epoll is watching for */
+  unsigned long long  sent;      /* Bytes written */
+  unsigned long long  received;  /* Bytes read back */
+  unsigned long long *start;     /* Send time of each request in flight,
+                                    indexed by request number % depth */
+} load_conn;
+
+/*
+ * Work and results of one load generator thread
+ */
+typedef struct {
+  pthread_t           thread;
+  load_conn          *conns;
+  int                 num_conns;
+  unsigned long long  requests;
+  unsigned long long  errors;
+  unsigned long long  max_ns;
+  unsigned long long  hist[HIST_BUCKETS];
+} load_thread;
+
+int port = 0;
+int depth = LOAD_DEPTH;
+size_t msg_size = LOAD_SIZE;
+size_t unit;
+int framed = 0;
+unsigned long long deadline;
+char *request;   /* One request, as it goes on the wire */
+char *reply;     /* What the server should send back for one request */
+
+unsigned long long now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int hist_bucket(unsigned long long v)
 {
-  int sockfd, ret, i;
+  int e;
+
+  if (v < HIST_SUB)
+    return v;
+
+  e = 63 - __builtin_clzll(v);
+  return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+         ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/*
+ * Smallest value that lands in bucket b
+ */
+unsigned long long hist_value(int b)
+{
+  int e;
+
+  if (b < HIST_SUB)
+    return b;
+
+  e = b / HIST_SUB + HIST_SUB_BITS - 1;
+  return (unsigned long long) (HIST_SUB + b % HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+/*
+ * Connect a session socket to the server on SOCKET_ADDRESS, or on the
+ * TCP loopback port if one is given
+ */
+int connect_server()
+{
+  int sockfd, ret, one = 1;
   struct sockaddr_un saun;
-  char buf[BSIZE];
+  struct sockaddr_in sin;
 
-//#if 0
+  if (port > 0) {
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    sockfd = socket(PF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+      perror("Error Opening Socket");
+      return -1;
+    }
+
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    ret = connect(sockfd, (struct sockaddr*)&sin, sizeof(sin));
+  } else {
   /* Add Code: Populate the sockaddr_un struct */
   saun.sun_family = AF_UNIX;
   strcpy(saun.sun_path, SOCKET_ADDRESS);
@@ -34,16 +158,35 @@ int main(int argc, char *argv[])
   sockfd = socket(PF_UNIX, SOCK_STREAM,0);
   if (sockfd < 0) {
     perror("Error Opening Socket");
-    return EXIT_FAILURE;
+    return -1;
   }
 
   /* Add Code: Connect the session socket to the server */
   ret = connect(sockfd, (struct sockaddr*)&saun, sizeof(saun));
+  }
   if (ret < 0) {
     perror("Error Connecting Sockets");
-    return EXIT_FAILURE;
+    close(sockfd);
+    return -1;
   }
 
+  return sockfd;
+}
+
+/*
+ * Send each of strs to the server and print what comes back
+ */
+int send_strings()
+{
+  int sockfd, i;
+  size_t len, got;
+  ssize_t n;
+  char buf[BSIZE];
+
+  sockfd = connect_server();
+  if (sockfd < 0)
+    return EXIT_FAILURE;
+
   /* Add Code: Send the strs array, one string at a time, to the
    * server. Read the converted string and print it out before sending
    * the next string
@@ -51,10 +194,323 @@ int main(int argc, char *argv[])
   for (i = 0; i < NSTRS; i++) {
     printf("SENDING:\n%s", strs[i]);
 
-    write(sockfd, strs[i], BSIZE);
-    read(sockfd, buf, BSIZE);
-    printf("RECEIVED:\n%s\n", buf);
+    len = strlen(strs[i]);
+    write(sockfd, strs[i], len);
+
+    /* The reply can come back in more than one piece */
+    for (got = 0; got < len; got += n) {
+      n = read(sockfd, buf + got, len - got);
+      if (n <= 0) {
+        perror("Error Reading Socket");
+        return EXIT_FAILURE;
+      }
+    }
+    printf("RECEIVED:\n%.*s\n", (int) len, buf);
   }
 
   close(sockfd);
+  return EXIT_SUCCESS;
+}
+
+static void watch_conn(int epfd, load_conn *c, int events)
+{
+  struct epoll_event ev;
+
+  if (c->events == events)
+    return;
+
+  ev.events = events;
+  ev.data.ptr = c;
+  epoll_ctl(epfd, c->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, &ev);
+  c->events = events;
+}
+
+/*
+ * Keep depth requests in flight, writing as many of them as there is
+ * room for in one writev() that points at the same request over and
+ * over
+ */
+static int send_requests(int epfd, load_conn *c)
+{
+  struct iovec iov[MAX_IOV];
+  unsigned long long limit, first, req;
+  size_t off, len;
+  ssize_t n;
+  int cnt;
+
+  limit = (c->received / unit + depth) * unit;
+  while (c->sent < limit) {
+    off = c->sent % unit;
+    len = limit - c->sent;
+
+    for (cnt = 0; cnt < MAX_IOV && len > 0; cnt++) {
+      iov[cnt].iov_base = request + off;
+      iov[cnt].iov_len = unit - off < len ? unit - off : len;
+      len -= iov[cnt].iov_len;
+      off = 0;
+    }
+
+    n = writev(c->fd, iov, cnt);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+        break;
+      return -1;
+    }
+
+    /* Start the clock on each request whose first byte just went out */
+    first = (c->sent + unit - 1) / unit;
+    c->sent += n;
+    for (req = first; req * unit < c->sent; req++)
+      c->start[req % depth] = now_ns();
+  }
+
+  watch_conn(epfd, c, EPOLLIN | (c->sent < limit ? EPOLLOUT : 0));
+  return 0;
+}
+
+/*
+ * Read replies, check them and time every request that is now
+ * complete
+ */
+static int receive_replies(int epfd, load_thread *t, load_conn *c,
+                           char *buf)
+{
+  unsigned long long done, rtt, end;
+  size_t off, chunk, i;
+  ssize_t n;
+
+  n = read(c->fd, buf, RECV_BSIZE);
+  if (n < 0)
+    return errno == EINTR || errno == EAGAIN ? 0 : -1;
+  if (n == 0)
+    return -1;
+
+  for (i = 0; i < (size_t) n; i += chunk) {
+    off = (c->received + i) % unit;
+    chunk = unit - off < n - i ? unit - off : n - i;
+    if (memcmp(buf + i, reply + off, chunk) != 0)
+      t->errors++;
+  }
+
+  done = c->received / unit;
+  c->received += n;
+  end = now_ns();
+  for (; done < c->received / unit; done++) {
+    rtt = end - c->start[done % depth];
+    t->hist[hist_bucket(rtt)]++;
+    if (rtt > t->max_ns)
+      t->max_ns = rtt;
+    t->requests++;
+  }
+
+  return send_requests(epfd, c);
+}
+
+static void *load_thread_main(void *arg)
+{
+  load_thread *t = arg;
+  struct epoll_event events[MAX_EVENTS];
+  char *buf;
+  load_conn *c;
+  long long left;
+  int epfd, i, n;
+
+  buf = malloc(RECV_BSIZE);
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (buf == NULL || epfd < 0) {
+    perror("Error Starting Load Thread");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < t->num_conns; i++)
+    send_requests(epfd, &t->conns[i]);
+
+  while ((left = (long long) (deadline - now_ns())) > 0) {
+    n = epoll_wait(epfd, events, MAX_EVENTS, left / 1000000 + 1);
+    if (n < 0 && errno != EINTR) {
+      perror("Error Waiting on epoll");
+      exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < n; i++) {
+      c = events[i].data.ptr;
+      if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) &&
+           receive_replies(epfd, t, c, buf) < 0) ||
+          (events[i].events & EPOLLOUT && send_requests(epfd, c) < 0)) {
+        fprintf(stderr, "Lost a connection to the server\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  close(epfd);
+  free(buf);
+  return NULL;
+}
+
+/*
+ * Open num_conns connections spread over num_threads threads, keep
+ * depth requests of msg_size bytes in flight on each one for seconds,
+ * then report the request rate and round trip latency
+ */
+int run_load(int num_conns, int num_threads, int seconds)
+{
+  load_thread *threads;
+  load_conn *conns;
+  unsigned long long *hist, requests = 0, errors = 0, max_ns = 0;
+  unsigned long long count, seen, start, elapsed;
+  static const double pcts[] = { 50, 90, 99, 99.9 };
+  struct rlimit rl;
+  size_t i;
+  int t, b, p, fd;
+
+  /* One descriptor per connection, plus a few to spare */
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  unit = msg_size + (framed ? FRAME_HDR : 0);
+  request = malloc(unit);
+  reply = malloc(unit);
+  threads = calloc(num_threads, sizeof(load_thread));
+  conns = calloc(num_conns, sizeof(load_conn));
+  hist = calloc(HIST_BUCKETS, sizeof(unsigned long long));
+  if (!request || !reply || !threads || !conns || !hist) {
+    perror("Error Allocating Load");
+    return EXIT_FAILURE;
+  }
+
+  /*
+   * Lines of lower case letters, which the server upper cases. The
+   * header is the same in the reply as in the request.
+   */
+  if (framed) {
+    for (i = 0; i < FRAME_HDR; i++)
+      request[i] = reply[i] = msg_size >> (8 * (FRAME_HDR - 1 - i));
+  }
+  for (i = unit - msg_size; i < unit; i++) {
+    reply[i] = i == unit - 1 ? '\n' : 'A' + i % 26;
+    request[i] = reply[i] == '\n' ? '\n' : reply[i] + 32;
+  }
+
+  for (i = 0; i < (size_t) num_conns; i++) {
+    fd = connect_server();
+    if (fd < 0)
+      return EXIT_FAILURE;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    conns[i].fd = fd;
+    conns[i].start = calloc(depth, sizeof(unsigned long long));
+    if (conns[i].start == NULL) {
+      perror("Error Allocating Load");
+      return EXIT_FAILURE;
+    }
+  }
+
+  /* Hand each thread a contiguous block of the connections */
+  for (t = 0; t < num_threads; t++) {
+    threads[t].conns = conns + (size_t) num_conns * t / num_threads;
+    threads[t].num_conns = (size_t) num_conns * (t + 1) / num_threads -
+                           (size_t) num_conns * t / num_threads;
+  }
+
+  start = now_ns();
+  deadline = start + seconds * 1000000000ULL;
+  for (t = 0; t < num_threads; t++)
+    pthread_create(&threads[t].thread, NULL, load_thread_main, &threads[t]);
+  for (t = 0; t < num_threads; t++) {
+    pthread_join(threads[t].thread, NULL);
+    requests += threads[t].requests;
+    errors += threads[t].errors;
+    if (threads[t].max_ns > max_ns)
+      max_ns = threads[t].max_ns;
+    for (b = 0; b < HIST_BUCKETS; b++)
+      hist[b] += threads[t].hist[b];
+  }
+  elapsed = now_ns() - start;
+
+  printf("Load:        %d connections, %d threads, depth %d, "
+         "%zu byte %s, %.3f s\n", num_conns, num_threads, depth,
+         msg_size, framed ? "frames" : "messages", elapsed / 1e9);
+  printf("Requests:    %llu (%.0f requests/s, %.1f MB/s each way)\n",
+         requests, requests / (elapsed / 1e9),
+         requests * msg_size / (elapsed / 1e9) / 1e6);
+
+  printf("RTT (us):   ");
+  count = requests;
+  for (p = 0; p < (int) (sizeof(pcts) / sizeof(pcts[0])); p++) {
+    seen = 0;
+    for (b = 0; b < HIST_BUCKETS - 1; b++) {
+      seen += hist[b];
+      if (seen >= count * pcts[p] / 100)
+        break;
+    }
+    printf(" p%g %.1f ", pcts[p], hist_value(b) / 1e3);
+  }
+  printf(" max %.1f\n", max_ns / 1e3);
+
+  if (errors) {
+    printf("Errors:      %llu replies did not match\n", errors);
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < (size_t) num_conns; i++) {
+    close(conns[i].fd);
+    free(conns[i].start);
+  }
+  free(conns);
+  free(threads);
+  free(hist);
+  free(request);
+  free(reply);
+  return EXIT_SUCCESS;
+}
+
+void usage(char *prog)
+{
+  fprintf(stderr, "Usage: %s [-t PORT] [-l [-c CONNS] [-j THREADS] "
+          "[-d DEPTH] [-s SIZE] [-D SECONDS] [-f]]\n", prog);
+  fprintf(stderr, "  -t  connect to a TCP loopback port instead of %s\n",
+          SOCKET_ADDRESS);
+  fprintf(stderr, "  -l  generate load instead of sending the strings\n");
+  fprintf(stderr, "  -f  send each message as a frame: a 4 byte big "
+          "endian length then the\n      message (for server -f)\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+  int opt, load = 0;
+  int num_conns = LOAD_CONNS, num_threads = LOAD_THREADS;
+  int seconds = LOAD_SECONDS;
+
+  while ((opt = getopt(argc, argv, "t:lc:j:d:s:D:f")) != -1) {
+    switch (opt) {
+    case 't': port = atoi(optarg); break;
+    case 'l': load = 1; break;
+    case 'c': num_conns = atoi(optarg); break;
+    case 'j': num_threads = atoi(optarg); break;
+    case 'd': depth = atoi(optarg); break;
+    case 's': msg_size = atol(optarg); break;
+    case 'D': seconds = atoi(optarg); break;
+    case 'f': framed = 1; break;
+    default: usage(argv[0]);
+    }
+  }
+
+  if (port < 0 || port > 65535 || num_conns < 1 || num_threads < 1 ||
+      depth < 1 || msg_size < 1 || msg_size > UINT32_MAX || seconds < 1 ||
+      (framed && !load))
+    usage(argv[0]);
+
+  if (!load)
+    return send_strings();
+
+  if (num_threads > num_conns)
+    num_threads = num_conns;
+  return run_load(num_conns, num_threads, seconds);
 }
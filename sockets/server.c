@@ -1,13 +1,90 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "uring.h"
 
 #define QSIZE 5
 #define BSIZE 256
 #define SOCKET_ADDRESS "mysock"
+#define CONN_BSIZE 65536  /* Per connection ring in epoll mode, a power
+                             of 2 */
+#define FRAME_HDR 4       /* Big endian payload length in framed mode */
+#define MAX_EVENTS 256
+#define MAX_WORKERS 256
+#define CACHE_LINE 64
+#define URING_ENTRIES 4096
+#define URING_BUFS 1024      /* Provided buffers per worker in io_uring
+                                mode, a power of 2 */
+#define URING_BSIZE 16384
+
+/*
+ * Where a connection's stream is in its frames in framed mode
+ */
+typedef struct {
+  uint32_t frame_left; /* Payload bytes left in the frame */
+  uint32_t hdr;        /* Header bytes seen so far */
+  int      hdr_len;    /* How many header bytes */
+} framing;
+
+/*
+ * State kept for each client in epoll mode. The buffer is a ring of
+ * bytes that were read and converted but not yet written back, so the
+ * server can keep reading while earlier replies are still going out.
+ * head and tail count bytes and are only wrapped when indexing buf.
+ */
+typedef struct {
+  int      fd;
+  int      events;     /* What epoll is watching for */
+  int      eof;        /* The client has finished sending */
+  size_t   head;       /* Next byte to write back */
+  size_t   tail;       /* Next byte to read into */
+  framing  fr;
+  char     buf[CONN_BSIZE];
+} connection;
+
+/*
+ * One thread of the epoll server, with its own epoll loop and its own
+ * connections. The counters are only changed by the worker, but main()
+ * reads them whenever it is asked for a report.
+ */
+typedef struct {
+  pthread_t          thread;
+  int                id;
+  int                epfd;
+  int                listenfd;   /* Own SO_REUSEPORT listener for TCP,
+                                    shared for AF_UNIX */
+  int                port;
+  unsigned long      accepted;
+  unsigned long      open;
+  unsigned long      max_open;
+  unsigned long long bytes;
+  unsigned long long syscalls;
+} __attribute__((aligned(CACHE_LINE))) worker;
+
+static int framed = 0;
+static int use_uring = 0;
+static int stopfd = -1;  /* Readable once the workers should stop */
 
 /*
  * Convert a null-terminated sting (one whose end is denoted by a byte
@@ -26,22 +103,126 @@ convert_string (char *cp)
   }
 }
 
-int main(int argc, char *argv[])
+/*
+ * Convert len bytes to upper case. Bytes from a socket are not null
+ * terminated, and a read can end in the middle of a line.
+ *
+ * Only ASCII letters change, which is what toupper does in the C
+ * locale the server runs in. That lets whole vectors of bytes be
+ * converted at once: a byte between 'a' and 'z' has 0x20 cleared.
+ * Bytes of 0x80 and up are negative as signed chars, so they never
+ * fall in the range.
+ */
+static void
+convert_bytes_scalar (char *cp, size_t len)
 {
-  int handshake_sockfd, session_sockfd, ret;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    cp[i] = (char) toupper ((unsigned char) cp[i]);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) static void
+convert_bytes_sse2 (char *cp, size_t len)
+{
+  const __m128i before_a = _mm_set1_epi8('a' - 1);
+  const __m128i after_z = _mm_set1_epi8('z' + 1);
+  const __m128i bit = _mm_set1_epi8(0x20);
+  __m128i v, lower;
+  size_t i;
+
+  for (i = 0; i + 16 <= len; i += 16) {
+    v = _mm_loadu_si128((__m128i *) (cp + i));
+    lower = _mm_and_si128(_mm_cmpgt_epi8(v, before_a),
+                          _mm_cmplt_epi8(v, after_z));
+    v = _mm_xor_si128(v, _mm_and_si128(lower, bit));
+    _mm_storeu_si128((__m128i *) (cp + i), v);
+  }
+  convert_bytes_scalar(cp + i, len - i);
+}
+
+__attribute__((target("avx2"))) static void
+convert_bytes_avx2 (char *cp, size_t len)
+{
+  const __m256i before_a = _mm256_set1_epi8('a' - 1);
+  const __m256i after_z = _mm256_set1_epi8('z' + 1);
+  const __m256i bit = _mm256_set1_epi8(0x20);
+  __m256i v, lower;
+  size_t i;
+
+  for (i = 0; i + 32 <= len; i += 32) {
+    v = _mm256_loadu_si256((__m256i *) (cp + i));
+    lower = _mm256_and_si256(_mm256_cmpgt_epi8(v, before_a),
+                             _mm256_cmpgt_epi8(after_z, v));
+    v = _mm256_xor_si256(v, _mm256_and_si256(lower, bit));
+    _mm256_storeu_si256((__m256i *) (cp + i), v);
+  }
+  convert_bytes_sse2(cp + i, len - i);
+}
+#endif
+
+void
+convert_bytes (char *cp, size_t len)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  static int have_avx2 = -1;
+
+  if (have_avx2 < 0)
+    have_avx2 = __builtin_cpu_supports("avx2");
+  if (have_avx2)
+    convert_bytes_avx2(cp, len);
+  else if (__builtin_cpu_supports("sse2"))
+    convert_bytes_sse2(cp, len);
+  else
+#endif
+    convert_bytes_scalar(cp, len);
+}
+
+/*
+ * Create a listening socket on SOCKET_ADDRESS, or on the TCP loopback
+ * port if one is given
+ */
+int
+make_listener (int port, int backlog, int flags, int reuseport)
+{
+  int handshake_sockfd, ret, one = 1;
   struct sockaddr_un saun;
-  char buf[BSIZE];
+  struct sockaddr_in sin;
 
+  if (port > 0) {
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
+    handshake_sockfd = socket(PF_INET, SOCK_STREAM | flags, 0);
+    if (handshake_sockfd < 0) {
+      perror("Error Opening Socket");
+      return -1;
+    }
+
+    setsockopt(handshake_sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    /* Every worker binds its own socket and the kernel shares out
+     * the connections between them */
+    if (reuseport &&
+        setsockopt(handshake_sockfd, SOL_SOCKET, SO_REUSEPORT, &one,
+                   sizeof(one)) < 0) {
+      perror("Error Setting SO_REUSEPORT");
+      close(handshake_sockfd);
+      return -1;
+    }
+    ret = bind(handshake_sockfd, (struct sockaddr*)&sin, sizeof(sin));
+  } else {
   /* Add Code: Populate the sockaddr_un struct */
    saun.sun_family = AF_UNIX;
     strcpy(saun.sun_path, SOCKET_ADDRESS);
 
   /* Add Code: Create the handshake socket */
-   handshake_sockfd = socket(PF_UNIX, SOCK_STREAM, 0);
+   handshake_sockfd = socket(PF_UNIX, SOCK_STREAM | flags, 0);
   if (handshake_sockfd < 0) {
     perror("Error Opening Socket");
-    return EXIT_FAILURE;
+    return -1;
   }
 
 
@@ -52,20 +233,35 @@ int main(int argc, char *argv[])
   unlink(SOCKET_ADDRESS);
    ret = bind(handshake_sockfd, (struct sockaddr*)&saun, sizeof(saun));
   /* Add Code: Bind the handshake socket to the sockaddr. */
+  }
   if (ret < 0) {
     perror("Error Binding Socket");
-    return EXIT_FAILURE;
+    return -1;
   }
 
   /* Add Code: Make the handshake socket a listening socket, with a
    * specified Queue Size
    */
-    ret = listen(handshake_sockfd, 1);
+    ret = listen(handshake_sockfd, backlog);
   if (ret < 0) {
     perror("Error Listening on Socket");
-    return EXIT_FAILURE;
+    return -1;
   }
 
+  return handshake_sockfd;
+}
+
+/*
+ * The original lab server: serve a single client, printing everything
+ * that goes by
+ */
+int
+serve_one (int handshake_sockfd)
+{
+  int session_sockfd;
+  char buf[BSIZE];
+  ssize_t read_return;
+
   /* Add Code: Accept a connection on the handshake socket,
    * giving the session socket as the return value.
    */
@@ -80,20 +276,872 @@ int main(int argc, char *argv[])
    * write the line back to the client. Continue until there are no
    * more lines to read.
    */
-    size_t read_return = 1;
-  while (read_return>0) {
-    read_return = read(session_sockfd, buf, BSIZE);
-    if (read_return == 0)
-    {
+  while ((read_return = read(session_sockfd, buf, BSIZE)) > 0) {
+    printf("RECEIVED:\n%.*s", (int) read_return, buf);
+    convert_bytes(buf, read_return);
+    write(session_sockfd, buf, read_return);
+    printf("SENDING:\n%.*s\n", (int) read_return, buf);
+  }
+
+  close(session_sockfd);
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Count system calls made by a worker, to compare the epoll and
+ * io_uring loops by
+ */
+static void
+count_syscalls (worker *w, int n)
+{
+  __atomic_store_n(&w->syscalls, w->syscalls + n, __ATOMIC_RELAXED);
+}
+
+static void
+close_connection (worker *w, connection *conn)
+{
+  epoll_ctl(w->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  count_syscalls(w, 2);
+  free(conn);
+}
+
+/*
+ * Watch for more data while there is room in the ring, and for room
+ * to write while there are replies waiting in it
+ */
+static int
+watch_connection (worker *w, connection *conn)
+{
+  struct epoll_event ev;
+  size_t used = conn->tail - conn->head;
+  int op = conn->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+  ev.events = (!conn->eof && used < CONN_BSIZE ? EPOLLIN : 0) |
+              (used > 0 ? EPOLLOUT : 0);
+  if (ev.events == conn->events)
+    return 0;
+
+  ev.data.ptr = conn;
+  conn->events = ev.events;
+  count_syscalls(w, 1);
+  return epoll_ctl(w->epfd, op, conn->fd, &ev);
+}
+
+/*
+ * Upper case the payloads in len new bytes from a client. In framed
+ * mode the length headers have to go back untouched, and frames can
+ * be split over any number of reads.
+ */
+static void
+convert_new_bytes (framing *fr, char *cp, size_t len)
+{
+  size_t n;
+
+  if (!framed) {
+    convert_bytes(cp, len);
+    return;
+  }
+
+  while (len > 0) {
+    if (fr->frame_left == 0) {
+      fr->hdr = fr->hdr << 8 | (unsigned char) *cp++;
+      len--;
+      if (++fr->hdr_len == FRAME_HDR) {
+        fr->frame_left = fr->hdr;
+        fr->hdr = 0;
+        fr->hdr_len = 0;
+      }
+      continue;
+    }
+
+    n = len < fr->frame_left ? len : fr->frame_left;
+    convert_bytes(cp, n);
+    fr->frame_left -= n;
+    cp += n;
+    len -= n;
+  }
+}
+
+/*
+ * Split len bytes of the ring starting at byte pos into at most two
+ * pieces that do not wrap
+ */
+static int
+ring_iov (connection *conn, size_t pos, size_t len, struct iovec *iov)
+{
+  size_t off = pos & (CONN_BSIZE - 1);
+  size_t first = len < CONN_BSIZE - off ? len : CONN_BSIZE - off;
+
+  iov[0].iov_base = conn->buf + off;
+  iov[0].iov_len = first;
+  iov[1].iov_base = conn->buf;
+  iov[1].iov_len = len - first;
+  return len - first > 0 ? 2 : 1;
+}
+
+/*
+ * Read as much as the ring has room for in one readv() and convert
+ * it. Returns -1 if the connection should be closed.
+ */
+static int
+read_connection (worker *w, connection *conn)
+{
+  struct iovec iov[2];
+  size_t room = CONN_BSIZE - (conn->tail - conn->head);
+  ssize_t n;
+  int cnt, i;
+
+  cnt = ring_iov(conn, conn->tail, room, iov);
+  do {
+    n = readv(conn->fd, iov, cnt);
+    count_syscalls(w, 1);
+  } while (n < 0 && errno == EINTR);
+
+  if (n < 0)
+    return errno == EAGAIN ? 0 : -1;
+  if (n == 0) {
+    conn->eof = 1;
+    return 0;
+  }
+
+  cnt = ring_iov(conn, conn->tail, n, iov);
+  for (i = 0; i < cnt; i++)
+    convert_new_bytes(&conn->fr, iov[i].iov_base, iov[i].iov_len);
+  conn->tail += n;
+  return 0;
+}
+
+/*
+ * Write back everything converted so far, however many replies that
+ * is, in one writev(). Returns -1 if the connection should be closed.
+ */
+static int
+flush_connection (worker *w, connection *conn)
+{
+  struct iovec iov[2];
+  ssize_t n;
+  int cnt;
+
+  if (conn->head == conn->tail)
+    return 0;
+
+  cnt = ring_iov(conn, conn->head, conn->tail - conn->head, iov);
+  do {
+    n = writev(conn->fd, iov, cnt);
+    count_syscalls(w, 1);
+  } while (n < 0 && errno == EINTR);
+
+  if (n < 0)
+    return errno == EAGAIN ? 0 : -1;
+
+  conn->head += n;
+  __atomic_store_n(&w->bytes, w->bytes + n, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/*
+ * Move data through a connection that epoll says is ready. Returns
+ * -1 once the connection is finished with.
+ */
+static int
+serve_connection (worker *w, connection *conn, int events)
+{
+  if (events & (EPOLLIN | EPOLLHUP | EPOLLERR) &&
+      conn->tail - conn->head < CONN_BSIZE && !conn->eof &&
+      read_connection(w, conn) < 0)
+    return -1;
+
+  if (flush_connection(w, conn) < 0)
+    return -1;
+
+  /* Finish sending the replies before hanging up */
+  if (conn->eof && conn->head == conn->tail)
+    return -1;
+
+  return watch_connection(w, conn);
+}
+
+/*
+ * Accept every pending connection. Running out of descriptors is not
+ * fatal, the clients just wait in the backlog until some close.
+ */
+static void
+accept_connections (worker *w)
+{
+  int fd, one = 1;
+  connection *conn;
+
+  for (;;) {
+    fd = accept4(w->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    count_syscalls(w, 1);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN)
+        perror("Error Accepting Socket");
+      return;
+    }
+
+    if (w->port > 0) {
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      count_syscalls(w, 1);
+    }
+
+    conn = malloc(sizeof(connection));
+    if (conn == NULL) {
+      close(fd);
+      continue;
+    }
+    conn->fd = fd;
+    conn->events = 0;
+    conn->eof = 0;
+    conn->head = conn->tail = 0;
+    memset(&conn->fr, 0, sizeof(framing));
+
+    if (watch_connection(w, conn) < 0) {
+      perror("Error Watching Socket");
+      close(fd);
+      free(conn);
+      continue;
+    }
+
+    __atomic_store_n(&w->accepted, w->accepted + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->open, w->open + 1, __ATOMIC_RELAXED);
+    if (w->open > w->max_open)
+      __atomic_store_n(&w->max_open, w->open, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+ * Serve clients of one worker with nonblocking sockets and epoll
+ * until main() says to stop. Events carry the connection they are
+ * for, the listener and the stop eventfd carry their own descriptor.
+ */
+static void *
+serve_epoll (void *arg)
+{
+  worker *w = arg;
+  int i, n;
+  struct epoll_event ev, events[MAX_EVENTS];
+  connection *conn;
+
+  /*
+   * A shared AF_UNIX listener wakes only one of the workers waiting on
+   * it for each new connection, not all of them.
+   */
+  ev.events = EPOLLIN | (w->port > 0 ? 0 : EPOLLEXCLUSIVE);
+  ev.data.ptr = &w->listenfd;
+  if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->listenfd, &ev) < 0) {
+    perror("Error Watching Socket");
+    exit(EXIT_FAILURE);
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = &stopfd;
+  if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, stopfd, &ev) < 0) {
+    perror("Error Watching Socket");
+    exit(EXIT_FAILURE);
+  }
+
+  for (;;) {
+    n = epoll_wait(w->epfd, events, MAX_EVENTS, -1);
+    count_syscalls(w, 1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("Error Waiting on epoll");
+      exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < n; i++) {
+      if (events[i].data.ptr == &stopfd)
+        return NULL;
+      if (events[i].data.ptr == &w->listenfd) {
+        accept_connections(w);
+        continue;
+      }
+
+      conn = events[i].data.ptr;
+      if (serve_connection(w, conn, events[i].events) < 0) {
+        close_connection(w, conn);
+        __atomic_store_n(&w->open, w->open - 1, __ATOMIC_RELAXED);
+      }
+    }
+  }
+}
+
+/*
+ * State kept for each client in io_uring mode. Data is received
+ * straight into buffers the kernel picks from the worker's pool, and
+ * those buffers queue up on the connection until they have been
+ * written back. Only one write is in flight at a time so replies can
+ * not overtake each other.
+ */
+typedef struct uring_conn {
+  int                fd;
+  int                receiving;  /* A receive is armed */
+  int                sending;    /* A write is in flight */
+  int                starved;    /* Waiting for a free buffer */
+  int                eof;        /* The client has finished sending */
+  int                dead;       /* Something failed, drop the replies */
+  int                shut;       /* shutdown() was called to end receiving */
+  int                head;       /* First and last buffer waiting to be */
+  int                tail;       /*   written back, -1 when none are */
+  framing            fr;
+  struct uring_conn *next_starved;
+} uring_conn;
+
+/* What a completion is for, in the low bits of its user_data */
+enum { OP_ACCEPT, OP_RECV, OP_SEND, OP_STOP };
+#define OP_MASK 7
+
+typedef struct {
+  uring       ring;
+  uring_bufs  bufs;
+  char       *pool;                 /* URING_BUFS buffers of URING_BSIZE */
+  int         fixed;                /* pool is registered for WRITE_FIXED */
+  int         multishot;            /* One accept or receive keeps going */
+  int         accepting;            /* An accept is armed */
+  int         nfree;                /* Buffers the kernel can fill */
+  int         next[URING_BUFS];     /* Queues of buffers to write back */
+  unsigned    off[URING_BUFS];      /* Next byte of a buffer to write */
+  unsigned    len[URING_BUFS];      /* Bytes of it left to write */
+  uring_conn *starved;              /* Connections waiting for a buffer */
+} uring_state;
+
+static struct io_uring_sqe *
+queue_op (uring_state *u, int op, uring_conn *conn)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+
+  if (sqe == NULL) {
+    perror("Error Submitting to io_uring");
+    exit(EXIT_FAILURE);
+  }
+  sqe->user_data = (uintptr_t) conn | op;
+  return sqe;
+}
+
+static void
+arm_accept (worker *w, uring_state *u)
+{
+  struct io_uring_sqe *sqe = queue_op(u, OP_ACCEPT, NULL);
+
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = w->listenfd;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->ioprio = u->multishot ? IORING_ACCEPT_MULTISHOT : 0;
+  u->accepting = 1;
+}
+
+static void
+arm_recv (uring_state *u, uring_conn *conn)
+{
+  struct io_uring_sqe *sqe = queue_op(u, OP_RECV, conn);
+
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->ioprio = u->multishot ? IORING_RECV_MULTISHOT : 0;
+  conn->receiving = 1;
+}
+
+/*
+ * Write back the first waiting buffer, unless a write is already out
+ */
+static void
+start_send (uring_state *u, uring_conn *conn)
+{
+  struct io_uring_sqe *sqe;
+  int b = conn->head;
+
+  if (conn->sending || b < 0)
+    return;
+
+  sqe = queue_op(u, OP_SEND, conn);
+  sqe->opcode = u->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_SEND;
+  sqe->fd = conn->fd;
+  sqe->addr = (uintptr_t) (u->pool + (size_t) b * URING_BSIZE + u->off[b]);
+  sqe->len = u->len[b];
+  sqe->buf_index = 0;
+  conn->sending = 1;
+}
+
+static void
+recycle_buffer (uring_state *u, int b)
+{
+  uring_bufs_add(&u->bufs, u->pool + (size_t) b * URING_BSIZE, URING_BSIZE, b);
+  u->nfree++;
+}
+
+/*
+ * Close a connection once nothing is in flight for it any more and
+ * there is nothing left to send back
+ */
+static void
+finish_connection (worker *w, uring_state *u, uring_conn *conn)
+{
+  int b;
+
+  if (conn->dead && !conn->sending) {
+    while ((b = conn->head) >= 0) {
+      conn->head = u->next[b];
+      recycle_buffer(u, b);
+    }
+    conn->tail = -1;
+  }
+  /* Make the armed receive give up */
+  if (conn->dead && conn->receiving && !conn->shut) {
+    shutdown(conn->fd, SHUT_RDWR);
+    count_syscalls(w, 1);
+    conn->shut = 1;
+  }
+
+  if (conn->receiving || conn->sending || conn->starved)
+    return;
+  if (!conn->dead && (!conn->eof || conn->head >= 0))
+    return;
+
+  close(conn->fd);
+  count_syscalls(w, 1);
+  free(conn);
+  __atomic_store_n(&w->open, w->open - 1, __ATOMIC_RELAXED);
+
+  /* Accepting stops when descriptors run out */
+  if (!u->accepting)
+    arm_accept(w, u);
+}
+
+static void
+accepted (worker *w, uring_state *u, int fd)
+{
+  uring_conn *conn;
+  int one = 1;
+
+  if (w->port > 0) {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    count_syscalls(w, 1);
+  }
+
+  conn = calloc(1, sizeof(uring_conn));
+  if (conn == NULL) {
+    close(fd);
+    count_syscalls(w, 1);
+    return;
+  }
+  conn->fd = fd;
+  conn->head = conn->tail = -1;
+  arm_recv(u, conn);
+
+  __atomic_store_n(&w->accepted, w->accepted + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&w->open, w->open + 1, __ATOMIC_RELAXED);
+  if (w->open > w->max_open)
+    __atomic_store_n(&w->max_open, w->open, __ATOMIC_RELAXED);
+}
+
+static void
+received (uring_state *u, uring_conn *conn, int res, unsigned flags)
+{
+  int b;
+
+  if (res > 0) {
+    b = flags >> IORING_CQE_BUFFER_SHIFT;
+    u->nfree--;
+    if (conn->dead) {
+      recycle_buffer(u, b);
+    } else {
+      convert_new_bytes(&conn->fr, u->pool + (size_t) b * URING_BSIZE, res);
+      u->off[b] = 0;
+      u->len[b] = res;
+      u->next[b] = -1;
+      if (conn->head < 0)
+        conn->head = b;
+      else
+        u->next[conn->tail] = b;
+      conn->tail = b;
+      start_send(u, conn);
+    }
+  }
+
+  if (flags & IORING_CQE_F_MORE)
+    return;
+
+  /* The receive is over, see whether to start another */
+  conn->receiving = 0;
+  if (res > 0 && !conn->dead) {
+    arm_recv(u, conn);
+  } else if (res == -ENOBUFS && !conn->dead) {
+    /* Every buffer is waiting to be written back, so wait with it */
+    conn->starved = 1;
+    conn->next_starved = u->starved;
+    u->starved = conn;
+  } else if (res == -EINVAL && u->multishot && !conn->dead) {
+    /* Too old a kernel for multishot, so one receive at a time */
+    u->multishot = 0;
+    arm_recv(u, conn);
+  } else if (res == 0) {
+    conn->eof = 1;
+  } else if (res < 0) {
+    conn->dead = 1;
+  }
+}
+
+static void
+sent (worker *w, uring_state *u, uring_conn *conn, int res)
+{
+  int b = conn->head;
+
+  conn->sending = 0;
+  if (res < 0 || conn->dead) {
+    conn->dead = 1;
+    return;
+  }
+
+  __atomic_store_n(&w->bytes, w->bytes + res, __ATOMIC_RELAXED);
+  u->off[b] += res;
+  u->len[b] -= res;
+  if (u->len[b] == 0) {
+    conn->head = u->next[b];
+    if (conn->head < 0)
+      conn->tail = -1;
+    recycle_buffer(u, b);
+  }
+  start_send(u, conn);
+}
+
+/*
+ * Serve clients of one worker with io_uring until main() says to
+ * stop. One accept and one receive per connection stay armed for as
+ * long as they keep producing, and everything queued while handling a
+ * batch of completions goes to the kernel in the same system call that
+ * waits for the next batch.
+ */
+static void *
+serve_uring (void *arg)
+{
+  worker *w = arg;
+  uring_state *u;
+  uring_conn *conn;
+  struct io_uring_cqe *cqe;
+  struct io_uring_sqe *sqe;
+  struct iovec iov;
+  uint64_t data;
+  unsigned flags;
+  int b, res;
+
+  u = calloc(1, sizeof(uring_state));
+  if (u == NULL ||
+      uring_init(&u->ring, URING_ENTRIES,
+                 IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN) < 0 ||
+      uring_bufs_init(&u->ring, &u->bufs, URING_BUFS, 0) < 0 ||
+      (u->pool = aligned_alloc(4096, (size_t) URING_BUFS * URING_BSIZE))
+        == NULL) {
+    perror("Error Setting Up io_uring");
+    exit(EXIT_FAILURE);
+  }
+
+  for (b = 0; b < URING_BUFS; b++)
+    recycle_buffer(u, b);
+  uring_bufs_publish(&u->bufs);
+
+  /* Replies go out of the same buffers, pinned once up front */
+  iov.iov_base = u->pool;
+  iov.iov_len = (size_t) URING_BUFS * URING_BSIZE;
+  u->fixed = uring_register_buffers(&u->ring, &iov, 1) == 0;
+  u->multishot = 1;
+
+  arm_accept(w, u);
+  /* Only wait for stopfd to be readable, every worker has to see it */
+  sqe = queue_op(u, OP_STOP, NULL);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = stopfd;
+  sqe->poll32_events = POLLIN;
+
+  for (;;) {
+    if (uring_submit(&u->ring, 1) < 0) {
+      perror("Error Waiting on io_uring");
+      exit(EXIT_FAILURE);
+    }
+    count_syscalls(w, 1);
+
+    while ((cqe = uring_peek_cqe(&u->ring)) != NULL) {
+      data = cqe->user_data;
+      res = cqe->res;
+      flags = cqe->flags;
+      uring_cqe_seen(&u->ring);
+      conn = (uring_conn *) (uintptr_t) (data & ~(uint64_t) OP_MASK);
+
+      switch (data & OP_MASK) {
+      case OP_STOP:
+        goto out;
+
+      case OP_ACCEPT:
+        if (res >= 0)
+          accepted(w, u, res);
+        if (flags & IORING_CQE_F_MORE)
+          break;
+        u->accepting = 0;
+        if (res == -EINVAL && u->multishot) {
+          /* Too old a kernel for multishot, so one at a time */
+          u->multishot = 0;
+        } else if (res == -EMFILE || res == -ENFILE || res == -ENOMEM) {
+          /* Clients wait in the backlog until some close */
+          if (w->open > 0)
+            break;
+        } else if (res < 0 && res != -EINTR && res != -ECONNABORTED) {
+          errno = -res;
+          perror("Error Accepting Socket");
+        }
+        arm_accept(w, u);
+        break;
+
+      case OP_RECV:
+        received(u, conn, res, flags);
+        finish_connection(w, u, conn);
+        break;
+
+      case OP_SEND:
+        sent(w, u, conn, res);
+        finish_connection(w, u, conn);
+        break;
+      }
+    }
+
+    /* Buffers written back can take new data */
+    uring_bufs_publish(&u->bufs);
+    while (u->starved != NULL && u->nfree > 0) {
+      conn = u->starved;
+      u->starved = conn->next_starved;
+      conn->starved = 0;
+      if (conn->dead)
+        finish_connection(w, u, conn);
+      else
+        arm_recv(u, conn);
+    }
+  }
+
+out:
+  uring_bufs_free(&u->ring, &u->bufs);
+  uring_exit(&u->ring);
+  free(u->pool);
+  free(u);
+  return NULL;
+}
+
+/*
+ * Whether the kernel can run the io_uring loop at all. It may be too
+ * old for provided buffer rings, or have io_uring turned off.
+ */
+static int
+uring_usable (void)
+{
+  uring r;
+  uring_bufs b;
+  int ok, err;
+
+  if (uring_init(&r, 8, 0) < 0)
+    return 0;
+  ok = uring_bufs_init(&r, &b, 8, 0) == 0;
+  err = errno;
+  if (ok)
+    uring_bufs_free(&r, &b);
+  uring_exit(&r);
+  errno = err;
+  return ok;
+}
+
+/*
+ * Print the counters of every worker, and their totals
+ */
+void
+print_workers (worker *workers, int num_workers)
+{
+  unsigned long accepted = 0, open = 0;
+  unsigned long long bytes = 0, syscalls = 0;
+  unsigned long a, o, m;
+  unsigned long long b, c;
+  int i;
+
+  for (i = 0; i < num_workers; i++) {
+    a = __atomic_load_n(&workers[i].accepted, __ATOMIC_RELAXED);
+    o = __atomic_load_n(&workers[i].open, __ATOMIC_RELAXED);
+    m = __atomic_load_n(&workers[i].max_open, __ATOMIC_RELAXED);
+    b = __atomic_load_n(&workers[i].bytes, __ATOMIC_RELAXED);
+    c = __atomic_load_n(&workers[i].syscalls, __ATOMIC_RELAXED);
+    if (num_workers > 1)
+      printf("Worker %3d: %lu connections (%lu open, %lu at once), "
+             "%llu bytes, %llu system calls\n", i, a, o, m, b, c);
+    accepted += a;
+    open += o;
+    bytes += b;
+    syscalls += c;
+  }
+
+  printf("Served %lu connections (%lu open), %llu bytes, %llu system "
+         "calls\n", accepted, open, bytes, syscalls);
+  fflush(stdout);
+}
+
+/*
+ * Run num_workers epoll or io_uring loops until interrupted. SIGUSR1
+ * prints the counters without stopping.
+ */
+int
+serve_workers (int port, int num_workers)
+{
+  worker *workers;
+  sigset_t sigs;
+  int i, sig, shared = -1;
+
+  /*
+   * Only main() takes the signals, so block them before the workers
+   * start and inherit the mask
+   */
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  sigaddset(&sigs, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+  stopfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  workers = aligned_alloc(CACHE_LINE, num_workers * sizeof(worker));
+  if (stopfd < 0 || workers == NULL) {
+    perror("Error Starting Workers");
+    return EXIT_FAILURE;
+  }
+  memset(workers, 0, num_workers * sizeof(worker));
+
+  /* AF_UNIX has no SO_REUSEPORT, so all the workers share a listener */
+  if (port == 0) {
+    shared = make_listener(0, SOMAXCONN, SOCK_NONBLOCK, 0);
+    if (shared < 0)
+      return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < num_workers; i++) {
+    workers[i].id = i;
+    workers[i].port = port;
+    workers[i].listenfd = port > 0 ? make_listener(port, SOMAXCONN,
+                                                   SOCK_NONBLOCK, 1)
+                                   : shared;
+    workers[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (workers[i].listenfd < 0 || workers[i].epfd < 0) {
+      perror("Error Starting Workers");
+      return EXIT_FAILURE;
+    }
+  }
+
+  for (i = 0; i < num_workers; i++) {
+    if (pthread_create(&workers[i].thread, NULL,
+                       use_uring ? serve_uring : serve_epoll, &workers[i])) {
+      fprintf(stderr, "Error Starting Worker %d\n", i);
+      return EXIT_FAILURE;
+    }
+  }
+
+  while (sigwait(&sigs, &sig) == 0 && sig == SIGUSR1)
+    print_workers(workers, num_workers);
+
+  eventfd_write(stopfd, 1);
+  for (i = 0; i < num_workers; i++)
+    pthread_join(workers[i].thread, NULL);
+
+  print_workers(workers, num_workers);
+
+  for (i = 0; i < num_workers; i++) {
+    close(workers[i].epfd);
+    if (port > 0)
+      close(workers[i].listenfd);
+  }
+  if (shared >= 0) {
+    close(shared);
+    unlink(SOCKET_ADDRESS);
+  }
+  close(stopfd);
+  free(workers);
+  return EXIT_SUCCESS;
+}
+
+void
+usage (char *prog)
+{
+  fprintf(stderr, "Usage: %s [-e|-u [-f] [-w WORKERS]] [-t PORT]\n", prog);
+  fprintf(stderr, "  -e  serve many clients at once with epoll until "
+          "interrupted,\n      SIGUSR1 prints the counters\n");
+  fprintf(stderr, "  -u  like -e but with io_uring, or epoll if the kernel "
+          "can not\n");
+  fprintf(stderr, "  -f  requests are frames: a 4 byte big endian length "
+          "then that many bytes\n");
+  fprintf(stderr, "  -w  number of threads, each with its own epoll loop "
+          "(default 1)\n");
+  fprintf(stderr, "  -t  listen on a TCP loopback port instead of %s\n",
+          SOCKET_ADDRESS);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+  int handshake_sockfd, ret, opt;
+  int use_epoll = 0, port = 0, num_workers = 1;
+  struct rlimit rl;
+
+  while ((opt = getopt(argc, argv, "euft:w:")) != -1) {
+    switch (opt) {
+    case 'e':
+      use_epoll = 1;
+      break;
+    case 'u':
+      use_epoll = 1;
+      use_uring = 1;
+      break;
+    case 'f':
+      framed = 1;
+      break;
+    case 'w':
+      num_workers = atoi(optarg);
+      if (num_workers < 1 || num_workers > MAX_WORKERS)
+        usage(argv[0]);
+      break;
+    case 't':
+      port = atoi(optarg);
+      if (port <= 0 || port > 65535)
+        usage(argv[0]);
       break;
+    default:
+      usage(argv[0]);
     }
-    printf("RECEIVED:\n%s", buf);
-    convert_string(buf);
-    write(session_sockfd, buf, BSIZE);
-    printf("SENDING:\n%s\n", buf);
   }
 
-  close(session_sockfd);
-  close(handshake_sockfd);
+  if ((framed || num_workers > 1) && !use_epoll)
+    usage(argv[0]);
+
+  if (!use_epoll) {
+    handshake_sockfd = make_listener(port, QSIZE, 0, 0);
+    if (handshake_sockfd < 0)
+      return EXIT_FAILURE;
+    ret = serve_one(handshake_sockfd);
+    close(handshake_sockfd);
+    return ret;
+  }
+
+  /*
+   * Every client costs a descriptor, so allow as many as the hard
+   * limit does. Writing to a client that has gone away should close
+   * that connection, not kill the server.
+   */
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  if (use_uring && !uring_usable()) {
+    fprintf(stderr, "io_uring is not available (%s), using epoll\n",
+            strerror(errno));
+    use_uring = 0;
+  }
 
+  return serve_workers(port, num_workers);
 }